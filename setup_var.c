@@ -23,19 +23,23 @@
 #include <grub/types.h>
 #include <grub/dl.h>
 #include <grub/misc.h>
+#include <grub/mm.h>
 #include <grub/command.h>
 #include <grub/file.h>
+#include <grub/disk.h>
+#include <grub/partition.h>
+#include <grub/time.h>
 #include <grub/efi/efi.h>
 #include <grub/pci.h>
 
+#include "setup_var.h"
+
 #define INSYDE_SETUP_VAR			((grub_efi_char16_t*)"S\0e\0t\0u\0p\0\0\0")
 #define INSYDE_SETUP_VAR_NSIZE		(12)
 #define INSYDE_CUSTOM_VAR			((grub_efi_char16_t*)"C\0u\0s\0t\0o\0m\0\0\0")
 #define INSYDE_CUSTOM_VAR_NSIZE		(14)
-#define INSYDE_SETUP_VAR_SIZE		(0x2bc)
 #define INSYDE_SETUP_VAR_GUID		{ 0xa04a27f4, 0xdf00, 0x4d42, { 0xb5, 0x52, 0x39, 0x51, 0x13, 0x02, 0x11, 0x3d } }
 #define MAX_VARIABLE_SIZE			(1024)
-#define MAX_VAR_DATA_SIZE			(65536)
 
 #define CMDNAME_SETUP_VAR2			("setup_var2")
 #define CMDCHECK_SETUP_VAR2			(9)
@@ -52,446 +56,4003 @@
 
 #define SETUP_VAR_SIZE_THRESHOLD (0x10)
 
+#define SETUP_VAR_OUT_BUF_SIZE	(1024)
+#define SETUP_VAR_INDEX_BUCKETS	(256)
+#define SETUP_VAR_QUESTION_BUCKETS	(1024)
+#define SETUP_VAR_MAX_PATTERN_SIZE	(64)
+#define SETUP_VAR_FIND_MAX_MATCHES	(100)
+/* Room a write is assumed to take in the store on top of the name and data,
+ * an authenticated EDK2 variable header being 60 bytes */
+#define SETUP_VAR_HEADER_OVERHEAD	(0x40)
+
+#define SETUP_VAR_SNAPSHOT_MAGIC	("SVSNAP01")
+#define SETUP_VAR_FINGERPRINT_MAGIC	("SVFPRT01")
+/* setup_var_fingerprint --contents: each record carries the variable data */
+#define SETUP_VAR_FINGERPRINT_CONTENTS	(0x1)
+
 GRUB_MOD_LICENSE("GPLv3+");
 
+/* In-memory index of the variable store. It is built by a single
+ * get_next_variable_name pass on the first command that needs it and reused
+ * by every later setup_var* and lsefivar call. Sizes are probed lazily, so
+ * building the index itself costs no get_variable calls. Entries are also
+ * chained into a hash table keyed by name, so lookups don't walk the whole
+ * store. */
+struct setup_var_index_entry
+{
+    grub_efi_char16_t* name;
+    grub_efi_uintn_t name_size;
+    grub_efi_guid_t guid;
+    grub_efi_uintn_t size;
+    grub_efi_uint32_t attr;
+    int size_known;
+    grub_uint32_t hash;
+    /* position + 1 of the previous entry in the same bucket, 0 ends the chain */
+    grub_size_t hash_next;
+};
+
+static struct setup_var_index_entry* var_index = NULL;
+static grub_size_t var_index_count = 0;
+static grub_size_t var_index_capacity = 0;
+static int var_index_valid = 0;
+/* position + 1 of the last entry added to each bucket */
+static grub_size_t var_index_buckets[SETUP_VAR_INDEX_BUCKETS];
+
+/* A varstore name to look up, with its hash computed once. */
+struct setup_var_key
+{
+    const grub_efi_char16_t* name;
+    grub_efi_uintn_t name_size;
+    grub_uint32_t hash;
+};
+
+/* A varstore loaded for editing. Outside of a setup_var_begin session it only
+ * lives for one command and is written back right away. Inside a session it
+ * is kept in the shadows list, later commands read and modify the staged copy
+ * and setup_var_commit writes each dirty varstore with a single SetVariable. */
+struct setup_var_shadow
+{
+    struct setup_var_shadow* next;
+    grub_efi_char16_t* name;
+    grub_efi_uintn_t name_size;
+    grub_efi_guid_t guid;
+    grub_efi_uint32_t attr;
+    grub_efi_uintn_t size;
+    grub_uint8_t* data;
+    /* contents as last read from or written to the firmware */
+    grub_uint8_t* orig;
+    int pooled;
+    int dirty;
+};
+
+static struct setup_var_shadow* shadows = NULL;
+static int session_active = 0;
+
+/* Scratch buffer shared by all commands. A varstore read outside a session
+ * only lives for one command, so its working and original copies are carved
+ * out of this buffer instead of being allocated every time. It only grows. */
+static grub_uint8_t* var_pool = NULL;
+static grub_size_t var_pool_size = 0;
+static int var_pool_busy = 0;
+
+/* Word type for comparing buffers a machine word at a time. */
+typedef grub_addr_t __attribute__ ((__may_alias__)) setup_var_word_t;
+#define SETUP_VAR_MAX_PRINTED_RANGES (16)
+
+/* Console output is collected in out_buf and handed to the terminal a block
+ * at a time. Every grub_printf call goes through the terminal layer, which
+ * is slow on serial consoles, so per-character and per-field printing made
+ * long listings crawl. */
+static char out_buf[SETUP_VAR_OUT_BUF_SIZE + 1];
+static grub_size_t out_len = 0;
+
+/* Set by a leading --quiet, suppresses the banners and progress messages. */
+static int quiet = 0;
+
+static void
+out_flush (void)
+{
+    if (out_len == 0)
+        return;
+    out_buf[out_len] = 0;
+    grub_xputs(out_buf);
+    out_len = 0;
+}
+
+static void
+out_putc (char c)
+{
+    if (out_len == SETUP_VAR_OUT_BUF_SIZE)
+        out_flush();
+    out_buf[out_len++] = c;
+}
+
+static void
+out_vprintf (const char* fmt, va_list args)
+{
+    va_list copy;
+    grub_size_t len;
+
+    va_copy(copy, args);
+    len = grub_vsnprintf(out_buf + out_len, SETUP_VAR_OUT_BUF_SIZE + 1 - out_len, fmt, copy);
+    va_end(copy);
+    if (out_len + len < SETUP_VAR_OUT_BUF_SIZE)
+    {
+        out_len += len;
+        return;
+    }
+
+    /* possibly truncated, retry with the whole buffer */
+    out_flush();
+    va_copy(copy, args);
+    len = grub_vsnprintf(out_buf, SETUP_VAR_OUT_BUF_SIZE + 1, fmt, copy);
+    va_end(copy);
+    if (len < SETUP_VAR_OUT_BUF_SIZE)
+    {
+        out_len = len;
+        return;
+    }
+    grub_vprintf(fmt, args);
+}
+
+static void out_printf (const char* fmt, ...) __attribute__ ((format (GNU_PRINTF, 1, 2)));
+
+static void
+out_printf (const char* fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    out_vprintf(fmt, args);
+    va_end(args);
+}
+
+/* Like out_printf, but for messages that --quiet suppresses. */
+static void out_info (const char* fmt, ...) __attribute__ ((format (GNU_PRINTF, 1, 2)));
+
+static void
+out_info (const char* fmt, ...)
+{
+    va_list args;
+
+    if (quiet)
+        return;
+    va_start(args, fmt);
+    out_vprintf(fmt, args);
+    va_end(args);
+}
+
 void print_varname(grub_efi_char16_t* str);
 
 void print_varname(grub_efi_char16_t* str)
 {
     while(*str != 0x0)
     {
-        grub_printf("%c", (grub_uint8_t) *str);
+        out_putc((grub_uint8_t) *str);
         str++;
     }
 }
 
-grub_uint64_t pack_data(grub_uint8_t* data, grub_uint16_t offset, grub_uint16_t size);
+grub_uint64_t pack_data(grub_uint8_t* data, grub_uint32_t offset, grub_uint16_t size);
 
-grub_uint64_t pack_data(grub_uint8_t* data, grub_uint16_t offset, grub_uint16_t size)
+grub_uint64_t pack_data(grub_uint8_t* data, grub_uint32_t offset, grub_uint16_t size)
 {
     grub_uint64_t res = 0, buf = 0;
-    for (int i = offset + size - 1; i >= offset; --i) {
-	buf = data[i];
-        res += buf << 8 * (i - offset);
+    for (grub_uint16_t i = 0; i < size; ++i) {
+        buf = data[offset + i];
+        res += buf << 8 * i;
     }
     return res;
 }
 
-void set_data(grub_uint8_t* data, grub_uint16_t offset, grub_uint16_t size, grub_uint64_t value);
+void set_data(grub_uint8_t* data, grub_uint32_t offset, grub_uint16_t size, grub_uint64_t value);
 
-void set_data(grub_uint8_t* data, grub_uint16_t offset, grub_uint16_t size, grub_uint64_t value)
+void set_data(grub_uint8_t* data, grub_uint32_t offset, grub_uint16_t size, grub_uint64_t value)
 {
-    for (int i = offset; i < offset + size; ++i) {
-        data[i] = (value >> 8 * (i - offset)) & 0xFF;
+    for (grub_uint16_t i = 0; i < size; ++i) {
+        data[offset + i] = (value >> 8 * i) & 0xFF;
     }
 }
 
-static grub_err_t
-grub_cmd_setup_var (grub_command_t cmd,
-           int argc, char *argv[])
+/* Convert an ASCII varstore name to the NUL-terminated UCS-2 form used by the
+ * runtime services. The size in bytes, terminator included, is returned in
+ * name_size. */
+static grub_efi_char16_t*
+varname_from_ascii (const char* str, grub_efi_uintn_t* name_size)
 {
-    grub_efi_status_t status;
-    grub_efi_guid_t setup_var_guid = INSYDE_SETUP_VAR_GUID;
-    grub_efi_guid_t guid;
-    grub_uint8_t tmp_data[MAX_VAR_DATA_SIZE];
-    grub_uint16_t offset = 0x1af;
-    grub_efi_uintn_t setup_var_size = INSYDE_SETUP_VAR_SIZE;
-    grub_uint8_t set_value = 0x0;
-    grub_efi_uint32_t setup_var_attr = 0x7;
-    const char* endptr;
-
-    grub_uint16_t var_size = 0;
-    grub_efi_char16_t* custom_varname = NULL;
-    grub_efi_uintn_t custom_varname_size = 0;
-
-    grub_efi_char16_t name[MAX_VARIABLE_SIZE/2];
-    grub_efi_uintn_t name_size;
+    grub_size_t len = grub_strlen(str) + 1;
+    grub_efi_char16_t* name = grub_malloc(len * sizeof(grub_efi_char16_t));
 
-    grub_uint16_t isMode2 = 0;
-    grub_uint16_t isMode3 = 0;
-    grub_uint16_t isModeVS = 0;
-    grub_uint16_t isModeCV = 0;
-    if (cmd->name[CMDCHECK_SETUP_VAR2] == '2') isMode2 = 1;
-    if (grub_strlen(cmd->name) > CMDCHECK_SETUP_DVARS_START_INDEX && cmd->name[CMDCHECK_SETUP_DVARS_START_INDEX] != 0)
-    {
-        char name_suffix[11];
-        grub_strncpy(name_suffix, cmd->name + CMDCHECK_SETUP_DVARS_START_INDEX, 10);
-        if (!grub_strcmp(name_suffix, CMDCHECK_SETUP_VAR3))
-            isMode3 = 1;
-        else if (!grub_strcmp(name_suffix, CMDCHECK_SETUP_VAR_VS))
-            isModeVS = 1;
-        else if (!grub_strcmp(name_suffix, CMDCHECK_SETUP_VAR_CV))
-            isModeCV = 1;
-    }
+    if (!name)
+        return NULL;
+    for (grub_size_t i = 0; i < len; ++i)
+        name[i] = (grub_uint8_t) str[i];
+    *name_size = len * sizeof(grub_efi_char16_t);
+    return name;
+}
 
-    if (argc == 0)
+static int
+parse_hex_digits (const char** str, grub_size_t count, grub_uint64_t* value)
+{
+    *value = 0;
+    for (grub_size_t i = 0; i < count; ++i)
     {
-        grub_printf(
-                "Hello!\n"
-        );
-        grub_printf(
-                "You may brick your InsydeH2o based laptop and need to send it in\n"
-        );
-        grub_printf(
-                "for repair.\n"
-        );
-        grub_printf(
-                "Some vendors (like Sony) are rather slow, and it could get expensive if they\n"
-        );
-        grub_printf(
-                "discover that you used this or similar tools.\nYou should be  *very*  sure what you do.\n"
-        );
-        grub_printf(
-                "\n\nThis Setup variable modification tool may only work with current (July 2009)\n"
-        );
-        grub_printf(
-                "Insyde H2o based firmware releases. Vendors may decide to lock the EFI\n"
-        );
-        grub_printf(
-                "environment completely out or introduce other security measures.\n"
-        );
-        grub_printf(
-                "Final warning: YOU MAY BRICK YOUR LAPTOP IF YOU USE THIS TOOL - I TAKE  N O \n"
-        );
-        grub_printf(
-                "RESPONSIBILITY FOR  Y O U R  ACTIONS.\n"
-        );
-        if (isMode3 || isModeVS || isModeCV)
-            grub_printf(
-                    "\n\n(c) 2009 by Bernhard Froemel <bfroemel@gmail.com>\n(c) 2021 by datasone <datasone@datasone.moe>\n"
-            );
+        char c = grub_tolower(**str);
+        if (c >= '0' && c <= '9')
+            *value = (*value << 4) | (grub_uint64_t) (c - '0');
+        else if (c >= 'a' && c <= 'f')
+            *value = (*value << 4) | (grub_uint64_t) (c - 'a' + 10);
         else
-            grub_printf(
-                    "\n\n(c) 2009 by Bernhard Froemel <bfroemel@gmail.com>\n"
-            );
+            return 0;
+        (*str)++;
     }
+    return 1;
+}
 
-    name[0] = 0x0;
+/* Parse a GUID as printed in IFR dumps, e.g.
+ * D1405D16-7AFC-4695-BB12-41459D3695A2, optionally enclosed in brackets or
+ * braces. Returns 0 if str is not a GUID. */
+static int
+parse_guid (const char* str, grub_efi_guid_t* guid)
+{
+    grub_uint64_t value;
+    char close = 0;
 
-    if (isModeCV)
+    if (*str == '[')
+        close = ']';
+    else if (*str == '{')
+        close = '}';
+    if (close)
+        str++;
+
+    if (!parse_hex_digits(&str, 8, &value) || *str++ != '-')
+        return 0;
+    guid->data1 = value;
+    if (!parse_hex_digits(&str, 4, &value) || *str++ != '-')
+        return 0;
+    guid->data2 = value;
+    if (!parse_hex_digits(&str, 4, &value) || *str++ != '-')
+        return 0;
+    guid->data3 = value;
+    for (int i = 0; i < 8; ++i)
     {
-        int varname_size = grub_strlen(argv[0]) + 1;
-        custom_varname = (grub_efi_char16_t*) grub_malloc(varname_size * sizeof(grub_efi_char16_t));
-        for (int i = 0; i < varname_size; ++i)
-            custom_varname[i] = argv[0][i];
-        custom_varname_size = varname_size * 2;
-        grub_printf("Looking for %s variable...\n", argv[0]);
+        if (i == 2 && *str++ != '-')
+            return 0;
+        if (!parse_hex_digits(&str, 2, &value))
+            return 0;
+        guid->data4[i] = value;
     }
-    else
+
+    if (close && *str++ != close)
+        return 0;
+    return *str == 0;
+}
+
+static int
+parse_hex_arg (const char* str, grub_uint64_t* value)
+{
+    const char* endptr;
+
+    grub_errno = 0;
+    *value = grub_strtoull(str, &endptr, 16);
+    if (endptr == str || *endptr != 0 || grub_errno != 0)
     {
-        /* scan for Setup variable */
-        grub_printf("Looking for Setup variable...\n");
+        grub_errno = 0;
+        return 0;
     }
+    return 1;
+}
 
-    do
-    {
-        name_size = MAX_VARIABLE_SIZE;
-        status = efi_call_3(grub_efi_system_table->runtime_services->get_next_variable_name,
-        &name_size,
-        name,
-        &guid);
+/* Decode a hex command argument for a field that holds at most max. Values
+ * that don't fit are refused instead of being truncated. position names the
+ * argument in the messages, e.g. "second". */
+static grub_err_t
+parse_hex_field (const char* str, grub_uint64_t max, const char* position, const char* example,
+                 grub_uint64_t* value)
+{
+    if (!parse_hex_arg(str, value))
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode your %s argument. Please provide a hex value (e.g. %s).",
+                          position, example);
+    if (*value > max)
+        return grub_error(GRUB_ERR_OUT_OF_RANGE, "your %s argument is too large, it can be at most 0x%llx.",
+                          position, (unsigned long long) max);
+    return GRUB_ERR_NONE;
+}
 
-        if(status == GRUB_EFI_NOT_FOUND)
-        { /* finished traversing VSS */
-            break;
-        }
+/* Decode the size of a value, which pack_data and set_data limit to 8 bytes. */
+static grub_err_t
+parse_size_arg (const char* str, const char* position, grub_uint16_t* size)
+{
+    grub_uint64_t value;
 
-        if(status)
-        {
-            grub_printf("status: 0x%02x\n", (grub_uint32_t) status);
-        }
+    if (parse_hex_field(str, sizeof(grub_uint64_t), position, "0x01", &value))
+        return grub_errno;
+    if (value == 0)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "your %s argument must be between 0x01 and 0x08.", position);
+    *size = value;
+    return GRUB_ERR_NONE;
+}
 
-        if(! status && (
-                (!isModeCV && name_size == INSYDE_SETUP_VAR_NSIZE && 0 == grub_memcmp(name, INSYDE_SETUP_VAR, name_size)) ||
-                (isMode2 && name_size == INSYDE_CUSTOM_VAR_NSIZE && 0 == grub_memcmp(name, INSYDE_CUSTOM_VAR, name_size)) ||
-                (isModeCV && name_size == custom_varname_size && 0 == grub_memcmp(name, custom_varname, name_size))
-                ))
-        {
-            grub_printf("var name: ");
-            print_varname(name);
-            grub_printf(", var size: %u, var guid: %08x-%04x-%04x - %02x-%02x-%02x-%02x-%02x-%02x-%02x-%02x\n\n",
-            (grub_uint32_t) name_size,
-            guid.data1,
-            guid.data2,
-            guid.data3,
-            guid.data4[0], guid.data4[1], guid.data4[2], guid.data4[3], guid.data4[4], guid.data4[5], guid.data4[6], guid.data4[7]
-            );
+/* Largest value a field of size bytes holds. */
+static grub_uint64_t
+field_max (grub_uint16_t size)
+{
+    if (size >= sizeof(grub_uint64_t))
+        return ~(grub_uint64_t) 0;
+    return ((grub_uint64_t) 1 << (8 * size)) - 1;
+}
 
-            if(grub_memcmp(&guid, &setup_var_guid, sizeof(grub_efi_guid_t)) == 0)
-            {
-                grub_printf("--> GUID matches expected GUID\n");
-            }
-            else
-            {
-                grub_printf("--> GUID does not match expected GUID, taking it nevertheless...\n");
-                grub_memcpy(&setup_var_guid, &guid, sizeof(grub_efi_guid_t));
-            }
+/* Whether size bytes at offset lie within a varstore of var_size bytes.
+ * Written so that it can't wrap, even where UINTN is 32 bits. */
+static int
+range_fits (grub_uint64_t offset, grub_uint64_t size, grub_uint64_t var_size)
+{
+    return offset <= var_size && size <= var_size - offset;
+}
 
-            /* obtain current contents of Setup variable */
-            if(argc >= 1 && argc < 3 + (isModeVS) + (isModeCV * 2))
-            {
-                if (isModeCV)
-                {
-                    grub_errno = 0;
-                    offset = grub_strtoul(argv[1], &endptr, 16);
-                    if(endptr == argv[1] || grub_errno != 0)
-                    {
-                        return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode your second argument. Please provide a hex value (e.g. 0x1af).");
-                    }
-                }
-                else
-                {
-                    grub_errno = 0;
-                    offset = grub_strtoul(argv[0], &endptr, 16);
-                    if(endptr == argv[0] || grub_errno != 0)
-                    {
-                        return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode your first argument. Please provide a hex value (e.g. 0x1af).");
-                    }
-                }
-                status = efi_call_5(grub_efi_system_table->runtime_services->get_variable,
-                    name,
-                    &setup_var_guid,
-                    &setup_var_attr,
-                    &setup_var_size,
-                    tmp_data);
-                if(status == GRUB_EFI_BUFFER_TOO_SMALL)
-                {
-                    grub_printf("expected a different size of the Setup variable (got %d (0x%x) bytes). Continue with care...\n", (int)setup_var_size, (int)setup_var_size);
-                    status = efi_call_5(grub_efi_system_table->runtime_services->get_variable,
-                    name,
-                    &setup_var_guid,
-                    &setup_var_attr,
-                    &setup_var_size,
-                    tmp_data);
-                }
-                if(status)
-                {
-                    return grub_error(GRUB_ERR_INVALID_COMMAND, "can't get variable using efi (error: 0x%016lx)", status);
-                }
-		if (isModeCV)
-		{
-                    grub_printf("successfully obtained \"%s\" variable from VSS (got %d (0x%x) bytes).\n", argv[0], (int)setup_var_size, (int)setup_var_size);
-		}
-		else
-		{
-		    grub_printf("successfully obtained \"Setup\" variable from VSS (got %d (0x%x) bytes).\n", (int)setup_var_size, (int)setup_var_size);
-		}
-                if(offset > setup_var_size)
-                {
-                    /* When in newly added modes and the Setup variable size is too small(smaller than threshold, 0x10 here), supress the error and continue to the next Setup variable */
-                    if ((isMode3) && setup_var_size < SETUP_VAR_SIZE_THRESHOLD)
-                    {
-                        grub_printf("Too small variable detected, ignoring.\n\n");
-                        continue;
-                    }
-                    return grub_error(GRUB_ERR_BAD_ARGUMENT, "offset is out of range.");
-                }
-                if (argc == 2 && isModeVS) // VS with only size param
-                {
-                    var_size = grub_strtoul(argv[1], &endptr, 16);
-                    if(endptr == argv[1] || grub_errno != 0)
-                    {
-                        return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode your second argument. Please provide a hex value (e.g. 0x01).");
-                    }
-                    grub_printf("offset 0x%02x is: 0x%02lx\n", offset, pack_data(tmp_data, offset, var_size));
-                }
-                else if (argc == 3 && isModeCV) // CV with only size param
-                {
-                    var_size = grub_strtoul(argv[2], &endptr, 16);
-                    if(endptr == argv[2] || grub_errno != 0)
-                    {
-                        return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode your third argument. Please provide a hex value (e.g. 0x01).");
-                    }
-                    grub_printf("offset 0x%02x is: 0x%02lx\n", offset, pack_data(tmp_data, offset, var_size));
-                }
-                else
-                    grub_printf("offset 0x%02x is: 0x%02x\n", offset, tmp_data[offset]);
-            }
-            /* modify and write Setup variable, if user requests it (old commands) */
-            if((argc == 2) && !(isModeVS || isModeCV))
-            {
-                set_value = grub_strtoul(argv[1], &endptr, 16);
-                if(endptr == argv[1] || grub_errno != 0)
-                {
-                    return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode your second argument. Please provide a hex value (e.g. 0x01).");
-                }
-                grub_printf("setting offset 0x%02x to 0x%02x\n", offset, set_value);
-                tmp_data[offset] = set_value;
-                status = efi_call_5(grub_efi_system_table->runtime_services->set_variable,
-                    name,
-                    &setup_var_guid,
-                    setup_var_attr,
-                    setup_var_size,
-                    tmp_data);
-                if(status)
-                {
-                    return grub_error(GRUB_ERR_INVALID_COMMAND, "can't set variable using efi (error: 0x%016lx)", status);
-                }
-            }
-            else if (isModeVS)
-            {
-                if (argc == 3) // VS with size and setval
-                {
-                    var_size = grub_strtoul(argv[1], &endptr, 16);
-                    grub_uint64_t larger_set_value = grub_strtoull(argv[2], &endptr, 16);
-                    if (endptr == argv[2] || grub_errno != 0)
-                    {
-                        return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode your third argument. Please provide a hex value (e.g. 0x01).");
-                    }
-                    grub_printf("setting offset 0x%02x to 0x%02lx\n", offset, larger_set_value);
-                    set_data(tmp_data, offset, var_size, larger_set_value);
-                    status = efi_call_5(grub_efi_system_table->runtime_services->set_variable,
-                                        name,
-                                        &setup_var_guid,
-                                        setup_var_attr,
-                                        setup_var_size,
-                                        tmp_data);
-                    if(status)
-                    {
-                        return grub_error(GRUB_ERR_INVALID_COMMAND, "can't set variable using efi (error: 0x%016lx)", status);
-                    }
-                }
-            }
-            else if (isModeCV)
-            {
-                if (argc == 4) // CV with size and setval
-                {
-                    var_size = grub_strtoul(argv[2], &endptr, 16);
-                    grub_uint64_t larger_set_value = grub_strtoull(argv[3], &endptr, 16);
-                    if (endptr == argv[3] || grub_errno != 0)
-                    {
-                        return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode your fourth argument. Please provide a hex value (e.g. 0x01).");
-                    }
-                    grub_printf("setting offset 0x%02x to 0x%02lx\n", offset, larger_set_value);
-                    set_data(tmp_data, offset, var_size, larger_set_value);
-                    status = efi_call_5(grub_efi_system_table->runtime_services->set_variable,
-                                        name,
-                                        &setup_var_guid,
-                                        setup_var_attr,
-                                        setup_var_size,
-                                        tmp_data);
-                    if(status)
-                    {
-                        return grub_error(GRUB_ERR_INVALID_COMMAND, "can't set variable using efi (error: 0x%016lx)", status);
-                    }
-                }
-            }
-        }
-    } while (! status);
+/* Per-service call statistics, shown by setup_var_stats. Some firmware is
+ * very slow at enumeration or at SetVariable when it has to reclaim space. */
+enum
+{
+    SERVICE_GET_NEXT_VARIABLE_NAME,
+    SERVICE_GET_VARIABLE,
+    SERVICE_SET_VARIABLE,
+    SERVICE_QUERY_VARIABLE_INFO,
+    SERVICE_COUNT
+};
 
-    if(argc == 0 || argc > 2 + (isModeVS) + (isModeCV * 2))
-    {
-        if (isModeVS)
-            return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s offset [size] [setval]", cmd->name);
-        if (isModeCV)
-            return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s varstorename offset [size] [setval]", cmd->name);
-        return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s offset [setval]", cmd->name);
-    }
+struct setup_var_service_stats
+{
+    grub_uint64_t calls;
+    grub_uint64_t errors;
+    /* calls that returned EFI_BUFFER_TOO_SMALL, i.e. size probes and retries */
+    grub_uint64_t too_small;
+    grub_uint64_t bytes;
+    grub_uint64_t total_ms;
+    grub_uint64_t max_ms;
+};
 
-    grub_free(custom_varname);
-    return grub_errno;
+static const char* const service_names[SERVICE_COUNT] =
+{
+    "GetNextVariableName",
+    "GetVariable",
+    "SetVariable",
+    "QueryVariableInfo",
+};
+
+static struct setup_var_service_stats service_stats[SERVICE_COUNT];
+/* SetVariable calls saved because the contents were unchanged */
+static grub_uint64_t writes_skipped;
+
+static void
+service_account (int service, grub_uint64_t start, grub_efi_status_t status, grub_efi_uintn_t bytes)
+{
+    struct setup_var_service_stats* stats = &service_stats[service];
+    grub_uint64_t elapsed = grub_get_time_ms() - start;
+
+    stats->calls++;
+    stats->total_ms += elapsed;
+    if (elapsed > stats->max_ms)
+        stats->max_ms = elapsed;
+    if (status == GRUB_EFI_BUFFER_TOO_SMALL)
+        stats->too_small++;
+    else if (status == GRUB_EFI_SUCCESS)
+        stats->bytes += bytes;
+    else if (!(service == SERVICE_GET_NEXT_VARIABLE_NAME && status == GRUB_EFI_NOT_FOUND))
+        /* NOT_FOUND is how enumeration ends, not an error */
+        stats->errors++;
 }
 
-static grub_err_t
-grub_cmd_lsefivar (grub_command_t cmd __attribute__ ((unused)),
-           int argc __attribute__ ((unused)), char *argv[] __attribute__ ((unused)))
+static grub_efi_status_t
+efi_get_next_variable_name (grub_efi_uintn_t* name_size, grub_efi_char16_t* name, grub_efi_guid_t* guid)
+{
+    return efi_call_3(grub_efi_system_table->runtime_services->get_next_variable_name,
+                      name_size, name, guid);
+}
+
+static grub_efi_status_t
+efi_get_variable (grub_efi_char16_t* name, const grub_efi_guid_t* guid, grub_efi_uint32_t* attr,
+                  grub_efi_uintn_t* size, void* data)
+{
+    return efi_call_5(grub_efi_system_table->runtime_services->get_variable,
+                      name, (grub_efi_guid_t*) guid, attr, size, data);
+}
+
+static grub_efi_status_t
+efi_set_variable (grub_efi_char16_t* name, const grub_efi_guid_t* guid, grub_efi_uint32_t attr,
+                  grub_efi_uintn_t size, void* data)
+{
+    return efi_call_5(grub_efi_system_table->runtime_services->set_variable,
+                      name, (grub_efi_guid_t*) guid, attr, size, data);
+}
+
+static grub_efi_status_t
+efi_query_variable_info (grub_efi_uint32_t attr, grub_efi_uint64_t* max_storage,
+                         grub_efi_uint64_t* remaining, grub_efi_uint64_t* max_size)
+{
+    grub_efi_runtime_services_t* rt = grub_efi_system_table->runtime_services;
+
+    /* QueryVariableInfo only exists since UEFI 2.0 */
+    if (rt->hdr.revision < (2 << 16))
+        return GRUB_EFI_UNSUPPORTED;
+    return efi_call_4(rt->query_variable_info, attr, max_storage, remaining, max_size);
+}
+
+static const struct setup_var_backend efi_backend =
+{
+    "EFI runtime services",
+    efi_get_next_variable_name,
+    efi_get_variable,
+    efi_set_variable,
+    efi_query_variable_info,
+    NULL,
+};
+
+static const struct setup_var_backend* backend = &efi_backend;
+
+/* All variable accesses go through these, which add the statistics on top of
+ * the backend. */
+static grub_efi_status_t
+rt_get_next_variable_name (grub_efi_uintn_t* name_size, grub_efi_char16_t* name, grub_efi_guid_t* guid)
 {
+    grub_uint64_t start = grub_get_time_ms();
     grub_efi_status_t status;
-    grub_efi_guid_t guid;
-    grub_uint8_t tmp_data[MAX_VAR_DATA_SIZE];
-    grub_efi_uintn_t setup_var_size = INSYDE_SETUP_VAR_SIZE;
-    grub_efi_uint32_t setup_var_attr = 0x7;
 
-    grub_efi_char16_t name[MAX_VARIABLE_SIZE/2];
-    grub_efi_uintn_t name_size;
+    status = backend->get_next_variable_name(name_size, name, guid);
+    service_account(SERVICE_GET_NEXT_VARIABLE_NAME, start, status, *name_size);
+    return status;
+}
 
-    name[0] = 0x0;
-    /* scan for Setup variable */
-    grub_printf("Listing EFI variables...\n");
-    do
-    {
-        name_size = MAX_VARIABLE_SIZE;
-        status = efi_call_3(grub_efi_system_table->runtime_services->get_next_variable_name,
-        &name_size,
-        name,
-        &guid);
+static grub_efi_status_t
+rt_get_variable (grub_efi_char16_t* name, const grub_efi_guid_t* guid, grub_efi_uint32_t* attr,
+                 grub_efi_uintn_t* size, void* data)
+{
+    grub_uint64_t start = grub_get_time_ms();
+    grub_efi_status_t status;
 
-        if(status == GRUB_EFI_NOT_FOUND)
-        { /* finished traversing VSS */
-            break;
-        }
+    status = backend->get_variable(name, guid, attr, size, data);
+    service_account(SERVICE_GET_VARIABLE, start, status, *size);
+    return status;
+}
 
-        if(status)
-        {
-            grub_printf("status: 0x%02x\n", (grub_uint32_t) status);
-        }
-        if(! status)
-        {
-            setup_var_size = 1;
-            status = efi_call_5(grub_efi_system_table->runtime_services->get_variable,
-            name,
-            &guid,
-            &setup_var_attr,
-            &setup_var_size,
-            tmp_data);
-            if (status && status != GRUB_EFI_BUFFER_TOO_SMALL)
-            {
-                grub_printf("error (0x%x) getting var size:\n  ", (grub_uint32_t)status);
-                setup_var_size = 0;
-            }
-            status = 0;
+static grub_efi_status_t
+rt_set_variable (grub_efi_char16_t* name, const grub_efi_guid_t* guid, grub_efi_uint32_t attr,
+                 grub_efi_uintn_t size, void* data)
+{
+    grub_uint64_t start = grub_get_time_ms();
+    grub_efi_status_t status;
 
-            grub_printf("name size: %02u, var size: %06u (0x%06x), var guid: %08x-%04x-%04x - %02x-%02x-%02x-%02x-%02x-%02x-%02x-%02x, name: ",
-            (grub_uint32_t) name_size, (grub_uint32_t) setup_var_size, (grub_uint32_t) setup_var_size,
-            guid.data1,
-            guid.data2,
-            guid.data3,
-            guid.data4[0], guid.data4[1], guid.data4[2], guid.data4[3], guid.data4[4], guid.data4[5], guid.data4[6], guid.data4[7]
-            );
-            print_varname(name);
-            grub_printf("\n");
-        }
-    } while (! status);
+    status = backend->set_variable(name, guid, attr, size, data);
+    service_account(SERVICE_SET_VARIABLE, start, status, size);
+    return status;
+}
 
-    return grub_errno;
+static grub_efi_status_t
+rt_query_variable_info (grub_efi_uint32_t attr, grub_efi_uint64_t* max_storage,
+                        grub_efi_uint64_t* remaining, grub_efi_uint64_t* max_size)
+{
+    grub_uint64_t start = grub_get_time_ms();
+    grub_efi_status_t status;
+
+    status = backend->query_variable_info(attr, max_storage, remaining, max_size);
+    service_account(SERVICE_QUERY_VARIABLE_INFO, start, status, 0);
+    return status;
 }
 
+/* Set by a leading --force, writes even if they will make the firmware
+ * reclaim space. */
+static int force = 0;
 
-static grub_command_t cmd_setup_var;
-static grub_command_t cmd_setup_var2;
-static grub_command_t cmd_setup_var_3;
-static grub_command_t cmd_setup_var_vs;
-static grub_command_t cmd_setup_var_cv;
-static grub_command_t cmd_setup_lsvar;
+/* Check that the store has room for a write before making it. Firmware
+ * stores append the new copy of a variable and only mark the old one deleted,
+ * so a write needs room for a whole copy; without it SetVariable has to
+ * reclaim space first, which can take seconds and is the step that has
+ * bricked some Insyde boards. need is the room for all copies about to be
+ * written with attributes attr and largest the biggest of them. Sets and
+ * returns an error if the write should not be made. */
+static grub_err_t
+capacity_check (grub_efi_uint32_t attr, grub_uint64_t need, grub_efi_uintn_t largest)
+{
+    grub_efi_uint64_t max_storage;
+    grub_efi_uint64_t remaining;
+    grub_efi_uint64_t max_size;
 
-GRUB_MOD_INIT(setup_var)
+    if (rt_query_variable_info(attr, &max_storage, &remaining, &max_size))
+        /* nothing to go by, e.g. on pre-UEFI 2.0 firmware */
+        return GRUB_ERR_NONE;
+
+    out_info("variable store: 0x%llx of 0x%llx bytes free, largest variable 0x%llx bytes.\n",
+             (unsigned long long) remaining, (unsigned long long) max_storage, (unsigned long long) max_size);
+    if (largest > max_size)
+        return grub_error(GRUB_ERR_OUT_OF_RANGE, "variable too large for the store (need 0x%llx, at most 0x%llx)",
+                          (unsigned long long) largest, (unsigned long long) max_size);
+    if (need > remaining)
+    {
+        if (!force)
+            return grub_error(GRUB_ERR_OUT_OF_RANGE, "not enough variable store space (need 0x%llx, have 0x%llx), "
+                              "the firmware would have to reclaim space. Use --force to write anyway",
+                              (unsigned long long) need, (unsigned long long) remaining);
+        out_printf("warning: the write needs about 0x%llx bytes but only 0x%llx are free, writing anyway.\n",
+                   (unsigned long long) need, (unsigned long long) remaining);
+    }
+    else if (remaining - need < max_storage / 16)
+        out_printf("warning: the variable store is nearly full.\n");
+    return GRUB_ERR_NONE;
+}
+
+/* Drop the index, e.g. after a SetVariable that may have changed the set of
+ * variables. The next command rebuilds it. */
+static void
+index_invalidate (void)
 {
-    cmd_setup_var = grub_register_command ("setup_var", grub_cmd_setup_var,
-                    "setup_var offset [setval]",
-                    "Read/Write specific (byte) offset of setup variable.");
-    cmd_setup_var2 = grub_register_command ("setup_var2", grub_cmd_setup_var,
-                    "setup_var2 offset [setval]",
-                    "Read/Write specific (byte) offset of setup and custom variables.");
-    cmd_setup_var_3 = grub_register_command ("setup_var_3", grub_cmd_setup_var,
-                    "setup_var_3 offset [setval]",
-                    "Read/Write specific (byte) offset of setup variables ignoring error, use with great caution!!!");
-    cmd_setup_var_vs = grub_register_command ("setup_var_vs", grub_cmd_setup_var,
-                    "setup_var_vs offset [size] [setval]",
-                    "Read/write specific (byte) offset of setup variable, capable of longer value (specify with size).");
-    cmd_setup_var_cv = grub_register_command ("setup_var_cv", grub_cmd_setup_var,
-                    "setup_var_cv varstorename offset [size] [setval]",
-                    "Read/write specific (byte) offset of specified variable, capable of longer value (specify with size).");
-    cmd_setup_lsvar = grub_register_command ("lsefivar", grub_cmd_lsefivar,
-                    "lsefivar",
-                    "Lists all efi variables.");
+    for (grub_size_t i = 0; i < var_index_count; ++i)
+        grub_free(var_index[i].name);
+    grub_free(var_index);
+    var_index = NULL;
+    var_index_count = 0;
+    var_index_capacity = 0;
+    var_index_valid = 0;
+    grub_memset(var_index_buckets, 0, sizeof(var_index_buckets));
+}
+
+/* FNV-1a over the UCS-2 name, which includes its length through the
+ * terminating NUL. */
+static grub_uint32_t
+varname_hash (const grub_efi_char16_t* name, grub_efi_uintn_t name_size)
+{
+    const grub_uint8_t* p = (const grub_uint8_t*) name;
+    grub_uint32_t hash = 2166136261U;
+
+    for (grub_efi_uintn_t i = 0; i < name_size; ++i)
+        hash = (hash ^ p[i]) * 16777619U;
+    return hash;
+}
+
+static void
+key_init (struct setup_var_key* key, const grub_efi_char16_t* name, grub_efi_uintn_t name_size)
+{
+    key->name = name;
+    key->name_size = name_size;
+    key->hash = varname_hash(name, name_size);
+}
+
+static int
+key_matches (const struct setup_var_key* key, const struct setup_var_index_entry* entry)
+{
+    return entry->hash == key->hash && entry->name_size == key->name_size &&
+        0 == grub_memcmp(entry->name, key->name, key->name_size);
+}
+
+/* Position + 1 of the last indexed entry in the bucket of a key. Chains run
+ * from later to earlier entries. */
+static grub_size_t
+index_chain (const struct setup_var_key* key)
+{
+    return var_index_buckets[key->hash % SETUP_VAR_INDEX_BUCKETS];
+}
+
+static grub_err_t
+index_append (const grub_efi_char16_t* name, grub_efi_uintn_t name_size, const grub_efi_guid_t* guid)
+{
+    struct setup_var_index_entry* entry;
+
+    if (var_index_count == var_index_capacity)
+    {
+        grub_size_t new_capacity = var_index_capacity ? var_index_capacity * 2 : 64;
+        struct setup_var_index_entry* new_index = grub_realloc(var_index, new_capacity * sizeof(*var_index));
+        if (!new_index)
+            return grub_errno;
+        var_index = new_index;
+        var_index_capacity = new_capacity;
+    }
+
+    entry = &var_index[var_index_count];
+    entry->name = grub_malloc(name_size);
+    if (!entry->name)
+        return grub_errno;
+    grub_memcpy(entry->name, name, name_size);
+    entry->name_size = name_size;
+    grub_memcpy(&entry->guid, guid, sizeof(grub_efi_guid_t));
+    entry->size = 0;
+    entry->attr = 0;
+    entry->size_known = 0;
+    entry->hash = varname_hash(name, name_size);
+    entry->hash_next = var_index_buckets[entry->hash % SETUP_VAR_INDEX_BUCKETS];
+    var_index_count++;
+    var_index_buckets[entry->hash % SETUP_VAR_INDEX_BUCKETS] = var_index_count;
+    return GRUB_ERR_NONE;
+}
+
+/* Look up an already indexed variable without building the index. */
+static struct setup_var_index_entry*
+index_find (const grub_efi_char16_t* name, grub_efi_uintn_t name_size, const grub_efi_guid_t* guid)
+{
+    struct setup_var_key key;
+
+    if (!var_index_valid)
+        return NULL;
+    key_init(&key, name, name_size);
+    for (grub_size_t i = index_chain(&key); i; i = var_index[i - 1].hash_next)
+    {
+        if (key_matches(&key, &var_index[i - 1]) &&
+            0 == grub_memcmp(&var_index[i - 1].guid, guid, sizeof(grub_efi_guid_t)))
+            return &var_index[i - 1];
+    }
+    return NULL;
+}
+
+/* Find the indexed variable with the given name. The number of varstores
+ * sharing that name is returned in count, so callers can refuse to guess. */
+static struct setup_var_index_entry*
+index_find_name (const grub_efi_char16_t* name, grub_efi_uintn_t name_size, grub_size_t* count)
+{
+    struct setup_var_index_entry* found = NULL;
+    struct setup_var_key key;
+
+    *count = 0;
+    key_init(&key, name, name_size);
+    for (grub_size_t i = index_chain(&key); i; i = var_index[i - 1].hash_next)
+    {
+        if (key_matches(&key, &var_index[i - 1]))
+        {
+            /* the chain runs backwards, keep the earliest entry */
+            found = &var_index[i - 1];
+            (*count)++;
+        }
+    }
+    return found;
+}
+
+/* Find the entries matching any of a set of keys, in the order the firmware
+ * enumerated them. Returns a newly allocated array of positions, or NULL with
+ * count 0 if nothing matches. */
+static grub_size_t*
+index_find_keys (const struct setup_var_key* keys, grub_size_t key_count, grub_size_t* count)
+{
+    grub_size_t* found;
+    grub_size_t n = 0;
+
+    *count = 0;
+    for (grub_size_t k = 0; k < key_count; ++k)
+        for (grub_size_t i = index_chain(&keys[k]); i; i = var_index[i - 1].hash_next)
+            if (key_matches(&keys[k], &var_index[i - 1]))
+                n++;
+    if (n == 0)
+        return NULL;
+
+    found = grub_malloc(n * sizeof(*found));
+    if (!found)
+        return NULL;
+    for (grub_size_t k = 0; k < key_count; ++k)
+    {
+        /* skip keys repeating an earlier one, e.g. the same name twice */
+        grub_size_t d;
+        for (d = 0; d < k; ++d)
+            if (keys[d].name_size == keys[k].name_size &&
+                0 == grub_memcmp(keys[d].name, keys[k].name, keys[k].name_size))
+                break;
+        if (d < k)
+            continue;
+
+        for (grub_size_t i = index_chain(&keys[k]); i; i = var_index[i - 1].hash_next)
+        {
+            if (!key_matches(&keys[k], &var_index[i - 1]))
+                continue;
+            /* insertion sort, matches are few */
+            grub_size_t j = *count;
+            while (j > 0 && found[j - 1] > i - 1)
+            {
+                found[j] = found[j - 1];
+                j--;
+            }
+            found[j] = i - 1;
+            (*count)++;
+        }
+    }
+    return found;
+}
+
+static grub_err_t
+index_build (void)
+{
+    grub_efi_status_t status;
+    grub_efi_guid_t guid;
+    grub_efi_char16_t name[MAX_VARIABLE_SIZE/2];
+    grub_efi_uintn_t name_size;
+
+    index_invalidate();
+    name[0] = 0x0;
+    while (1)
+    {
+        name_size = MAX_VARIABLE_SIZE;
+        status = rt_get_next_variable_name(&name_size, name, &guid);
+
+        if(status == GRUB_EFI_NOT_FOUND)
+        { /* finished traversing VSS */
+            break;
+        }
+
+        if(status)
+        {
+            /* a partial index would make missing variables look absent */
+            index_invalidate();
+            return grub_error(GRUB_ERR_INVALID_COMMAND, "can't enumerate variables using efi (error: 0x%016lx)",
+                              status);
+        }
+
+        if (index_append(name, name_size, &guid))
+        {
+            index_invalidate();
+            return grub_errno;
+        }
+    }
+
+    var_index_valid = 1;
+    return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+index_ensure (void)
+{
+    if (var_index_valid)
+        return GRUB_ERR_NONE;
+    return index_build();
+}
+
+/* Ask the firmware for the size of a variable without reading its data. */
+static grub_efi_status_t
+var_probe_size (grub_efi_char16_t* name, const grub_efi_guid_t* guid, grub_efi_uint32_t* attr, grub_efi_uintn_t* size)
+{
+    grub_efi_status_t status;
+    grub_uint8_t probe;
+
+    *size = 0;
+    status = rt_get_variable(name, guid, attr, size, &probe);
+    if (status == GRUB_EFI_BUFFER_TOO_SMALL)
+        return GRUB_EFI_SUCCESS;
+    return status;
+}
+
+/* Fill in the size and attributes of an index entry, asking the firmware only
+ * the first time. */
+static grub_efi_status_t
+index_probe_size (struct setup_var_index_entry* entry)
+{
+    grub_efi_status_t status;
+    grub_efi_uintn_t size;
+    grub_efi_uint32_t attr = 0;
+
+    if (entry->size_known)
+        return GRUB_EFI_SUCCESS;
+
+    status = var_probe_size(entry->name, &entry->guid, &attr, &size);
+    if (status)
+        return status;
+
+    entry->size = size;
+    entry->attr = attr;
+    entry->size_known = 1;
+    return GRUB_EFI_SUCCESS;
+}
+
+/* Record the size and attributes seen by a successful GetVariable or
+ * SetVariable of an existing variable. Rewriting a variable does not change
+ * the set of variables, so the index stays valid. */
+static void
+index_update (struct setup_var_index_entry* entry, grub_efi_uint32_t attr, grub_efi_uintn_t size)
+{
+    entry->attr = attr;
+    entry->size = size;
+    entry->size_known = 1;
+}
+
+static grub_uint8_t*
+pool_reserve (grub_size_t size)
+{
+    if (size == 0)
+        size = 1;
+    if (size > var_pool_size)
+    {
+        grub_free(var_pool);
+        var_pool = grub_malloc(size);
+        if (!var_pool)
+        {
+            var_pool_size = 0;
+            return NULL;
+        }
+        var_pool_size = size;
+    }
+    return var_pool;
+}
+
+/* Get the working and original buffers of a varstore. Temporary copies use the
+ * shared pool; staged copies, which outlive the command, get their own. */
+static int
+shadow_alloc_buffers (struct setup_var_shadow* shadow, grub_efi_uintn_t size)
+{
+    grub_size_t span = ALIGN_UP(size, sizeof(setup_var_word_t));
+
+    if (!session_active && !var_pool_busy)
+    {
+        grub_uint8_t* buf = pool_reserve(2 * span);
+        if (!buf)
+            return 0;
+        shadow->data = buf;
+        shadow->orig = buf + span;
+        shadow->pooled = 1;
+        var_pool_busy = 1;
+        return 1;
+    }
+
+    shadow->data = grub_malloc(span ? span : 1);
+    shadow->orig = grub_malloc(span ? span : 1);
+    return shadow->data && shadow->orig;
+}
+
+static void
+shadow_free_buffers (struct setup_var_shadow* shadow)
+{
+    if (shadow->pooled)
+        var_pool_busy = 0;
+    else
+    {
+        grub_free(shadow->data);
+        grub_free(shadow->orig);
+    }
+    shadow->data = NULL;
+    shadow->orig = NULL;
+    shadow->pooled = 0;
+}
+
+static void
+shadow_free (struct setup_var_shadow* shadow)
+{
+    grub_free(shadow->name);
+    shadow_free_buffers(shadow);
+    grub_free(shadow);
+}
+
+/* Drop all staged varstores and close the session. */
+static void
+session_end (void)
+{
+    struct setup_var_shadow* next;
+
+    for (; shadows; shadows = next)
+    {
+        next = shadows->next;
+        shadow_free(shadows);
+    }
+    session_active = 0;
+}
+
+/* Read a varstore into exactly sized buffers. The size comes from the index
+ * or from a probe, so normally a single GetVariable reads the data. */
+static grub_efi_status_t
+shadow_load (struct setup_var_shadow* shadow)
+{
+    grub_efi_status_t status;
+    struct setup_var_index_entry* entry;
+    grub_efi_uintn_t size;
+
+    entry = index_find(shadow->name, shadow->name_size, &shadow->guid);
+    if (entry && entry->size_known)
+        size = entry->size;
+    else
+    {
+        status = var_probe_size(shadow->name, &shadow->guid, &shadow->attr, &size);
+        if (status)
+            return status;
+    }
+
+    for (int tries = 0; ; ++tries)
+    {
+        if (!shadow_alloc_buffers(shadow, size))
+            return GRUB_EFI_OUT_OF_RESOURCES;
+        shadow->size = size;
+        status = rt_get_variable(shadow->name, &shadow->guid, &shadow->attr, &shadow->size, shadow->data);
+        if (status != GRUB_EFI_BUFFER_TOO_SMALL || tries > 0)
+            break;
+        /* the variable grew since its size was recorded */
+        size = shadow->size;
+        shadow_free_buffers(shadow);
+    }
+    if (status)
+        return status;
+
+    grub_memcpy(shadow->orig, shadow->data, shadow->size);
+    if (entry)
+        index_update(entry, shadow->attr, shadow->size);
+    return GRUB_EFI_SUCCESS;
+}
+
+/* Get the contents of a varstore for reading or editing. Inside a session the
+ * staged copy is returned, so earlier edits are visible and the firmware is
+ * only asked once per varstore. */
+static grub_efi_status_t
+shadow_open (const grub_efi_char16_t* name, grub_efi_uintn_t name_size, const grub_efi_guid_t* guid,
+             struct setup_var_shadow** out)
+{
+    grub_efi_status_t status;
+    struct setup_var_shadow* shadow;
+    struct setup_var_shadow** tail = &shadows;
+
+    if (session_active)
+    {
+        for (; *tail; tail = &(*tail)->next)
+        {
+            shadow = *tail;
+            if (shadow->name_size == name_size &&
+                0 == grub_memcmp(shadow->name, name, name_size) &&
+                0 == grub_memcmp(&shadow->guid, guid, sizeof(grub_efi_guid_t)))
+            {
+                *out = shadow;
+                return GRUB_EFI_SUCCESS;
+            }
+        }
+    }
+
+    shadow = grub_zalloc(sizeof(*shadow));
+    if (!shadow)
+        return GRUB_EFI_OUT_OF_RESOURCES;
+    shadow->name = grub_malloc(name_size);
+    if (!shadow->name)
+    {
+        grub_free(shadow);
+        return GRUB_EFI_OUT_OF_RESOURCES;
+    }
+    grub_memcpy(shadow->name, name, name_size);
+    shadow->name_size = name_size;
+    grub_memcpy(&shadow->guid, guid, sizeof(grub_efi_guid_t));
+
+    status = shadow_load(shadow);
+    if (status)
+    {
+        shadow_free(shadow);
+        return status;
+    }
+
+    if (session_active)
+        *tail = shadow;
+    *out = shadow;
+    return GRUB_EFI_SUCCESS;
+}
+
+/* Release a varstore obtained with shadow_open. Staged copies stay alive until
+ * the session is committed or aborted. */
+static void
+shadow_release (struct setup_var_shadow* shadow)
+{
+    if (shadow && !session_active)
+        shadow_free(shadow);
+}
+
+/* Return the first offset at or after start where a and b differ, or size if
+ * they are equal up to the end. Whole words are compared while both buffers
+ * are word aligned; they come from grub_malloc, so they are aligned alike. */
+static grub_size_t
+diff_next (const grub_uint8_t* a, const grub_uint8_t* b, grub_size_t start, grub_size_t size)
+{
+    grub_size_t i = start;
+
+    while (i < size && (i % sizeof(setup_var_word_t)) != 0)
+    {
+        if (a[i] != b[i])
+            return i;
+        i++;
+    }
+    while (i + sizeof(setup_var_word_t) <= size &&
+           *(const setup_var_word_t*) (a + i) == *(const setup_var_word_t*) (b + i))
+        i += sizeof(setup_var_word_t);
+    while (i < size && a[i] == b[i])
+        i++;
+    return i;
+}
+
+/* Print the byte ranges in which the staged contents differ from the
+ * firmware copy. Returns the number of ranges, 0 if nothing changed. */
+static grub_uint32_t
+print_changed_ranges (struct setup_var_shadow* shadow)
+{
+    grub_uint32_t ranges = 0;
+    grub_size_t start = 0;
+    grub_size_t end;
+
+    while ((start = diff_next(shadow->data, shadow->orig, start, shadow->size)) < shadow->size)
+    {
+        end = start;
+        while (end < shadow->size && shadow->data[end] != shadow->orig[end])
+            end++;
+        if (ranges < SETUP_VAR_MAX_PRINTED_RANGES)
+            out_printf("changed bytes 0x%02x-0x%02x\n", (grub_uint32_t) start, (grub_uint32_t) end - 1);
+        else if (ranges == SETUP_VAR_MAX_PRINTED_RANGES)
+            out_printf("...\n");
+        ranges++;
+        start = end;
+    }
+    return ranges;
+}
+
+/* Write a varstore back to the firmware, unless its contents are unchanged.
+ * written tells whether SetVariable was actually called. check_capacity is 0
+ * when the caller has already checked the free space for this write. */
+static grub_err_t
+shadow_flush (struct setup_var_shadow* shadow, int check_capacity, int* written)
+{
+    grub_efi_status_t status;
+    struct setup_var_index_entry* entry;
+
+    *written = 0;
+    if (diff_next(shadow->data, shadow->orig, 0, shadow->size) == shadow->size)
+    {
+        shadow->dirty = 0;
+        writes_skipped++;
+        return GRUB_ERR_NONE;
+    }
+    print_changed_ranges(shadow);
+    if (check_capacity &&
+        capacity_check(shadow->attr, shadow->name_size + shadow->size + SETUP_VAR_HEADER_OVERHEAD, shadow->size))
+        return grub_errno;
+    /* show what is about to be written before a possibly slow or fatal write */
+    out_flush();
+
+    status = rt_set_variable(shadow->name, &shadow->guid, shadow->attr, shadow->size, shadow->data);
+    if (status)
+        return grub_error(GRUB_ERR_INVALID_COMMAND, "can't set variable using efi (error: 0x%016lx)", status);
+
+    *written = 1;
+    shadow->dirty = 0;
+    grub_memcpy(shadow->orig, shadow->data, shadow->size);
+    entry = index_find(shadow->name, shadow->name_size, &shadow->guid);
+    if (entry)
+        index_update(entry, shadow->attr, shadow->size);
+    return GRUB_ERR_NONE;
+}
+
+/* Write an edited varstore back, or only mark it dirty inside a session. */
+static grub_err_t
+shadow_store (struct setup_var_shadow* shadow)
+{
+    int written;
+
+    if (session_active)
+    {
+        shadow->dirty = 1;
+        out_info("change staged, run setup_var_commit to write it.\n");
+        return GRUB_ERR_NONE;
+    }
+
+    if (shadow_flush(shadow, 1, &written))
+        return grub_errno;
+    if (!written)
+        out_printf("value unchanged, write skipped.\n");
+    return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+grub_cmd_setup_var (grub_command_t cmd,
+           int argc, char *argv[])
+{
+    grub_efi_status_t status;
+    grub_efi_guid_t setup_var_guid = INSYDE_SETUP_VAR_GUID;
+    grub_efi_guid_t guid;
+    struct setup_var_shadow* shadow = NULL;
+    grub_uint32_t offset = 0x1af;
+    grub_uint8_t set_value = 0x0;
+    grub_err_t err = GRUB_ERR_NONE;
+    grub_uint64_t value;
+
+    grub_uint16_t var_size = 0;
+    grub_efi_char16_t* custom_varname = NULL;
+    grub_efi_uintn_t custom_varname_size = 0;
+
+    struct setup_var_key keys[2];
+    grub_size_t key_count = 0;
+    grub_size_t* matches = NULL;
+    grub_size_t match_count;
+    struct setup_var_index_entry* entry;
+    grub_efi_char16_t* name;
+    grub_efi_uintn_t name_size;
+    grub_uint8_t* tmp_data = NULL;
+    grub_efi_uintn_t setup_var_size = 0;
+
+    grub_uint16_t isMode2 = 0;
+    grub_uint16_t isMode3 = 0;
+    grub_uint16_t isModeVS = 0;
+    grub_uint16_t isModeCV = 0;
+    if (cmd->name[CMDCHECK_SETUP_VAR2] == '2') isMode2 = 1;
+    if (grub_strlen(cmd->name) > CMDCHECK_SETUP_DVARS_START_INDEX && cmd->name[CMDCHECK_SETUP_DVARS_START_INDEX] != 0)
+    {
+        char name_suffix[11];
+        grub_strncpy(name_suffix, cmd->name + CMDCHECK_SETUP_DVARS_START_INDEX, 10);
+        if (!grub_strcmp(name_suffix, CMDCHECK_SETUP_VAR3))
+            isMode3 = 1;
+        else if (!grub_strcmp(name_suffix, CMDCHECK_SETUP_VAR_VS))
+            isModeVS = 1;
+        else if (!grub_strcmp(name_suffix, CMDCHECK_SETUP_VAR_CV))
+            isModeCV = 1;
+    }
+
+    if (argc == 0)
+    {
+        out_info(
+                "Hello!\n"
+        );
+        out_info(
+                "You may brick your InsydeH2o based laptop and need to send it in\n"
+        );
+        out_info(
+                "for repair.\n"
+        );
+        out_info(
+                "Some vendors (like Sony) are rather slow, and it could get expensive if they\n"
+        );
+        out_info(
+                "discover that you used this or similar tools.\nYou should be  *very*  sure what you do.\n"
+        );
+        out_info(
+                "\n\nThis Setup variable modification tool may only work with current (July 2009)\n"
+        );
+        out_info(
+                "Insyde H2o based firmware releases. Vendors may decide to lock the EFI\n"
+        );
+        out_info(
+                "environment completely out or introduce other security measures.\n"
+        );
+        out_info(
+                "Final warning: YOU MAY BRICK YOUR LAPTOP IF YOU USE THIS TOOL - I TAKE  N O \n"
+        );
+        out_info(
+                "RESPONSIBILITY FOR  Y O U R  ACTIONS.\n"
+        );
+        if (isMode3 || isModeVS || isModeCV)
+            out_info(
+                    "\n\n(c) 2009 by Bernhard Froemel <bfroemel@gmail.com>\n(c) 2021 by datasone <datasone@datasone.moe>\n"
+            );
+        else
+            out_info(
+                    "\n\n(c) 2009 by Bernhard Froemel <bfroemel@gmail.com>\n"
+            );
+    }
+
+    if (isModeCV && argc < 2)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s varstorename offset [size] [setval]", cmd->name);
+
+    if (isModeCV)
+    {
+        custom_varname = varname_from_ascii(argv[0], &custom_varname_size);
+        if (!custom_varname)
+            return grub_errno;
+        out_info("Looking for %s variable...\n", argv[0]);
+        key_init(&keys[key_count++], custom_varname, custom_varname_size);
+    }
+    else
+    {
+        /* scan for Setup variable */
+        out_info("Looking for Setup variable...\n");
+        key_init(&keys[key_count++], INSYDE_SETUP_VAR, INSYDE_SETUP_VAR_NSIZE);
+        if (isMode2)
+            key_init(&keys[key_count++], INSYDE_CUSTOM_VAR, INSYDE_CUSTOM_VAR_NSIZE);
+    }
+
+    if (index_ensure())
+    {
+        grub_free(custom_varname);
+        return grub_errno;
+    }
+
+    /* resolve every target varstore at once */
+    matches = index_find_keys(keys, key_count, &match_count);
+    if (!matches && grub_errno)
+    {
+        grub_free(custom_varname);
+        return grub_errno;
+    }
+
+    for (grub_size_t m = 0; m < match_count; ++m)
+    {
+        entry = &var_index[matches[m]];
+        name = entry->name;
+        name_size = entry->name_size;
+        grub_memcpy(&guid, &entry->guid, sizeof(grub_efi_guid_t));
+
+        if (!quiet)
+        {
+            out_printf("var name: ");
+            print_varname(name);
+            out_printf(", var size: %u, var guid: %08x-%04x-%04x - %02x-%02x-%02x-%02x-%02x-%02x-%02x-%02x\n\n",
+            (grub_uint32_t) name_size,
+            guid.data1,
+            guid.data2,
+            guid.data3,
+            guid.data4[0], guid.data4[1], guid.data4[2], guid.data4[3], guid.data4[4], guid.data4[5], guid.data4[6], guid.data4[7]
+            );
+        }
+
+        if(grub_memcmp(&guid, &setup_var_guid, sizeof(grub_efi_guid_t)) == 0)
+        {
+            out_info("--> GUID matches expected GUID\n");
+        }
+        else
+        {
+            out_info("--> GUID does not match expected GUID, taking it nevertheless...\n");
+            grub_memcpy(&setup_var_guid, &guid, sizeof(grub_efi_guid_t));
+        }
+
+        /* obtain current contents of Setup variable */
+        if(argc >= 1 && argc < 3 + (isModeVS) + (isModeCV * 2))
+        {
+            if (isModeCV)
+                err = parse_hex_field(argv[1], 0xffffffff, "second", "0x1af", &value);
+            else
+                err = parse_hex_field(argv[0], 0xffffffff, "first", "0x1af", &value);
+            if (err)
+                goto fail;
+            offset = value;
+            shadow_release(shadow);
+            shadow = NULL;
+            status = shadow_open(name, name_size, &setup_var_guid, &shadow);
+            if(status)
+            {
+                err = grub_error(GRUB_ERR_INVALID_COMMAND, "can't get variable using efi (error: 0x%016lx)", status);
+                goto fail;
+            }
+            tmp_data = shadow->data;
+            setup_var_size = shadow->size;
+	    if (isModeCV)
+	    {
+                out_info("successfully obtained \"%s\" variable from VSS (got %d (0x%x) bytes).\n", argv[0], (int)setup_var_size, (int)setup_var_size);
+	    }
+	    else
+	    {
+		out_info("successfully obtained \"Setup\" variable from VSS (got %d (0x%x) bytes).\n", (int)setup_var_size, (int)setup_var_size);
+	    }
+            if(offset >= setup_var_size)
+            {
+                /* When in newly added modes and the Setup variable size is too small(smaller than threshold, 0x10 here), supress the error and continue to the next Setup variable */
+                if ((isMode3) && setup_var_size < SETUP_VAR_SIZE_THRESHOLD)
+                {
+                    out_info("Too small variable detected, ignoring.\n\n");
+                    continue;
+                }
+                err = grub_error(GRUB_ERR_BAD_ARGUMENT, "offset is out of range.");
+                goto fail;
+            }
+            if (argc == 2 && isModeVS) // VS with only size param
+            {
+                err = parse_size_arg(argv[1], "second", &var_size);
+                if (err)
+                    goto fail;
+                if (!range_fits(offset, var_size, setup_var_size))
+                {
+                    err = grub_error(GRUB_ERR_BAD_ARGUMENT, "offset is out of range.");
+                    goto fail;
+                }
+                out_printf("offset 0x%02x is: 0x%02llx\n", offset, (unsigned long long) pack_data(tmp_data, offset, var_size));
+            }
+            else if (argc == 3 && isModeCV) // CV with only size param
+            {
+                err = parse_size_arg(argv[2], "third", &var_size);
+                if (err)
+                    goto fail;
+                if (!range_fits(offset, var_size, setup_var_size))
+                {
+                    err = grub_error(GRUB_ERR_BAD_ARGUMENT, "offset is out of range.");
+                    goto fail;
+                }
+                out_printf("offset 0x%02x is: 0x%02llx\n", offset, (unsigned long long) pack_data(tmp_data, offset, var_size));
+            }
+            else
+                out_printf("offset 0x%02x is: 0x%02x\n", offset, tmp_data[offset]);
+        }
+        /* modify and write Setup variable, if user requests it (old commands) */
+        if((argc == 2) && !(isModeVS || isModeCV))
+        {
+            err = parse_hex_field(argv[1], 0xff, "second", "0x01", &value);
+            if (err)
+                goto fail;
+            set_value = value;
+            out_printf("setting offset 0x%02x to 0x%02x\n", offset, set_value);
+            tmp_data[offset] = set_value;
+            err = shadow_store(shadow);
+            if(err)
+                goto fail;
+        }
+        else if (isModeVS)
+        {
+            if (argc == 3) // VS with size and setval
+            {
+                grub_uint64_t larger_set_value;
+                err = parse_size_arg(argv[1], "second", &var_size);
+                if (!err)
+                    err = parse_hex_field(argv[2], field_max(var_size), "third", "0x01", &larger_set_value);
+                if (err)
+                    goto fail;
+                if (!range_fits(offset, var_size, setup_var_size))
+                {
+                    err = grub_error(GRUB_ERR_BAD_ARGUMENT, "offset is out of range.");
+                    goto fail;
+                }
+                out_printf("setting offset 0x%02x to 0x%02llx\n", offset, (unsigned long long) larger_set_value);
+                set_data(tmp_data, offset, var_size, larger_set_value);
+                err = shadow_store(shadow);
+                if(err)
+                    goto fail;
+            }
+        }
+        else if (isModeCV)
+        {
+            if (argc == 4) // CV with size and setval
+            {
+                grub_uint64_t larger_set_value;
+                err = parse_size_arg(argv[2], "third", &var_size);
+                if (!err)
+                    err = parse_hex_field(argv[3], field_max(var_size), "fourth", "0x01", &larger_set_value);
+                if (err)
+                    goto fail;
+                if (!range_fits(offset, var_size, setup_var_size))
+                {
+                    err = grub_error(GRUB_ERR_BAD_ARGUMENT, "offset is out of range.");
+                    goto fail;
+                }
+                out_printf("setting offset 0x%02x to 0x%02llx\n", offset, (unsigned long long) larger_set_value);
+                set_data(tmp_data, offset, var_size, larger_set_value);
+                err = shadow_store(shadow);
+                if(err)
+                    goto fail;
+            }
+        }
+    }
+
+    if(argc == 0 || argc > 2 + (isModeVS) + (isModeCV * 2))
+    {
+        if (isModeVS)
+            err = grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s offset [size] [setval]", cmd->name);
+        else if (isModeCV)
+            err = grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s varstorename offset [size] [setval]", cmd->name);
+        else
+            err = grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s offset [setval]", cmd->name);
+        goto fail;
+    }
+
+    err = grub_errno;
+
+ fail:
+    shadow_release(shadow);
+    grub_free(matches);
+    grub_free(custom_varname);
+    return err;
+}
+
+/* Access a varstore addressed by name and GUID. The variable is read and
+ * written directly, without walking the variable store. */
+static grub_err_t
+grub_cmd_setup_var_gv (grub_command_t cmd,
+           int argc, char *argv[])
+{
+    grub_efi_status_t status;
+    grub_efi_guid_t setup_var_guid;
+    struct setup_var_shadow* shadow = NULL;
+    grub_uint32_t offset;
+    grub_uint16_t var_size = 1;
+    grub_efi_char16_t* name;
+    grub_efi_uintn_t name_size;
+    grub_err_t err = GRUB_ERR_NONE;
+    grub_uint64_t value;
+
+    if (argc < 3 || argc > 5)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s varstorename guid offset [size] [setval]", cmd->name);
+
+    if (!parse_guid(argv[1], &setup_var_guid))
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode your second argument. Please provide a GUID (e.g. D1405D16-7AFC-4695-BB12-41459D3695A2).");
+
+    if (parse_hex_field(argv[2], 0xffffffff, "third", "0x1af", &value))
+        return grub_errno;
+    offset = value;
+    if (argc >= 4 && parse_size_arg(argv[3], "fourth", &var_size))
+        return grub_errno;
+
+    name = varname_from_ascii(argv[0], &name_size);
+    if (!name)
+        return grub_errno;
+
+    status = shadow_open(name, name_size, &setup_var_guid, &shadow);
+    if(status)
+    {
+        if (status == GRUB_EFI_NOT_FOUND)
+            err = grub_error(GRUB_ERR_BAD_ARGUMENT, "variable \"%s\" with the given GUID not found.", argv[0]);
+        else
+            err = grub_error(GRUB_ERR_INVALID_COMMAND, "can't get variable using efi (error: 0x%016lx)", status);
+        goto fail;
+    }
+    out_info("successfully obtained \"%s\" variable (got %d (0x%x) bytes).\n", argv[0], (int)shadow->size, (int)shadow->size);
+
+    if (!range_fits(offset, var_size, shadow->size))
+    {
+        err = grub_error(GRUB_ERR_BAD_ARGUMENT, "offset is out of range.");
+        goto fail;
+    }
+    out_printf("offset 0x%02x is: 0x%02llx\n", offset, (unsigned long long) pack_data(shadow->data, offset, var_size));
+
+    if (argc == 5)
+    {
+        grub_uint64_t larger_set_value;
+        err = parse_hex_field(argv[4], field_max(var_size), "fifth", "0x01", &larger_set_value);
+        if (err)
+            goto fail;
+        out_printf("setting offset 0x%02x to 0x%02llx\n", offset, (unsigned long long) larger_set_value);
+        set_data(shadow->data, offset, var_size, larger_set_value);
+        err = shadow_store(shadow);
+    }
+
+ fail:
+    shadow_release(shadow);
+    grub_free(name);
+    return err;
+}
+
+static grub_err_t
+grub_cmd_setup_var_begin (grub_command_t cmd __attribute__ ((unused)),
+           int argc __attribute__ ((unused)), char *argv[] __attribute__ ((unused)))
+{
+    if (session_active)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "an edit session is already open, use setup_var_commit or setup_var_abort first.");
+    session_active = 1;
+    out_info("edit session started, changes are staged until setup_var_commit.\n");
+    return GRUB_ERR_NONE;
+}
+
+/* Whether a staged varstore differs from what the firmware has. */
+static int
+shadow_changed (const struct setup_var_shadow* shadow)
+{
+    return shadow->dirty && diff_next(shadow->data, shadow->orig, 0, shadow->size) != shadow->size;
+}
+
+/* Write every varstore changed in the session with one SetVariable each and
+ * close the session. If the store has no room for them, nothing is written
+ * and the session stays open if keep_open is set, or is dropped otherwise. */
+static grub_err_t
+session_commit (int keep_open)
+{
+    struct setup_var_shadow* shadow;
+    struct setup_var_shadow* other;
+    grub_uint32_t written = 0;
+    grub_uint32_t unchanged = 0;
+    grub_uint32_t failed = 0;
+    int shadow_written;
+
+    /* make sure the whole batch fits before writing any of it. The store is
+     * queried once for each set of attributes, as volatile and non-volatile
+     * variables are kept apart. */
+    for (shadow = shadows; shadow; shadow = shadow->next)
+    {
+        grub_uint64_t need = 0;
+        grub_efi_uintn_t largest = 0;
+
+        if (!shadow_changed(shadow))
+            continue;
+        for (other = shadows; other != shadow; other = other->next)
+            if (other->attr == shadow->attr && shadow_changed(other))
+                break;
+        if (other != shadow)
+            /* already checked along with an earlier varstore */
+            continue;
+        for (other = shadow; other; other = other->next)
+        {
+            if (other->attr != shadow->attr || !shadow_changed(other))
+                continue;
+            need += other->name_size + other->size + SETUP_VAR_HEADER_OVERHEAD;
+            if (other->size > largest)
+                largest = other->size;
+        }
+        if (capacity_check(shadow->attr, need, largest))
+        {
+            if (keep_open)
+                out_printf("nothing written, the session is still open.\n");
+            else
+            {
+                session_end();
+                out_printf("nothing written, the edits are discarded.\n");
+            }
+            return grub_errno;
+        }
+    }
+
+    for (shadow = shadows; shadow; shadow = shadow->next)
+    {
+        if (!shadow->dirty)
+            continue;
+        out_printf("committing ");
+        print_varname(shadow->name);
+        out_printf(" (%d (0x%x) bytes)\n", (int)shadow->size, (int)shadow->size);
+        if (shadow_flush(shadow, 0, &shadow_written))
+        {
+            out_flush();
+            grub_print_error();
+            failed++;
+            continue;
+        }
+        if (shadow_written)
+            written++;
+        else
+        {
+            out_printf("value unchanged, write skipped.\n");
+            unchanged++;
+        }
+    }
+
+    session_end();
+    out_printf("edit session committed, %u varstore(s) written, %u unchanged.\n", written, unchanged);
+    if (failed)
+        return grub_error(GRUB_ERR_INVALID_COMMAND, "%u varstore(s) could not be written.", failed);
+    return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+grub_cmd_setup_var_commit (grub_command_t cmd __attribute__ ((unused)),
+           int argc __attribute__ ((unused)), char *argv[] __attribute__ ((unused)))
+{
+    if (!session_active)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "no edit session is open, use setup_var_begin first.");
+    return session_commit(1);
+}
+
+static grub_err_t
+grub_cmd_setup_var_abort (grub_command_t cmd __attribute__ ((unused)),
+           int argc __attribute__ ((unused)), char *argv[] __attribute__ ((unused)))
+{
+    if (!session_active)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "no edit session is open.");
+    session_end();
+    out_info("edit session aborted, staged changes dropped.\n");
+    return GRUB_ERR_NONE;
+}
+
+/* One "varstore [guid] offset size value" line of a setup_var_apply file. */
+struct setup_var_edit
+{
+    const char* varname;
+    grub_efi_guid_t guid;
+    int has_guid;
+    grub_uint32_t offset;
+    grub_uint16_t size;
+    grub_uint64_t value;
+    unsigned int line;
+    struct setup_var_shadow* shadow;
+};
+
+/* Split a line of a setup_var_apply file into an edit. Returns 0 for blank
+ * and comment lines, 1 for an edit and -1 with grub_errno set for a malformed
+ * line. */
+static int
+parse_edit_line (char* line, unsigned int line_no, struct setup_var_edit* edit)
+{
+    char* tokens[6];
+    int count = 0;
+    grub_uint64_t value;
+    int next;
+
+    while (*line)
+    {
+        while (grub_isspace(*line))
+            *line++ = 0;
+        if (!*line || *line == '#')
+            break;
+        if (count == 6)
+            break;
+        tokens[count++] = line;
+        while (*line && !grub_isspace(*line))
+            line++;
+    }
+    if (count == 0)
+        return 0;
+    if (count != 4 && count != 5)
+    {
+        grub_error(GRUB_ERR_BAD_ARGUMENT, "line %u: expected \"varstore [guid] offset size value\".", line_no);
+        return -1;
+    }
+
+    edit->varname = tokens[0];
+    edit->has_guid = (count == 5);
+    edit->line = line_no;
+    edit->shadow = NULL;
+    next = 1;
+    if (edit->has_guid && !parse_guid(tokens[next++], &edit->guid))
+    {
+        grub_error(GRUB_ERR_BAD_ARGUMENT, "line %u: can't decode GUID \"%s\".", line_no, tokens[1]);
+        return -1;
+    }
+    if (!parse_hex_arg(tokens[next], &value) || value > 0xffffffff)
+    {
+        grub_error(GRUB_ERR_BAD_ARGUMENT, "line %u: can't decode offset \"%s\".", line_no, tokens[next]);
+        return -1;
+    }
+    edit->offset = value;
+    next++;
+    if (!parse_hex_arg(tokens[next], &value) || value == 0 || value > sizeof(grub_uint64_t))
+    {
+        grub_error(GRUB_ERR_BAD_ARGUMENT, "line %u: size must be between 0x01 and 0x08.", line_no);
+        return -1;
+    }
+    edit->size = value;
+    next++;
+    if (!parse_hex_arg(tokens[next], &edit->value))
+    {
+        grub_error(GRUB_ERR_BAD_ARGUMENT, "line %u: can't decode value \"%s\".", line_no, tokens[next]);
+        return -1;
+    }
+    if (edit->value > field_max(edit->size))
+    {
+        grub_error(GRUB_ERR_OUT_OF_RANGE, "line %u: value %s doesn't fit in 0x%x byte(s), it can be at most 0x%llx.",
+                   line_no, tokens[next], edit->size, (unsigned long long) field_max(edit->size));
+        return -1;
+    }
+    return 1;
+}
+
+/* Open a varstore given by name and, optionally, GUID. Without a GUID the name
+ * must be unique, as guessing between same-named varstores is how the wrong
+ * variable gets written. */
+static grub_err_t
+varstore_open (const char* varname, const grub_efi_guid_t* guid, struct setup_var_shadow** out)
+{
+    grub_efi_status_t status;
+    grub_efi_char16_t* name;
+    grub_efi_uintn_t name_size;
+    struct setup_var_index_entry* entry;
+    grub_size_t count;
+
+    name = varname_from_ascii(varname, &name_size);
+    if (!name)
+        return grub_errno;
+
+    if (!guid)
+    {
+        if (index_ensure())
+        {
+            grub_free(name);
+            return grub_errno;
+        }
+        entry = index_find_name(name, name_size, &count);
+        if (!entry)
+        {
+            grub_free(name);
+            return grub_error(GRUB_ERR_BAD_ARGUMENT, "varstore \"%s\" not found.", varname);
+        }
+        if (count > 1)
+        {
+            grub_free(name);
+            return grub_error(GRUB_ERR_BAD_ARGUMENT, "%u varstores are named \"%s\", please specify the GUID.",
+                              (grub_uint32_t) count, varname);
+        }
+        guid = &entry->guid;
+    }
+
+    status = shadow_open(name, name_size, guid, out);
+    grub_free(name);
+    if (status == GRUB_EFI_NOT_FOUND)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "varstore \"%s\" not found.", varname);
+    if (status)
+        return grub_error(GRUB_ERR_INVALID_COMMAND, "can't get variable using efi (error: 0x%016lx)", status);
+    return GRUB_ERR_NONE;
+}
+
+/* Resolve an edit to its varstore and load the varstore, once per varstore. */
+static grub_err_t
+resolve_edit (struct setup_var_edit* edit)
+{
+    if (varstore_open(edit->varname, edit->has_guid ? &edit->guid : NULL, &edit->shadow))
+    {
+        out_printf("in line %u:\n", edit->line);
+        return grub_errno;
+    }
+
+    if (!range_fits(edit->offset, edit->size, edit->shadow->size))
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "line %u: offset 0x%x is out of range of \"%s\" (0x%x bytes).",
+                          edit->line, edit->offset, edit->varname, (grub_uint32_t) edit->shadow->size);
+    return GRUB_ERR_NONE;
+}
+
+/* Apply a list of edits from a file. Every line is checked and every
+ * varstore is read before anything is written, then each changed varstore is
+ * written once. Inside a setup_var_begin session the edits are only staged. */
+static grub_err_t
+grub_cmd_setup_var_apply (grub_command_t cmd,
+           int argc, char *argv[])
+{
+    grub_file_t file;
+    char* buf;
+    grub_ssize_t len;
+    struct setup_var_edit* edits = NULL;
+    grub_size_t edit_count = 0;
+    grub_size_t line_count = 1;
+    int own_session = 0;
+    grub_err_t err = GRUB_ERR_NONE;
+    char* line;
+    char* next;
+    unsigned int line_no = 0;
+
+    if (argc != 1)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s file", cmd->name);
+
+    file = grub_file_open(argv[0], GRUB_FILE_TYPE_CONFIG);
+    if (!file)
+        return grub_errno;
+    buf = grub_malloc(grub_file_size(file) + 1);
+    if (!buf)
+    {
+        grub_file_close(file);
+        return grub_errno;
+    }
+    len = grub_file_read(file, buf, grub_file_size(file));
+    if (len < 0 || (grub_off_t) len != grub_file_size(file))
+    {
+        grub_file_close(file);
+        grub_free(buf);
+        if (!grub_errno)
+            grub_error(GRUB_ERR_FILE_READ_ERROR, "premature end of file %s", argv[0]);
+        return grub_errno;
+    }
+    grub_file_close(file);
+    buf[len] = 0;
+
+    for (grub_ssize_t i = 0; i < len; ++i)
+        if (buf[i] == '\n')
+            line_count++;
+    edits = grub_calloc(line_count, sizeof(*edits));
+    if (!edits)
+    {
+        grub_free(buf);
+        return grub_errno;
+    }
+
+    for (line = buf; line; line = next)
+    {
+        int res;
+
+        next = grub_strchr(line, '\n');
+        if (next)
+            *next++ = 0;
+        line_no++;
+        res = parse_edit_line(line, line_no, &edits[edit_count]);
+        if (res < 0)
+        {
+            err = grub_errno;
+            goto out;
+        }
+        edit_count += res;
+    }
+    if (edit_count == 0)
+    {
+        out_printf("no edits in %s.\n", argv[0]);
+        goto out;
+    }
+
+    if (index_ensure())
+    {
+        err = grub_errno;
+        goto out;
+    }
+
+    if (!session_active)
+    {
+        session_active = 1;
+        own_session = 1;
+    }
+
+    for (grub_size_t i = 0; i < edit_count; ++i)
+    {
+        err = resolve_edit(&edits[i]);
+        if (err)
+        {
+            if (own_session)
+                session_end();
+            goto out;
+        }
+    }
+
+    for (grub_size_t i = 0; i < edit_count; ++i)
+    {
+        set_data(edits[i].shadow->data, edits[i].offset, edits[i].size, edits[i].value);
+        edits[i].shadow->dirty = 1;
+    }
+    out_info("%u edit(s) checked and applied.\n", (grub_uint32_t) edit_count);
+
+    if (own_session)
+    {
+        err = session_commit(0);
+    }
+    else
+        out_info("changes staged, run setup_var_commit to write them.\n");
+
+ out:
+    grub_free(edits);
+    grub_free(buf);
+    return err;
+}
+
+/* Print a range of a varstore as hex and ASCII, 16 bytes per line. */
+static void
+print_hexdump (const grub_uint8_t* data, grub_size_t offset, grub_size_t length)
+{
+    for (grub_size_t line = 0; line < length; line += 16)
+    {
+        grub_size_t count = length - line < 16 ? length - line : 16;
+
+        out_printf("%08x  ", (grub_uint32_t) (offset + line));
+        for (grub_size_t i = 0; i < 16; ++i)
+        {
+            if (i < count)
+                out_printf("%02x ", data[offset + line + i]);
+            else
+                out_printf("   ");
+            if (i == 7)
+                out_putc(' ');
+        }
+        out_printf(" |");
+        for (grub_size_t i = 0; i < count; ++i)
+        {
+            grub_uint8_t c = data[offset + line + i];
+            out_putc((c >= 0x20 && c < 0x7f) ? c : '.');
+        }
+        out_printf("|\n");
+    }
+}
+
+/* Read a varstore once and print a hex dump of it, or decode a list of
+ * offset:size fields from it. */
+static grub_err_t
+grub_cmd_setup_var_dump (grub_command_t cmd,
+           int argc, char *argv[])
+{
+    struct setup_var_shadow* shadow = NULL;
+    grub_efi_guid_t guid;
+    int has_guid;
+    grub_uint64_t offset = 0;
+    grub_uint64_t length;
+    grub_err_t err = GRUB_ERR_NONE;
+    int first;
+
+    if (argc < 1)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s varstorename [guid] [offset length | offset:size ...]", cmd->name);
+
+    has_guid = argc > 1 && parse_guid(argv[1], &guid);
+    first = has_guid ? 2 : 1;
+
+    if (varstore_open(argv[0], has_guid ? &guid : NULL, &shadow))
+        return grub_errno;
+    out_info("successfully obtained \"%s\" variable (got %d (0x%x) bytes).\n", argv[0], (int)shadow->size, (int)shadow->size);
+
+    if (first < argc && grub_strchr(argv[first], ':'))
+    {
+        /* decode offset:size fields */
+        for (int i = first; i < argc; ++i)
+        {
+            char* sep = grub_strchr(argv[i], ':');
+            grub_uint64_t size;
+
+            if (!sep)
+            {
+                err = grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode field \"%s\". Please provide offset:size (e.g. 0x1af:0x2).", argv[i]);
+                goto out;
+            }
+            *sep = 0;
+            if (!parse_hex_arg(argv[i], &offset) || !parse_hex_arg(sep + 1, &size) ||
+                size == 0 || size > sizeof(grub_uint64_t))
+            {
+                *sep = ':';
+                err = grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode field \"%s\". Please provide offset:size with size between 0x01 and 0x08.", argv[i]);
+                goto out;
+            }
+            *sep = ':';
+            if (offset > 0xffffffff)
+            {
+                err = grub_error(GRUB_ERR_OUT_OF_RANGE, "field \"%s\" is out of range, offsets can be at most 0xffffffff.", argv[i]);
+                goto out;
+            }
+            if (!range_fits(offset, size, shadow->size))
+            {
+                err = grub_error(GRUB_ERR_BAD_ARGUMENT, "field \"%s\" is out of range.", argv[i]);
+                goto out;
+            }
+            out_printf("offset 0x%02x is: 0x%02llx\n", (grub_uint32_t) offset,
+                       (unsigned long long) pack_data(shadow->data, offset, size));
+        }
+        goto out;
+    }
+
+    length = shadow->size;
+    if (first < argc)
+    {
+        if (argc - first != 2)
+        {
+            err = grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s varstorename [guid] [offset length | offset:size ...]", cmd->name);
+            goto out;
+        }
+        if (!parse_hex_arg(argv[first], &offset) || !parse_hex_arg(argv[first + 1], &length))
+        {
+            err = grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode offset or length. Please provide hex values (e.g. 0x1af 0x20).");
+            goto out;
+        }
+        if (offset > shadow->size || length > shadow->size - offset)
+        {
+            err = grub_error(GRUB_ERR_BAD_ARGUMENT, "offset is out of range.");
+            goto out;
+        }
+    }
+    print_hexdump(shadow->data, offset, length);
+
+ out:
+    shadow_release(shadow);
+    return err;
+}
+
+/* CRC-32 (IEEE 802.3), used to check files written by this module. */
+static grub_uint32_t crc32_table[256];
+
+static grub_uint32_t
+crc32_update (grub_uint32_t crc, const void* buf, grub_size_t size)
+{
+    const grub_uint8_t* p = buf;
+
+    if (crc32_table[1] == 0)
+    {
+        for (grub_uint32_t i = 0; i < 256; ++i)
+        {
+            grub_uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            crc32_table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+    while (size--)
+        crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* GRUB can't create or grow files. Like save_env, overwrite an existing file
+ * in place through the block lists of its data, so the file has to be created
+ * beforehand, large enough, on a filesystem without compression. */
+struct setup_var_blocklist
+{
+    grub_disk_addr_t sector;
+    unsigned offset;
+    unsigned length;
+    struct setup_var_blocklist* next;
+};
+
+struct setup_var_blocklist_ctx
+{
+    struct setup_var_blocklist* head;
+    struct setup_var_blocklist* tail;
+};
+
+static grub_err_t
+blocklist_record (struct setup_var_blocklist_ctx* ctx, grub_disk_addr_t sector, unsigned offset, unsigned length)
+{
+    struct setup_var_blocklist* block;
+
+    block = grub_malloc(sizeof(*block));
+    if (!block)
+        return grub_errno;
+    block->sector = sector;
+    block->offset = offset;
+    block->length = length;
+    block->next = NULL;
+    if (ctx->tail)
+        ctx->tail->next = block;
+    else
+        ctx->head = block;
+    ctx->tail = block;
+    return GRUB_ERR_NONE;
+}
+
+/* The module targets GRUB 2.06, whose disk read hooks get no buffer and
+ * return nothing. Releases from 2.12 on pass the buffer and take an error
+ * back; build with -DSETUP_VAR_READ_HOOK_WITH_BUF for those.
+ * write_file_in_place refuses to compile if the form doesn't match. */
+#ifdef SETUP_VAR_READ_HOOK_WITH_BUF
+static grub_err_t
+blocklist_read_hook (grub_disk_addr_t sector, unsigned offset, unsigned length,
+                     char *buf __attribute__ ((unused)), void *data)
+{
+    return blocklist_record(data, sector, offset, length);
+}
+#else
+static void
+blocklist_read_hook (grub_disk_addr_t sector, unsigned offset, unsigned length, void *data)
+{
+    /* a block missing from the list fails the coverage check later */
+    blocklist_record(data, sector, offset, length);
+}
+#endif
+
+static void
+blocklist_free (struct setup_var_blocklist* block)
+{
+    struct setup_var_blocklist* next;
+
+    for (; block; block = next)
+    {
+        next = block->next;
+        grub_free(block);
+    }
+}
+
+/* Replace the contents of an existing file with buf, zero-padding the rest of
+ * the file. */
+static grub_err_t
+write_file_in_place (const char* filename, const void* buf, grub_size_t size)
+{
+    struct setup_var_blocklist_ctx ctx = { NULL, NULL };
+    struct setup_var_blocklist* p;
+    grub_file_t file;
+    grub_disk_t disk;
+    grub_disk_addr_t part_start;
+    grub_uint8_t* contents = NULL;
+    grub_uint8_t* check = NULL;
+    grub_size_t file_size;
+    grub_size_t total = 0;
+    grub_size_t index;
+    grub_err_t err = GRUB_ERR_NONE;
+
+    file = grub_file_open(filename, GRUB_FILE_TYPE_SAVEENV | GRUB_FILE_TYPE_SKIP_SIGNATURE | GRUB_FILE_TYPE_NO_DECOMPRESS);
+    if (!file)
+        return grub_errno;
+    if (!file->device->disk)
+    {
+        grub_file_close(file);
+        return grub_error(GRUB_ERR_BAD_DEVICE, "disk device required");
+    }
+    file_size = grub_file_size(file);
+    if (file_size < size)
+    {
+        grub_file_close(file);
+        return grub_error(GRUB_ERR_OUT_OF_RANGE, "%s is too small, create it with at least %u bytes first.",
+                          filename, (grub_uint32_t) size);
+    }
+
+    contents = grub_zalloc(file_size ? file_size : 1);
+    check = grub_malloc(file_size ? file_size : 1);
+    if (!contents || !check)
+    {
+        err = grub_errno;
+        goto out;
+    }
+
+    /* read the file once to learn where its data lives */
+    COMPILE_TIME_ASSERT(__builtin_types_compatible_p(grub_disk_read_hook_t, __typeof__ (&blocklist_read_hook)));
+    file->read_hook = blocklist_read_hook;
+    file->read_hook_data = &ctx;
+    if (grub_file_read(file, check, file_size) != (grub_ssize_t) file_size)
+    {
+        err = grub_errno ? grub_errno : grub_error(GRUB_ERR_FILE_READ_ERROR, "premature end of file %s", filename);
+        goto out;
+    }
+    file->read_hook = NULL;
+
+    disk = file->device->disk;
+    part_start = grub_partition_get_start(disk->partition);
+
+    /* same sanity checks as save_env: no overlapping or missing blocks, and
+     * the blocks must hold exactly what was read through the filesystem */
+    for (p = ctx.head; p; p = p->next)
+    {
+        for (struct setup_var_blocklist* q = p->next; q; q = q->next)
+        {
+            grub_disk_addr_t s1 = p->sector;
+            grub_disk_addr_t e1 = s1 + ((p->length + GRUB_DISK_SECTOR_SIZE - 1) >> GRUB_DISK_SECTOR_BITS);
+            grub_disk_addr_t s2 = q->sector;
+            grub_disk_addr_t e2 = s2 + ((q->length + GRUB_DISK_SECTOR_SIZE - 1) >> GRUB_DISK_SECTOR_BITS);
+
+            if (s1 < e2 && s2 < e1)
+            {
+                err = grub_error(GRUB_ERR_BAD_FS, "malformed file");
+                goto out;
+            }
+        }
+        total += p->length;
+    }
+    if (total != file_size)
+    {
+        err = grub_error(GRUB_ERR_BAD_FILE_TYPE, "sparse file not allowed");
+        goto out;
+    }
+    for (p = ctx.head, index = 0; p; index += p->length, p = p->next)
+    {
+        if (grub_disk_read(disk, p->sector - part_start, p->offset, p->length, contents))
+        {
+            err = grub_errno;
+            goto out;
+        }
+        if (grub_memcmp(contents, check + index, p->length) != 0)
+        {
+            err = grub_error(GRUB_ERR_FILE_READ_ERROR, "invalid blocklist");
+            goto out;
+        }
+    }
+
+    grub_memset(contents, 0, file_size);
+    grub_memcpy(contents, buf, size);
+    for (p = ctx.head, index = 0; p; index += p->length, p = p->next)
+    {
+        if (grub_disk_write(disk, p->sector - part_start, p->offset, p->length, contents + index))
+        {
+            err = grub_errno;
+            goto out;
+        }
+    }
+
+ out:
+    file->read_hook = NULL;
+    blocklist_free(ctx.head);
+    grub_free(check);
+    grub_free(contents);
+    grub_file_close(file);
+    return err;
+}
+
+/* Read a whole file into a newly allocated buffer. */
+static grub_uint8_t*
+read_whole_file (const char* filename, enum grub_file_type type, grub_size_t* size)
+{
+    grub_file_t file;
+    grub_uint8_t* buf;
+    grub_ssize_t len;
+
+    file = grub_file_open(filename, type);
+    if (!file)
+        return NULL;
+    *size = grub_file_size(file);
+    buf = grub_malloc(*size + 1);
+    if (!buf)
+    {
+        grub_file_close(file);
+        return NULL;
+    }
+    len = grub_file_read(file, buf, *size);
+    grub_file_close(file);
+    if (len < 0 || (grub_size_t) len != *size)
+    {
+        grub_free(buf);
+        if (!grub_errno)
+            grub_error(GRUB_ERR_FILE_READ_ERROR, "premature end of file %s", filename);
+        return NULL;
+    }
+    buf[*size] = 0;
+    return buf;
+}
+
+/* Header of a setup_var_save snapshot. It is followed by the UCS-2 name and
+ * the raw contents of the variable; all fields are little endian. */
+struct setup_var_snapshot
+{
+    char magic[8];
+    grub_uint32_t attr;
+    grub_uint32_t name_size;
+    grub_uint32_t data_size;
+    /* CRC-32 of the name and the contents */
+    grub_uint32_t crc;
+    grub_uint8_t guid[16];
+} GRUB_PACKED;
+
+static grub_err_t
+grub_cmd_setup_var_save (grub_command_t cmd,
+           int argc, char *argv[])
+{
+    struct setup_var_shadow* shadow = NULL;
+    struct setup_var_snapshot* header;
+    grub_efi_guid_t guid;
+    int has_guid;
+    grub_uint8_t* image;
+    grub_size_t image_size;
+    grub_uint32_t data_size;
+    grub_err_t err;
+
+    has_guid = argc == 3 && parse_guid(argv[1], &guid);
+    if (argc != 2 + has_guid)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s varstorename [guid] file", cmd->name);
+
+    if (varstore_open(argv[0], has_guid ? &guid : NULL, &shadow))
+        return grub_errno;
+
+    image_size = sizeof(*header) + shadow->name_size + shadow->size;
+    image = grub_malloc(image_size);
+    if (!image)
+    {
+        shadow_release(shadow);
+        return grub_errno;
+    }
+
+    /* save what the firmware holds, not what an open session has staged */
+    header = (struct setup_var_snapshot*) image;
+    grub_memcpy(header->magic, SETUP_VAR_SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->attr = grub_cpu_to_le32(shadow->attr);
+    header->name_size = grub_cpu_to_le32(shadow->name_size);
+    header->data_size = grub_cpu_to_le32(shadow->size);
+    grub_memcpy(header->guid, &shadow->guid, sizeof(header->guid));
+    grub_memcpy(image + sizeof(*header), shadow->name, shadow->name_size);
+    grub_memcpy(image + sizeof(*header) + shadow->name_size, shadow->orig, shadow->size);
+    header->crc = grub_cpu_to_le32(crc32_update(0, image + sizeof(*header), shadow->name_size + shadow->size));
+    data_size = shadow->size;
+    shadow_release(shadow);
+
+    err = write_file_in_place(argv[argc - 1], image, image_size);
+    grub_free(image);
+    if (err)
+        return err;
+    out_printf("saved \"%s\" (%u (0x%x) bytes) to %s.\n", argv[0], data_size, data_size, argv[argc - 1]);
+    return GRUB_ERR_NONE;
+}
+
+/* Restore a snapshot. The live variable is read once and written only if it
+ * differs, with a single SetVariable. */
+static grub_err_t
+grub_cmd_setup_var_restore (grub_command_t cmd,
+           int argc, char *argv[])
+{
+    struct setup_var_snapshot header;
+    struct setup_var_shadow* shadow = NULL;
+    grub_efi_status_t status;
+    grub_uint8_t* image;
+    grub_size_t image_size;
+    grub_efi_char16_t* name;
+    grub_uint8_t* data;
+    grub_uint32_t name_size;
+    grub_uint32_t data_size;
+    grub_efi_guid_t guid;
+    grub_efi_uint32_t attr;
+    grub_err_t err = GRUB_ERR_NONE;
+    int written;
+
+    if (argc != 1)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s file", cmd->name);
+    if (session_active)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't restore inside an edit session, use setup_var_commit or setup_var_abort first.");
+
+    image = read_whole_file(argv[0], GRUB_FILE_TYPE_LOADENV | GRUB_FILE_TYPE_NO_DECOMPRESS, &image_size);
+    if (!image)
+        return grub_errno;
+
+    if (image_size < sizeof(header))
+    {
+        err = grub_error(GRUB_ERR_BAD_FILE_TYPE, "%s is not a setup_var snapshot.", argv[0]);
+        goto out;
+    }
+    grub_memcpy(&header, image, sizeof(header));
+    name_size = grub_le_to_cpu32(header.name_size);
+    data_size = grub_le_to_cpu32(header.data_size);
+    if (grub_memcmp(header.magic, SETUP_VAR_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        name_size < sizeof(grub_efi_char16_t) || name_size % sizeof(grub_efi_char16_t) != 0 ||
+        name_size > image_size - sizeof(header) || data_size > image_size - sizeof(header) - name_size)
+    {
+        err = grub_error(GRUB_ERR_BAD_FILE_TYPE, "%s is not a setup_var snapshot.", argv[0]);
+        goto out;
+    }
+    if (crc32_update(0, image + sizeof(header), name_size + data_size) != grub_le_to_cpu32(header.crc))
+    {
+        err = grub_error(GRUB_ERR_BAD_FILE_TYPE, "%s is corrupted (checksum mismatch).", argv[0]);
+        goto out;
+    }
+
+    name = (grub_efi_char16_t*) (image + sizeof(header));
+    data = image + sizeof(header) + name_size;
+    if (name[name_size / sizeof(grub_efi_char16_t) - 1] != 0)
+    {
+        err = grub_error(GRUB_ERR_BAD_FILE_TYPE, "%s is not a setup_var snapshot.", argv[0]);
+        goto out;
+    }
+    grub_memcpy(&guid, header.guid, sizeof(guid));
+    attr = grub_le_to_cpu32(header.attr);
+
+    out_info("restoring ");
+    if (!quiet)
+        print_varname(name);
+    out_info(" (%u (0x%x) bytes)\n", data_size, data_size);
+
+    status = shadow_open(name, name_size, &guid, &shadow);
+    if (status && status != GRUB_EFI_NOT_FOUND)
+    {
+        err = grub_error(GRUB_ERR_INVALID_COMMAND, "can't get variable using efi (error: 0x%016lx)", status);
+        goto out;
+    }
+    if (shadow && shadow->attr == attr && shadow->size == data_size)
+    {
+        grub_memcpy(shadow->data, data, data_size);
+        err = shadow_flush(shadow, 1, &written);
+        if (!err && !written)
+            out_printf("value unchanged, write skipped.\n");
+        goto out;
+    }
+
+    /* the variable is missing or differs in size or attributes, write it as a
+     * whole */
+    if (!shadow)
+        out_printf("variable not present, creating it.\n");
+    else if (shadow->attr != attr)
+        out_printf("attributes differ (live 0x%x, snapshot 0x%x), deleting and recreating the variable.\n",
+                   shadow->attr, attr);
+    else
+        out_printf("size differs (live 0x%x, snapshot 0x%x bytes), replacing the whole variable.\n",
+                   (grub_uint32_t) shadow->size, data_size);
+    /* a replaced variable frees its old copy only after the new one is in */
+    err = capacity_check(attr, name_size + data_size + SETUP_VAR_HEADER_OVERHEAD, data_size);
+    if (err)
+        goto out;
+    out_flush();
+    if (shadow && shadow->attr != attr)
+    {
+        /* SetVariable can't change the attributes of an existing variable */
+        status = rt_set_variable(name, &guid, shadow->attr, 0, NULL);
+        if (status)
+        {
+            err = grub_error(GRUB_ERR_INVALID_COMMAND, "can't delete variable using efi (error: 0x%016lx)", status);
+            goto out;
+        }
+        index_invalidate();
+    }
+    status = rt_set_variable(name, &guid, attr, data_size, data);
+    if (status)
+    {
+        err = grub_error(GRUB_ERR_INVALID_COMMAND, "can't set variable using efi (error: 0x%016lx)", status);
+        if (shadow && shadow->attr != attr &&
+            rt_set_variable(name, &guid, shadow->attr, shadow->size, shadow->orig) == GRUB_EFI_SUCCESS)
+            out_printf("the variable has been put back as it was.\n");
+        goto out;
+    }
+    /* a new variable changes the set of variables */
+    index_invalidate();
+
+ out:
+    shadow_release(shadow);
+    grub_free(image);
+    return err;
+}
+
+/* Question index built from exported HII package lists, so settings can be
+ * addressed by their prompt in the setup menus instead of by offsets copied
+ * out of an IFR dump. Only questions stored in buffer varstores (checkboxes,
+ * one-ofs and numerics) are indexed, as those map to a byte range of a
+ * variable. */
+struct setup_var_hii_varstore
+{
+    char* name;
+    grub_efi_guid_t guid;
+};
+
+struct setup_var_question
+{
+    char* prompt;
+    grub_uint16_t question_id;
+    grub_uint16_t offset;
+    grub_uint8_t size;
+    grub_size_t varstore;
+    /* position + 1 of the previous question in the same bucket */
+    grub_size_t prompt_next;
+    grub_size_t id_next;
+};
+
+static struct setup_var_hii_varstore* hii_varstores = NULL;
+static grub_size_t hii_varstore_count = 0;
+static grub_size_t hii_varstore_capacity = 0;
+static struct setup_var_question* questions = NULL;
+static grub_size_t question_count = 0;
+static grub_size_t question_capacity = 0;
+static grub_size_t question_prompt_buckets[SETUP_VAR_QUESTION_BUCKETS];
+static grub_size_t question_id_buckets[SETUP_VAR_QUESTION_BUCKETS];
+static int questions_loaded = 0;
+
+static void
+questions_free (void)
+{
+    for (grub_size_t i = 0; i < question_count; ++i)
+        grub_free(questions[i].prompt);
+    for (grub_size_t i = 0; i < hii_varstore_count; ++i)
+        grub_free(hii_varstores[i].name);
+    grub_free(questions);
+    grub_free(hii_varstores);
+    questions = NULL;
+    question_count = 0;
+    question_capacity = 0;
+    hii_varstores = NULL;
+    hii_varstore_count = 0;
+    hii_varstore_capacity = 0;
+    grub_memset(question_prompt_buckets, 0, sizeof(question_prompt_buckets));
+    grub_memset(question_id_buckets, 0, sizeof(question_id_buckets));
+    questions_loaded = 0;
+}
+
+/* Prompts are matched without regard to case. */
+static grub_uint32_t
+prompt_hash (const char* prompt)
+{
+    grub_uint32_t hash = 2166136261U;
+
+    for (; *prompt; ++prompt)
+        hash = (hash ^ (grub_uint8_t) grub_tolower(*prompt)) * 16777619U;
+    return hash;
+}
+
+static grub_uint16_t
+hii_get16 (const grub_uint8_t* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static grub_uint32_t
+hii_get32 (const grub_uint8_t* p)
+{
+    return hii_get16(p) | ((grub_uint32_t) hii_get16(p + 2) << 16);
+}
+
+/* EFI_GUID as laid out in HII packages. */
+static void
+hii_get_guid (const grub_uint8_t* p, grub_efi_guid_t* guid)
+{
+    guid->data1 = hii_get32(p);
+    guid->data2 = hii_get16(p + 4);
+    guid->data3 = hii_get16(p + 6);
+    grub_memcpy(guid->data4, p + 8, sizeof(guid->data4));
+}
+
+/* Look up or add a varstore, shared by all questions that use it. */
+static grub_ssize_t
+hii_varstore_add (const grub_uint8_t* name, grub_size_t max_len, const grub_efi_guid_t* guid)
+{
+    grub_size_t len = 0;
+
+    while (len < max_len && name[len])
+        len++;
+    if (len == 0 || len == max_len)
+        return -1;
+
+    for (grub_size_t i = 0; i < hii_varstore_count; ++i)
+    {
+        if (grub_strlen(hii_varstores[i].name) == len &&
+            0 == grub_memcmp(hii_varstores[i].name, name, len) &&
+            0 == grub_memcmp(&hii_varstores[i].guid, guid, sizeof(grub_efi_guid_t)))
+            return i;
+    }
+
+    if (hii_varstore_count == hii_varstore_capacity)
+    {
+        grub_size_t new_capacity = hii_varstore_capacity ? hii_varstore_capacity * 2 : 16;
+        struct setup_var_hii_varstore* new_varstores = grub_realloc(hii_varstores, new_capacity * sizeof(*hii_varstores));
+        if (!new_varstores)
+            return -1;
+        hii_varstores = new_varstores;
+        hii_varstore_capacity = new_capacity;
+    }
+    hii_varstores[hii_varstore_count].name = grub_strndup((const char*) name, len);
+    if (!hii_varstores[hii_varstore_count].name)
+        return -1;
+    grub_memcpy(&hii_varstores[hii_varstore_count].guid, guid, sizeof(grub_efi_guid_t));
+    return hii_varstore_count++;
+}
+
+/* Offsets of the strings of one string package, indexed by string ID. SCSU
+ * (8-bit) strings are marked with the top bit. */
+struct setup_var_hii_strings
+{
+    const grub_uint8_t* base;
+    grub_size_t size;
+    grub_uint32_t* offsets;
+    grub_size_t count;
+    grub_size_t capacity;
+};
+
+#define HII_STRING_SCSU (0x80000000U)
+
+static int
+hii_strings_set (struct setup_var_hii_strings* strings, grub_size_t id, grub_uint32_t offset)
+{
+    if (id >= strings->capacity)
+    {
+        grub_size_t new_capacity = strings->capacity ? strings->capacity : 256;
+        grub_uint32_t* new_offsets;
+
+        while (new_capacity <= id)
+            new_capacity *= 2;
+        new_offsets = grub_realloc(strings->offsets, new_capacity * sizeof(*new_offsets));
+        if (!new_offsets)
+            return 0;
+        grub_memset(new_offsets + strings->capacity, 0xff, (new_capacity - strings->capacity) * sizeof(*new_offsets));
+        strings->offsets = new_offsets;
+        strings->capacity = new_capacity;
+    }
+    strings->offsets[id] = offset;
+    if (id >= strings->count)
+        strings->count = id + 1;
+    return 1;
+}
+
+/* Skip a NUL-terminated string of the given character width, returning the
+ * position after it, or 0 if it runs past the end. */
+static grub_size_t
+hii_skip_string (const grub_uint8_t* base, grub_size_t pos, grub_size_t end, grub_size_t width)
+{
+    while (pos + width <= end)
+    {
+        int nul = width == 1 ? base[pos] == 0 : hii_get16(base + pos) == 0;
+        pos += width;
+        if (nul)
+            return pos;
+    }
+    return 0;
+}
+
+/* Walk the string blocks of a string package. */
+static int
+hii_parse_strings (const grub_uint8_t* pkg, grub_size_t len, struct setup_var_hii_strings* strings)
+{
+    grub_size_t pos = hii_get32(pkg + 8);
+    grub_size_t id = 1;
+
+    strings->base = pkg;
+    strings->size = len;
+    while (pos < len)
+    {
+        grub_uint8_t type = pkg[pos];
+        grub_size_t count = 1;
+        grub_size_t width = 0;
+
+        switch (type)
+        {
+        case 0x00: /* END */
+            return 1;
+        case 0x10: /* STRING_SCSU */
+            pos += 1;
+            width = 1;
+            break;
+        case 0x11: /* STRING_SCSU_FONT */
+            pos += 2;
+            width = 1;
+            break;
+        case 0x12: /* STRINGS_SCSU */
+        case 0x13: /* STRINGS_SCSU_FONT */
+        case 0x16: /* STRINGS_UCS2 */
+        case 0x17: /* STRINGS_UCS2_FONT */
+            pos += (type & 1) ? 2 : 1;
+            if (pos + 2 > len)
+                return 0;
+            count = hii_get16(pkg + pos);
+            pos += 2;
+            width = type >= 0x16 ? 2 : 1;
+            break;
+        case 0x14: /* STRING_UCS2 */
+            pos += 1;
+            width = 2;
+            break;
+        case 0x15: /* STRING_UCS2_FONT */
+            pos += 2;
+            width = 2;
+            break;
+        case 0x20: /* DUPLICATE */
+            if (pos + 3 > len)
+                return 0;
+            if (hii_get16(pkg + pos + 1) < strings->count &&
+                !hii_strings_set(strings, id, strings->offsets[hii_get16(pkg + pos + 1)]))
+                return 0;
+            id++;
+            pos += 3;
+            continue;
+        case 0x21: /* SKIP2 */
+            if (pos + 3 > len)
+                return 0;
+            id += hii_get16(pkg + pos + 1);
+            pos += 3;
+            continue;
+        case 0x22: /* SKIP1 */
+            if (pos + 2 > len)
+                return 0;
+            id += pkg[pos + 1];
+            pos += 2;
+            continue;
+        case 0x30: /* EXT1 */
+            if (pos + 3 > len || pkg[pos + 2] < 3)
+                return 0;
+            pos += pkg[pos + 2];
+            continue;
+        case 0x31: /* EXT2 */
+            if (pos + 4 > len || hii_get16(pkg + pos + 2) < 4)
+                return 0;
+            pos += hii_get16(pkg + pos + 2);
+            continue;
+        case 0x32: /* EXT4 */
+            if (pos + 6 > len || hii_get32(pkg + pos + 2) < 6)
+                return 0;
+            pos += hii_get32(pkg + pos + 2);
+            continue;
+        default:
+            return 0;
+        }
+
+        for (; count > 0; --count, ++id)
+        {
+            grub_size_t next = hii_skip_string(pkg, pos, len, width);
+            if (!next || !hii_strings_set(strings, id, pos | (width == 1 ? HII_STRING_SCSU : 0)))
+                return 0;
+            pos = next;
+        }
+    }
+    return 1;
+}
+
+/* Copy a string as trimmed ASCII, replacing other characters with '?'. */
+static char*
+hii_string_ascii (const struct setup_var_hii_strings* strings, grub_uint16_t id)
+{
+    grub_uint32_t offset;
+    grub_size_t width;
+    grub_size_t pos;
+    grub_size_t len = 0;
+    char* str;
+
+    if (id >= strings->count || strings->offsets[id] == 0xffffffff)
+        return NULL;
+    offset = strings->offsets[id];
+    width = (offset & HII_STRING_SCSU) ? 1 : 2;
+    pos = offset & ~HII_STRING_SCSU;
+
+    str = grub_malloc((strings->size - pos) / width + 1);
+    if (!str)
+        return NULL;
+    for (; pos + width <= strings->size; pos += width)
+    {
+        grub_uint16_t c = width == 1 ? strings->base[pos] : hii_get16(strings->base + pos);
+        if (c == 0)
+            break;
+        if (len == 0 && c == ' ')
+            continue;
+        str[len++] = (c >= 0x20 && c < 0x7f) ? (char) c : '?';
+    }
+    while (len > 0 && str[len - 1] == ' ')
+        len--;
+    str[len] = 0;
+    return str;
+}
+
+static int
+question_add (char* prompt, grub_uint16_t question_id, grub_size_t varstore, grub_uint16_t offset, grub_uint8_t size)
+{
+    struct setup_var_question* question;
+    grub_size_t bucket;
+
+    if (question_count == question_capacity)
+    {
+        grub_size_t new_capacity = question_capacity ? question_capacity * 2 : 1024;
+        struct setup_var_question* new_questions = grub_realloc(questions, new_capacity * sizeof(*questions));
+        if (!new_questions)
+            return 0;
+        questions = new_questions;
+        question_capacity = new_capacity;
+    }
+
+    question = &questions[question_count];
+    question->prompt = prompt;
+    question->question_id = question_id;
+    question->varstore = varstore;
+    question->offset = offset;
+    question->size = size;
+    bucket = prompt_hash(prompt) % SETUP_VAR_QUESTION_BUCKETS;
+    question->prompt_next = question_prompt_buckets[bucket];
+    question_prompt_buckets[bucket] = question_count + 1;
+    bucket = question_id % SETUP_VAR_QUESTION_BUCKETS;
+    question->id_next = question_id_buckets[bucket];
+    question_id_buckets[bucket] = question_count + 1;
+    question_count++;
+    return 1;
+}
+
+/* VarStoreId to varstore mapping, valid within one form set. */
+struct setup_var_hii_varstore_ref
+{
+    grub_uint16_t id;
+    grub_size_t varstore;
+};
+
+/* Varstore IDs in scope in the form set being parsed. */
+struct setup_var_hii_refs
+{
+    struct setup_var_hii_varstore_ref* refs;
+    grub_size_t count;
+    grub_size_t capacity;
+};
+
+static int
+hii_ref_add (struct setup_var_hii_refs* refs, grub_uint16_t id, grub_size_t varstore)
+{
+    if (refs->count == refs->capacity)
+    {
+        grub_size_t new_capacity = refs->capacity ? refs->capacity * 2 : 16;
+        struct setup_var_hii_varstore_ref* new_refs = grub_realloc(refs->refs, new_capacity * sizeof(*refs->refs));
+        if (!new_refs)
+            return 0;
+        refs->refs = new_refs;
+        refs->capacity = new_capacity;
+    }
+    refs->refs[refs->count].id = id;
+    refs->refs[refs->count++].varstore = varstore;
+    return 1;
+}
+
+/* Walk the IFR opcodes of a forms package and index its questions. */
+static int
+hii_parse_forms (const grub_uint8_t* pkg, grub_size_t len, const struct setup_var_hii_strings* strings)
+{
+    struct setup_var_hii_refs refs = { NULL, 0, 0 };
+    grub_size_t pos = 4;
+    grub_efi_guid_t guid;
+    int ok = 0;
+
+    while (pos + 2 <= len)
+    {
+        const grub_uint8_t* op = pkg + pos;
+        grub_size_t op_len = op[1] & 0x7f;
+        grub_ssize_t varstore = -1;
+
+        if (op_len < 2 || pos + op_len > len)
+            goto out;
+        pos += op_len;
+
+        switch (op[0])
+        {
+        case 0x0e: /* FORM_SET, varstore IDs start over */
+            refs.count = 0;
+            break;
+        case 0x24: /* VARSTORE: guid, id, size, name */
+            if (op_len < 23)
+                break;
+            hii_get_guid(op + 2, &guid);
+            varstore = hii_varstore_add(op + 22, op_len - 22, &guid);
+            if (varstore >= 0 && !hii_ref_add(&refs, hii_get16(op + 18), varstore))
+                goto out;
+            break;
+        case 0x26: /* VARSTORE_EFI: id, guid, attributes, size, name */
+            if (op_len < 27)
+                break;
+            hii_get_guid(op + 4, &guid);
+            varstore = hii_varstore_add(op + 26, op_len - 26, &guid);
+            if (varstore >= 0 && !hii_ref_add(&refs, hii_get16(op + 2), varstore))
+                goto out;
+            break;
+        case 0x05: /* ONE_OF */
+        case 0x06: /* CHECKBOX */
+        case 0x07: /* NUMERIC */
+        {
+            grub_uint16_t varstore_id;
+            grub_uint8_t size = 1;
+            char* prompt;
+            grub_size_t r;
+
+            if (op_len < 14)
+                break;
+            varstore_id = hii_get16(op + 8);
+            for (r = 0; r < refs.count; ++r)
+                if (refs.refs[r].id == varstore_id)
+                    break;
+            if (r == refs.count)
+                break;
+            if (op[0] != 0x06)
+                size = 1 << (op[13] & 0x03);
+            prompt = hii_string_ascii(strings, hii_get16(op + 2));
+            if (!prompt)
+            {
+                if (grub_errno)
+                    goto out;
+                continue;
+            }
+            if (!question_add(prompt, hii_get16(op + 6), refs.refs[r].varstore, hii_get16(op + 10), size))
+            {
+                grub_free(prompt);
+                goto out;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        if (grub_errno)
+            goto out;
+    }
+    ok = 1;
+
+ out:
+    grub_free(refs.refs);
+    return ok;
+}
+
+/* Index the questions of a buffer holding one or more HII package lists, as
+ * returned by EFI_HII_DATABASE_PROTOCOL.ExportPackageLists. */
+static grub_err_t
+hii_parse_package_lists (const grub_uint8_t* buf, grub_size_t size, grub_uint32_t* forms)
+{
+    grub_size_t list = 0;
+
+    *forms = 0;
+    while (list + 20 <= size)
+    {
+        grub_size_t list_len;
+        struct setup_var_hii_strings strings = { NULL, 0, NULL, 0, 0 };
+        const grub_uint8_t* lbuf;
+        const grub_uint8_t* english = NULL;
+        const grub_uint8_t* first = NULL;
+        grub_size_t pos;
+        int ok = 1;
+
+        lbuf = buf + list;
+        list_len = hii_get32(lbuf + 16);
+        if (list_len < 20 || list_len > size - list)
+            return grub_error(GRUB_ERR_BAD_FILE_TYPE, "malformed HII package list at offset 0x%x.", (grub_uint32_t) list);
+
+        /* prompts refer to the string package of the same list; prefer
+         * English, as that is what users copy from IFR dumps */
+        for (pos = 20; pos + 4 <= list_len; )
+        {
+            grub_size_t pkg_len = hii_get32(lbuf + pos) & 0xffffff;
+            grub_uint8_t type = lbuf[pos + 3];
+
+            if (pkg_len < 4 || pkg_len > list_len - pos || type == 0xdf)
+                break;
+            if (type == 0x04 && pkg_len > 46)
+            {
+                const char* lang = (const char*) lbuf + pos + 46;
+                if (!first)
+                    first = lbuf + pos;
+                if (!english && grub_strncmp(lang, "en", 2) == 0)
+                    english = lbuf + pos;
+            }
+            pos += pkg_len;
+        }
+        if (!english)
+            english = first;
+        if (english)
+            ok = hii_parse_strings(english, hii_get32(english) & 0xffffff, &strings);
+
+        for (pos = 20; ok && pos + 4 <= list_len; )
+        {
+            grub_size_t pkg_len = hii_get32(lbuf + pos) & 0xffffff;
+            grub_uint8_t type = lbuf[pos + 3];
+
+            if (pkg_len < 4 || pkg_len > list_len - pos || type == 0xdf)
+                break;
+            if (type == 0x02)
+            {
+                ok = hii_parse_forms(lbuf + pos, pkg_len, &strings);
+                (*forms)++;
+            }
+            pos += pkg_len;
+        }
+        grub_free(strings.offsets);
+        if (grub_errno)
+            return grub_errno;
+        if (!ok)
+            return grub_error(GRUB_ERR_BAD_FILE_TYPE, "malformed HII package in list at offset 0x%x.", (grub_uint32_t) list);
+        list += list_len;
+    }
+    return GRUB_ERR_NONE;
+}
+
+#define SETUP_VAR_HII_DATABASE_GUID \
+    { 0xef9fc172, 0xa1b2, 0x4693, { 0xb3, 0x27, 0x6d, 0x32, 0xfc, 0x41, 0x60, 0x42 } }
+
+struct setup_var_hii_database
+{
+    void* new_package_list;
+    void* remove_package_list;
+    void* update_package_list;
+    void* list_package_lists;
+    grub_efi_status_t (*export_package_lists) (struct setup_var_hii_database* this, void* handle,
+                                               grub_efi_uintn_t* size, void* buffer);
+};
+
+/* Export every package list from the firmware's HII database. */
+static grub_uint8_t*
+hii_export (grub_size_t* size)
+{
+    grub_efi_guid_t hii_database_guid = SETUP_VAR_HII_DATABASE_GUID;
+    struct setup_var_hii_database* db;
+    grub_efi_status_t status;
+    grub_efi_uintn_t buf_size = 0;
+    grub_uint8_t* buf = NULL;
+
+    db = grub_efi_locate_protocol(&hii_database_guid, 0);
+    if (!db)
+    {
+        grub_error(GRUB_ERR_BAD_DEVICE, "HII database protocol not found, please give an exported HII file.");
+        return NULL;
+    }
+
+    status = efi_call_4(db->export_package_lists, db, NULL, &buf_size, NULL);
+    if (status == GRUB_EFI_BUFFER_TOO_SMALL)
+    {
+        buf = grub_malloc(buf_size);
+        if (!buf)
+            return NULL;
+        status = efi_call_4(db->export_package_lists, db, NULL, &buf_size, buf);
+    }
+    if (status == GRUB_EFI_SUCCESS && !buf)
+    {
+        grub_error(GRUB_ERR_BAD_DEVICE, "the HII database is empty.");
+        return NULL;
+    }
+    if (status)
+    {
+        grub_free(buf);
+        grub_error(GRUB_ERR_INVALID_COMMAND, "can't export HII packages using efi (error: 0x%016lx)", status);
+        return NULL;
+    }
+    *size = buf_size;
+    return buf;
+}
+
+/* (Re)build the question index from a file, or from the HII database. */
+static grub_err_t
+questions_load (const char* filename)
+{
+    grub_uint8_t* buf;
+    grub_size_t size = 0;
+    grub_uint32_t forms;
+    grub_err_t err;
+
+    if (filename)
+        buf = read_whole_file(filename, GRUB_FILE_TYPE_LOADENV | GRUB_FILE_TYPE_NO_DECOMPRESS, &size);
+    else
+        buf = hii_export(&size);
+    if (!buf)
+        return grub_errno;
+
+    questions_free();
+    err = hii_parse_package_lists(buf, size, &forms);
+    grub_free(buf);
+    if (err)
+    {
+        questions_free();
+        return err;
+    }
+    questions_loaded = 1;
+    out_info("%u question(s) in %u varstore(s) indexed from %u forms package(s).\n",
+             (grub_uint32_t) question_count, (grub_uint32_t) hii_varstore_count, forms);
+    return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+grub_cmd_setup_var_qload (grub_command_t cmd,
+           int argc, char *argv[])
+{
+    if (argc > 1)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s [file]", cmd->name);
+    return questions_load(argc ? argv[0] : NULL);
+}
+
+static void
+print_question (const struct setup_var_question* question)
+{
+    const struct setup_var_hii_varstore* varstore = &hii_varstores[question->varstore];
+
+    out_printf("  \"%s\" (question 0x%04x): %s %08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x offset 0x%02x size 0x%x\n",
+               question->prompt, question->question_id, varstore->name,
+               varstore->guid.data1, varstore->guid.data2, varstore->guid.data3,
+               varstore->guid.data4[0], varstore->guid.data4[1], varstore->guid.data4[2], varstore->guid.data4[3],
+               varstore->guid.data4[4], varstore->guid.data4[5], varstore->guid.data4[6], varstore->guid.data4[7],
+               question->offset, question->size);
+}
+
+static int
+question_matches (const struct setup_var_question* question, int by_id, grub_uint64_t question_id, const char* prompt)
+{
+    if (by_id)
+        return question->question_id == question_id;
+    return grub_strcasecmp(question->prompt, prompt) == 0;
+}
+
+/* Position + 1 of the next question in the same prompt or QuestionId chain. */
+static grub_size_t
+question_next (grub_size_t i, int by_id)
+{
+    return by_id ? questions[i - 1].id_next : questions[i - 1].prompt_next;
+}
+
+/* Read or set a setting by its prompt in the setup menus, or by its
+ * QuestionId given in hex. */
+static grub_err_t
+grub_cmd_setup_var_q (grub_command_t cmd,
+           int argc, char *argv[])
+{
+    struct setup_var_shadow* shadow = NULL;
+    const struct setup_var_question* question = NULL;
+    const struct setup_var_hii_varstore* varstore;
+    grub_uint64_t question_id = 0;
+    grub_uint64_t value = 0;
+    grub_uint32_t distinct = 0;
+    grub_size_t head;
+    int by_id;
+    grub_err_t err;
+
+    if (argc < 1 || argc > 2)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s question [setval]", cmd->name);
+    if (argc == 2 && !parse_hex_arg(argv[1], &value))
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode your second argument. Please provide a hex value (e.g. 0x01).");
+
+    if (!questions_loaded && questions_load(NULL))
+        return grub_errno;
+
+    by_id = grub_strncmp(argv[0], "0x", 2) == 0 && parse_hex_arg(argv[0], &question_id) && question_id <= 0xffff;
+    if (by_id)
+        head = question_id_buckets[question_id % SETUP_VAR_QUESTION_BUCKETS];
+    else
+        head = question_prompt_buckets[prompt_hash(argv[0]) % SETUP_VAR_QUESTION_BUCKETS];
+
+    /* the same setting often shows up in several forms; only refuse if the
+     * matches point at different bytes */
+    for (grub_size_t i = head; i; i = question_next(i, by_id))
+    {
+        const struct setup_var_question* q = &questions[i - 1];
+        grub_size_t j;
+
+        if (!question_matches(q, by_id, question_id, argv[0]))
+            continue;
+        for (j = head; j != i; j = question_next(j, by_id))
+        {
+            const struct setup_var_question* seen = &questions[j - 1];
+            if (question_matches(seen, by_id, question_id, argv[0]) && seen->varstore == q->varstore &&
+                seen->offset == q->offset && seen->size == q->size)
+                break;
+        }
+        if (j != i)
+            continue;
+
+        if (distinct++ == 1)
+        {
+            out_printf("\"%s\" matches several settings:\n", argv[0]);
+            print_question(question);
+        }
+        if (distinct > 1)
+            print_question(q);
+        question = q;
+    }
+    if (!question)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "question \"%s\" not found.", argv[0]);
+    if (distinct > 1)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "\"%s\" is ambiguous, please use setup_var_gv with one of the settings above.", argv[0]);
+    if (argc == 2 && value > field_max(question->size))
+        return grub_error(GRUB_ERR_OUT_OF_RANGE, "\"%s\" is 0x%x byte(s) wide, the value can be at most 0x%llx.",
+                          question->prompt, question->size, (unsigned long long) field_max(question->size));
+
+    varstore = &hii_varstores[question->varstore];
+    out_info("\"%s\" is %s offset 0x%02x size 0x%x.\n", question->prompt, varstore->name, question->offset, question->size);
+    if (varstore_open(varstore->name, &varstore->guid, &shadow))
+        return grub_errno;
+
+    if (!range_fits(question->offset, question->size, shadow->size))
+    {
+        err = grub_error(GRUB_ERR_BAD_ARGUMENT, "offset is out of range.");
+        goto fail;
+    }
+    out_printf("offset 0x%02x is: 0x%02llx\n", question->offset,
+               (unsigned long long) pack_data(shadow->data, question->offset, question->size));
+
+    err = GRUB_ERR_NONE;
+    if (argc == 2)
+    {
+        out_printf("setting offset 0x%02x to 0x%02llx\n", question->offset, (unsigned long long) value);
+        set_data(shadow->data, question->offset, question->size, value);
+        err = shadow_store(shadow);
+    }
+
+ fail:
+    shadow_release(shadow);
+    return err;
+}
+
+/* Match a UCS-2 variable name against an ASCII pattern in which '*' matches
+ * any run of characters and '?' any single character. */
+static int
+varname_match (const grub_efi_char16_t* name, const char* pattern)
+{
+    const grub_efi_char16_t* star_name = NULL;
+    const char* star_pattern = NULL;
+
+    while (*name)
+    {
+        if (*pattern == '*')
+        {
+            star_pattern = ++pattern;
+            star_name = name;
+        }
+        else if (*pattern && (*pattern == '?' || (grub_uint8_t) *pattern == *name))
+        {
+            pattern++;
+            name++;
+        }
+        else if (star_pattern)
+        {
+            pattern = star_pattern;
+            name = ++star_name;
+        }
+        else
+            return 0;
+    }
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == 0;
+}
+
+static int
+varname_has_prefix (const grub_efi_char16_t* name, const char* prefix)
+{
+    for (; *prefix; ++prefix, ++name)
+    {
+        if (*name != (grub_uint8_t) *prefix)
+            return 0;
+    }
+    return 1;
+}
+
+/* Read an indexed variable into the shared pool, growing the pool if needed,
+ * for commands that go through many variables. The caller owns the pool. */
+static grub_efi_status_t
+index_read_pooled (struct setup_var_index_entry* entry, grub_efi_uint32_t* attr, grub_efi_uintn_t* size)
+{
+    grub_efi_status_t status;
+
+    *size = var_pool_size;
+    status = rt_get_variable(entry->name, &entry->guid, attr, size, var_pool);
+    if (status == GRUB_EFI_BUFFER_TOO_SMALL)
+    {
+        if (!pool_reserve(*size))
+            return GRUB_EFI_OUT_OF_RESOURCES;
+        *size = var_pool_size;
+        status = rt_get_variable(entry->name, &entry->guid, attr, size, var_pool);
+    }
+    if (status == GRUB_EFI_SUCCESS)
+        index_update(entry, *attr, *size);
+    return status;
+}
+
+/* Search the contents of every variable for a byte pattern. The variables are
+ * read one after another into the shared pool, which grows to the largest one,
+ * and searched with Boyer-Moore-Horspool. */
+static grub_err_t
+grub_cmd_setup_var_find (grub_command_t cmd,
+           int argc, char *argv[])
+{
+    grub_uint8_t pattern[SETUP_VAR_MAX_PATTERN_SIZE];
+    grub_size_t pattern_len = 0;
+    grub_size_t shift[256];
+    const char* hex = NULL;
+    const char* name_pattern = NULL;
+    grub_efi_guid_t guid;
+    int filter_guid = 0;
+    grub_uint64_t max_matches = SETUP_VAR_FIND_MAX_MATCHES;
+    grub_uint32_t matches = 0;
+    grub_uint32_t matched_vars = 0;
+    grub_uint32_t searched = 0;
+    grub_uint32_t failed = 0;
+    grub_err_t err = GRUB_ERR_NONE;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (0 == grub_strcmp(argv[i], "--guid") && i + 1 < argc)
+        {
+            if (!parse_guid(argv[++i], &guid))
+                return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode GUID \"%s\".", argv[i]);
+            filter_guid = 1;
+        }
+        else if (0 == grub_strcmp(argv[i], "--name") && i + 1 < argc)
+            name_pattern = argv[++i];
+        else if (0 == grub_strcmp(argv[i], "--max") && i + 1 < argc)
+        {
+            if (!parse_hex_arg(argv[++i], &max_matches))
+                return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode match count \"%s\".", argv[i]);
+        }
+        else if (!hex && argv[i][0] != '-')
+            hex = argv[i];
+        else
+            return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s hexpattern [--guid guid] [--name pattern] [--max count]", cmd->name);
+    }
+    if (!hex)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s hexpattern [--guid guid] [--name pattern] [--max count]", cmd->name);
+
+    /* the pattern is given as hex bytes in memory order, e.g. 0x0a0b or 0a0b */
+    if (hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X'))
+        hex += 2;
+    while (*hex)
+    {
+        grub_uint64_t byte;
+
+        if (pattern_len == sizeof(pattern) || !parse_hex_digits(&hex, 2, &byte))
+            return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode the pattern. Please provide up to %u bytes in hex (e.g. 0x0a0b0c).",
+                              (grub_uint32_t) sizeof(pattern));
+        pattern[pattern_len++] = byte;
+    }
+    if (pattern_len == 0)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "the pattern is empty.");
+
+    for (grub_size_t c = 0; c < ARRAY_SIZE(shift); ++c)
+        shift[c] = pattern_len;
+    for (grub_size_t k = 0; k + 1 < pattern_len; ++k)
+        shift[pattern[k]] = pattern_len - 1 - k;
+
+    if (index_ensure())
+        return grub_errno;
+    if (var_pool_busy || !pool_reserve(MAX_VARIABLE_SIZE))
+        return grub_errno ? grub_errno : grub_error(GRUB_ERR_BAD_ARGUMENT, "the variable buffer is in use.");
+    var_pool_busy = 1;
+
+    for (grub_size_t i = 0; i < var_index_count; ++i)
+    {
+        struct setup_var_index_entry* entry = &var_index[i];
+        grub_efi_status_t status;
+        grub_efi_uint32_t attr;
+        grub_efi_uintn_t size;
+        grub_uint32_t found = 0;
+
+        if (name_pattern && !varname_match(entry->name, name_pattern))
+            continue;
+        if (filter_guid && grub_memcmp(&entry->guid, &guid, sizeof(grub_efi_guid_t)) != 0)
+            continue;
+
+        status = index_read_pooled(entry, &attr, &size);
+        if (status == GRUB_EFI_OUT_OF_RESOURCES && grub_errno)
+        {
+            err = grub_errno;
+            break;
+        }
+        if (status)
+        {
+            failed++;
+            continue;
+        }
+        searched++;
+
+        for (grub_size_t pos = 0; pos + pattern_len <= size; )
+        {
+            grub_uint8_t last = var_pool[pos + pattern_len - 1];
+
+            if (last == pattern[pattern_len - 1] && 0 == grub_memcmp(var_pool + pos, pattern, pattern_len - 1))
+            {
+                /* past the cap, matches are only counted */
+                if (!max_matches || matches + found < max_matches)
+                {
+                    out_printf("%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x offset 0x%04x: ",
+                               entry->guid.data1, entry->guid.data2, entry->guid.data3,
+                               entry->guid.data4[0], entry->guid.data4[1], entry->guid.data4[2], entry->guid.data4[3],
+                               entry->guid.data4[4], entry->guid.data4[5], entry->guid.data4[6], entry->guid.data4[7],
+                               (grub_uint32_t) pos);
+                    print_varname(entry->name);
+                    out_printf("\n");
+                }
+                found++;
+            }
+            pos += shift[last];
+        }
+        if (found)
+            matched_vars++;
+        matches += found;
+    }
+    var_pool_busy = 0;
+    if (err)
+        return err;
+
+    if (failed)
+        out_printf("%u variable(s) could not be read.\n", failed);
+    if (max_matches && matches > max_matches)
+        out_printf("%u more match(es) omitted, use --max to show more (--max 0 shows all).\n",
+                   (grub_uint32_t) (matches - max_matches));
+    out_info("%u match(es) in %u of %u variables searched.\n", matches, matched_vars, searched);
+    return GRUB_ERR_NONE;
+}
+
+/* Fingerprint of the variable store, written by setup_var_fingerprint and
+ * compared by setup_var_diff. The header is followed by one record per
+ * variable, each followed by the UCS-2 name and, with
+ * SETUP_VAR_FINGERPRINT_CONTENTS, by the contents. Records are sorted by GUID
+ * and name, so the store CRC does not depend on the enumeration order. All
+ * fields are little endian. */
+struct setup_var_fingerprint
+{
+    char magic[8];
+    grub_uint32_t count;
+    grub_uint32_t flags;
+    /* CRC-32 of all records */
+    grub_uint32_t store_crc;
+} GRUB_PACKED;
+
+struct setup_var_fingerprint_record
+{
+    grub_uint8_t guid[16];
+    grub_uint32_t attr;
+    grub_uint32_t size;
+    /* CRC-32 of the name, GUID, attributes and contents */
+    grub_uint32_t crc;
+    grub_uint16_t name_size;
+} GRUB_PACKED;
+
+/* Order of variables in a fingerprint. */
+static int
+fingerprint_key_cmp (const void* guid_a, const void* name_a, grub_size_t name_size_a,
+                     const void* guid_b, const void* name_b, grub_size_t name_size_b)
+{
+    int cmp = grub_memcmp(guid_a, guid_b, sizeof(grub_efi_guid_t));
+
+    if (cmp)
+        return cmp;
+    if (name_size_a != name_size_b)
+        return name_size_a < name_size_b ? -1 : 1;
+    return grub_memcmp(name_a, name_b, name_size_a);
+}
+
+static grub_err_t
+grub_cmd_setup_var_fingerprint (grub_command_t cmd,
+           int argc, char *argv[])
+{
+    struct setup_var_fingerprint* header;
+    struct setup_var_fingerprint_record record;
+    grub_size_t* order = NULL;
+    grub_uint8_t* image = NULL;
+    grub_size_t image_size;
+    grub_size_t pos;
+    grub_uint32_t count = 0;
+    grub_uint32_t failed = 0;
+    grub_uint32_t store_crc;
+    grub_uint32_t flags = 0;
+    grub_err_t err = GRUB_ERR_NONE;
+
+    if (argc > 0 && 0 == grub_strcmp(argv[0], "--contents"))
+    {
+        flags |= SETUP_VAR_FINGERPRINT_CONTENTS;
+        argc--;
+        argv++;
+    }
+    if (argc > 1)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s [--contents] [file]", cmd->name);
+
+    if (index_ensure())
+        return grub_errno;
+    if (var_pool_busy || !pool_reserve(MAX_VARIABLE_SIZE))
+        return grub_errno ? grub_errno : grub_error(GRUB_ERR_BAD_ARGUMENT, "the variable buffer is in use.");
+
+    /* sort the variables, insertion sort is plenty for a few hundred */
+    order = grub_malloc((var_index_count ? var_index_count : 1) * sizeof(*order));
+    if (!order)
+        return grub_errno;
+    image_size = sizeof(*header);
+    for (grub_size_t i = 0; i < var_index_count; ++i)
+    {
+        struct setup_var_index_entry* entry = &var_index[i];
+        grub_size_t j = i;
+
+        while (j > 0 && fingerprint_key_cmp(&var_index[order[j - 1]].guid, var_index[order[j - 1]].name,
+                                            var_index[order[j - 1]].name_size,
+                                            &entry->guid, entry->name, entry->name_size) > 0)
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+        image_size += sizeof(record) + entry->name_size;
+    }
+
+    image = grub_zalloc(image_size);
+    if (!image)
+    {
+        grub_free(order);
+        return grub_errno;
+    }
+
+    var_pool_busy = 1;
+    pos = sizeof(*header);
+    for (grub_size_t i = 0; i < var_index_count; ++i)
+    {
+        struct setup_var_index_entry* entry = &var_index[order[i]];
+        grub_efi_status_t status;
+        grub_efi_uint32_t attr;
+        grub_efi_uintn_t size;
+        grub_uint32_t crc;
+
+        status = index_read_pooled(entry, &attr, &size);
+        if (status == GRUB_EFI_OUT_OF_RESOURCES && grub_errno)
+        {
+            err = grub_errno;
+            break;
+        }
+        if (status)
+        {
+            failed++;
+            continue;
+        }
+
+        if (flags & SETUP_VAR_FINGERPRINT_CONTENTS)
+        {
+            /* the sizes are not all known up front, grow the image as we go */
+            grub_uint8_t* new_image = grub_realloc(image, image_size + size);
+
+            if (!new_image)
+            {
+                err = grub_errno;
+                break;
+            }
+            image = new_image;
+            image_size += size;
+        }
+
+        grub_memcpy(record.guid, &entry->guid, sizeof(record.guid));
+        record.attr = grub_cpu_to_le32(attr);
+        record.size = grub_cpu_to_le32(size);
+        record.name_size = grub_cpu_to_le16(entry->name_size);
+        crc = crc32_update(0, entry->name, entry->name_size);
+        crc = crc32_update(crc, record.guid, sizeof(record.guid));
+        crc = crc32_update(crc, &record.attr, sizeof(record.attr));
+        crc = crc32_update(crc, var_pool, size);
+        record.crc = grub_cpu_to_le32(crc);
+
+        grub_memcpy(image + pos, &record, sizeof(record));
+        grub_memcpy(image + pos + sizeof(record), entry->name, entry->name_size);
+        pos += sizeof(record) + entry->name_size;
+        if (flags & SETUP_VAR_FINGERPRINT_CONTENTS)
+        {
+            grub_memcpy(image + pos, var_pool, size);
+            pos += size;
+        }
+        count++;
+    }
+    var_pool_busy = 0;
+    grub_free(order);
+    if (err)
+        goto out;
+
+    store_crc = crc32_update(0, image + sizeof(*header), pos - sizeof(*header));
+    header = (struct setup_var_fingerprint*) image;
+    grub_memcpy(header->magic, SETUP_VAR_FINGERPRINT_MAGIC, sizeof(header->magic));
+    header->count = grub_cpu_to_le32(count);
+    header->flags = grub_cpu_to_le32(flags);
+    header->store_crc = grub_cpu_to_le32(store_crc);
+
+    if (failed)
+        out_printf("%u variable(s) could not be read and are left out.\n", failed);
+    out_printf("store fingerprint: %08x (%u variables)\n", store_crc, count);
+    if (argc == 1)
+    {
+        err = write_file_in_place(argv[0], image, pos);
+        if (!err)
+            out_info("fingerprint written to %s (%u bytes).\n", argv[0], (grub_uint32_t) pos);
+    }
+
+ out:
+    grub_free(image);
+    return err;
+}
+
+/* A fingerprint file read back, with its records checked. */
+struct setup_var_fingerprint_file
+{
+    grub_uint8_t* buf;
+    grub_size_t size;
+    grub_uint32_t count;
+    grub_uint32_t flags;
+    grub_uint32_t store_crc;
+};
+
+/* Length of the record at p, including its name and contents. */
+static grub_size_t
+fingerprint_record_size (const struct setup_var_fingerprint_file* fp, const grub_uint8_t* p)
+{
+    struct setup_var_fingerprint_record record;
+    grub_size_t size;
+
+    grub_memcpy(&record, p, sizeof(record));
+    size = sizeof(record) + grub_le_to_cpu16(record.name_size);
+    if (fp->flags & SETUP_VAR_FINGERPRINT_CONTENTS)
+        size += grub_le_to_cpu32(record.size);
+    return size;
+}
+
+static grub_err_t
+fingerprint_load (const char* filename, struct setup_var_fingerprint_file* fp)
+{
+    struct setup_var_fingerprint header;
+    grub_size_t pos;
+
+    fp->buf = read_whole_file(filename, GRUB_FILE_TYPE_LOADENV | GRUB_FILE_TYPE_NO_DECOMPRESS, &fp->size);
+    if (!fp->buf)
+        return grub_errno;
+    if (fp->size < sizeof(header))
+        goto bad;
+    grub_memcpy(&header, fp->buf, sizeof(header));
+    if (grub_memcmp(header.magic, SETUP_VAR_FINGERPRINT_MAGIC, sizeof(header.magic)) != 0)
+        goto bad;
+    fp->count = grub_le_to_cpu32(header.count);
+    fp->flags = grub_le_to_cpu32(header.flags);
+    if (fp->flags & ~SETUP_VAR_FINGERPRINT_CONTENTS)
+        goto bad;
+    fp->store_crc = grub_le_to_cpu32(header.store_crc);
+
+    /* the file may be longer than the fingerprint, find where it ends */
+    pos = sizeof(header);
+    for (grub_uint32_t i = 0; i < fp->count; ++i)
+    {
+        struct setup_var_fingerprint_record record;
+        grub_size_t name_size;
+
+        if (fp->size - pos < sizeof(record))
+            goto bad;
+        grub_memcpy(&record, fp->buf + pos, sizeof(record));
+        name_size = grub_le_to_cpu16(record.name_size);
+        if (name_size < sizeof(grub_efi_char16_t) || name_size > MAX_VARIABLE_SIZE ||
+            name_size % sizeof(grub_efi_char16_t) != 0 || fp->size - pos - sizeof(record) < name_size)
+            goto bad;
+        if ((fp->flags & SETUP_VAR_FINGERPRINT_CONTENTS) &&
+            fp->size - pos - sizeof(record) - name_size < grub_le_to_cpu32(record.size))
+            goto bad;
+        pos += fingerprint_record_size(fp, fp->buf + pos);
+    }
+    if (crc32_update(0, fp->buf + sizeof(header), pos - sizeof(header)) != fp->store_crc)
+    {
+        grub_free(fp->buf);
+        fp->buf = NULL;
+        return grub_error(GRUB_ERR_BAD_FILE_TYPE, "%s is corrupted (checksum mismatch).", filename);
+    }
+    fp->size = pos;
+    return GRUB_ERR_NONE;
+
+ bad:
+    grub_free(fp->buf);
+    fp->buf = NULL;
+    return grub_error(GRUB_ERR_BAD_FILE_TYPE, "%s is not a setup_var fingerprint.", filename);
+}
+
+static void
+print_fingerprint_record (char change, const grub_uint8_t* p)
+{
+    struct setup_var_fingerprint_record record;
+    grub_efi_char16_t name[MAX_VARIABLE_SIZE / 2 + 1];
+    grub_efi_guid_t guid;
+    grub_size_t name_size;
+
+    grub_memcpy(&record, p, sizeof(record));
+    name_size = grub_le_to_cpu16(record.name_size);
+    grub_memcpy(name, p + sizeof(record), name_size);
+    name[name_size / sizeof(grub_efi_char16_t)] = 0;
+    grub_memcpy(&guid, record.guid, sizeof(guid));
+
+    out_printf("%c %08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x ", change,
+               guid.data1, guid.data2, guid.data3,
+               guid.data4[0], guid.data4[1], guid.data4[2], guid.data4[3],
+               guid.data4[4], guid.data4[5], guid.data4[6], guid.data4[7]);
+    print_varname(name);
+    out_printf(" (0x%x bytes)\n", grub_le_to_cpu32(record.size));
+}
+
+/* Print the bytes of a changed variable that differ between two fingerprints
+ * taken with --contents. The records are at arbitrary offsets in the files,
+ * so this goes byte by byte rather than through diff_next. */
+static void
+print_changed_bytes (const grub_uint8_t* old, const grub_uint8_t* new, grub_size_t size)
+{
+    grub_uint32_t printed = 0;
+
+    for (grub_size_t i = 0; i < size; ++i)
+    {
+        if (old[i] == new[i])
+            continue;
+        if (printed < SETUP_VAR_MAX_PRINTED_RANGES)
+            out_printf("    0x%02x: 0x%02x -> 0x%02x\n", (grub_uint32_t) i, old[i], new[i]);
+        else if (printed == SETUP_VAR_MAX_PRINTED_RANGES)
+            out_printf("    ...\n");
+        printed++;
+    }
+}
+
+/* Compare two fingerprints. Both are sorted, so one merge pass finds the
+ * variables that were added, removed or changed. When both carry the
+ * contents, the changed bytes are listed too. */
+static grub_err_t
+grub_cmd_setup_var_diff (grub_command_t cmd,
+           int argc, char *argv[])
+{
+    struct setup_var_fingerprint_file a = { NULL, 0, 0, 0, 0 };
+    struct setup_var_fingerprint_file b = { NULL, 0, 0, 0, 0 };
+    grub_size_t pa = sizeof(struct setup_var_fingerprint);
+    grub_size_t pb = sizeof(struct setup_var_fingerprint);
+    grub_uint32_t added = 0;
+    grub_uint32_t removed = 0;
+    grub_uint32_t changed = 0;
+
+    if (argc != 2)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s file1 file2", cmd->name);
+    if (fingerprint_load(argv[0], &a) || fingerprint_load(argv[1], &b))
+    {
+        grub_free(a.buf);
+        return grub_errno;
+    }
+
+    if (a.store_crc == b.store_crc && a.count == b.count)
+    {
+        out_printf("fingerprints are identical (%08x, %u variables).\n", a.store_crc, a.count);
+        grub_free(a.buf);
+        grub_free(b.buf);
+        return GRUB_ERR_NONE;
+    }
+
+    while (pa < a.size || pb < b.size)
+    {
+        struct setup_var_fingerprint_record ra;
+        struct setup_var_fingerprint_record rb;
+        int cmp;
+
+        if (pa < a.size)
+            grub_memcpy(&ra, a.buf + pa, sizeof(ra));
+        if (pb < b.size)
+            grub_memcpy(&rb, b.buf + pb, sizeof(rb));
+
+        if (pa >= a.size)
+            cmp = 1;
+        else if (pb >= b.size)
+            cmp = -1;
+        else
+            cmp = fingerprint_key_cmp(ra.guid, a.buf + pa + sizeof(ra), grub_le_to_cpu16(ra.name_size),
+                                      rb.guid, b.buf + pb + sizeof(rb), grub_le_to_cpu16(rb.name_size));
+
+        if (cmp < 0)
+        {
+            print_fingerprint_record('-', a.buf + pa);
+            removed++;
+            pa += fingerprint_record_size(&a, a.buf + pa);
+        }
+        else if (cmp > 0)
+        {
+            print_fingerprint_record('+', b.buf + pb);
+            added++;
+            pb += fingerprint_record_size(&b, b.buf + pb);
+        }
+        else
+        {
+            if (ra.crc != rb.crc || ra.attr != rb.attr || ra.size != rb.size)
+            {
+                print_fingerprint_record('~', b.buf + pb);
+                if (ra.attr != rb.attr)
+                    out_printf("    attributes 0x%x -> 0x%x\n", grub_le_to_cpu32(ra.attr), grub_le_to_cpu32(rb.attr));
+                if ((a.flags & b.flags & SETUP_VAR_FINGERPRINT_CONTENTS) && ra.size == rb.size)
+                    print_changed_bytes(a.buf + pa + sizeof(ra) + grub_le_to_cpu16(ra.name_size),
+                                        b.buf + pb + sizeof(rb) + grub_le_to_cpu16(rb.name_size),
+                                        grub_le_to_cpu32(rb.size));
+                changed++;
+            }
+            pa += fingerprint_record_size(&a, a.buf + pa);
+            pb += fingerprint_record_size(&b, b.buf + pb);
+        }
+    }
+    out_printf("%u added, %u removed, %u changed.\n", added, removed, changed);
+
+    grub_free(a.buf);
+    grub_free(b.buf);
+    return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+grub_cmd_lsefivar (grub_command_t cmd,
+           int argc, char *argv[])
+{
+    grub_efi_status_t status;
+    struct setup_var_index_entry* entry;
+    const char* prefix = NULL;
+    const char* pattern = NULL;
+    grub_efi_guid_t guid;
+    int filter_guid = 0;
+    grub_uint64_t min_size = 0;
+    grub_uint64_t max_size = ~(grub_uint64_t) 0;
+    int filter_size = 0;
+    int names_only = 0;
+    grub_uint32_t listed = 0;
+    grub_efi_uint64_t store_size;
+    grub_efi_uint64_t store_free;
+    grub_efi_uint64_t store_max_var;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (0 == grub_strcmp(argv[i], "--names-only"))
+        {
+            names_only = 1;
+            continue;
+        }
+        if (i + 1 == argc)
+            return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s [--prefix prefix] [--name pattern] [--guid guid] "
+                              "[--min-size size] [--max-size size] [--names-only]", cmd->name);
+        if (0 == grub_strcmp(argv[i], "--prefix"))
+            prefix = argv[++i];
+        else if (0 == grub_strcmp(argv[i], "--name"))
+            pattern = argv[++i];
+        else if (0 == grub_strcmp(argv[i], "--guid"))
+        {
+            if (!parse_guid(argv[++i], &guid))
+                return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode GUID \"%s\".", argv[i]);
+            filter_guid = 1;
+        }
+        else if (0 == grub_strcmp(argv[i], "--min-size"))
+        {
+            if (!parse_hex_arg(argv[++i], &min_size))
+                return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode size \"%s\". Please provide a hex value (e.g. 0x10).", argv[i]);
+            filter_size = 1;
+        }
+        else if (0 == grub_strcmp(argv[i], "--max-size"))
+        {
+            if (!parse_hex_arg(argv[++i], &max_size))
+                return grub_error(GRUB_ERR_BAD_ARGUMENT, "can't decode size \"%s\". Please provide a hex value (e.g. 0x10).", argv[i]);
+            filter_size = 1;
+        }
+        else
+            return grub_error(GRUB_ERR_BAD_ARGUMENT, "unknown option \"%s\".", argv[i]);
+    }
+    if (names_only && filter_size)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "--names-only can't be combined with size filters.");
+
+    /* scan for Setup variable */
+    out_info("Listing EFI variables...\n");
+    if (index_ensure())
+        return grub_errno;
+
+    for (grub_size_t i = 0; i < var_index_count; ++i)
+    {
+        entry = &var_index[i];
+
+        /* filters that need no firmware call go first */
+        if (prefix && !varname_has_prefix(entry->name, prefix))
+            continue;
+        if (pattern && !varname_match(entry->name, pattern))
+            continue;
+        if (filter_guid && grub_memcmp(&entry->guid, &guid, sizeof(grub_efi_guid_t)) != 0)
+            continue;
+
+        if (names_only)
+        {
+            out_printf("name size: %02u, var guid: %08x-%04x-%04x - %02x-%02x-%02x-%02x-%02x-%02x-%02x-%02x, name: ",
+            (grub_uint32_t) entry->name_size,
+            entry->guid.data1,
+            entry->guid.data2,
+            entry->guid.data3,
+            entry->guid.data4[0], entry->guid.data4[1], entry->guid.data4[2], entry->guid.data4[3], entry->guid.data4[4], entry->guid.data4[5], entry->guid.data4[6], entry->guid.data4[7]
+            );
+            print_varname(entry->name);
+            out_printf("\n");
+            listed++;
+            continue;
+        }
+
+        status = index_probe_size(entry);
+        if (status)
+        {
+            if (filter_size)
+                continue;
+            out_printf("error (0x%x) getting var size:\n  ", (grub_uint32_t)status);
+        }
+        else if (entry->size < min_size || entry->size > max_size)
+            continue;
+
+        out_printf("name size: %02u, var size: %06u (0x%06x), var guid: %08x-%04x-%04x - %02x-%02x-%02x-%02x-%02x-%02x-%02x-%02x, name: ",
+        (grub_uint32_t) entry->name_size, (grub_uint32_t) entry->size, (grub_uint32_t) entry->size,
+        entry->guid.data1,
+        entry->guid.data2,
+        entry->guid.data3,
+        entry->guid.data4[0], entry->guid.data4[1], entry->guid.data4[2], entry->guid.data4[3], entry->guid.data4[4], entry->guid.data4[5], entry->guid.data4[6], entry->guid.data4[7]
+        );
+        print_varname(entry->name);
+        out_printf("\n");
+        listed++;
+    }
+    out_info("%u of %u variables listed.\n", listed, (grub_uint32_t) var_index_count);
+
+    /* show how close the store is to needing a reclaim */
+    if (!rt_query_variable_info(GRUB_EFI_VARIABLE_NON_VOLATILE | GRUB_EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                                GRUB_EFI_VARIABLE_RUNTIME_ACCESS, &store_size, &store_free, &store_max_var))
+        out_printf("variable store: 0x%llx of 0x%llx bytes free (%u%%), largest variable 0x%llx bytes.\n",
+                   (unsigned long long) store_free, (unsigned long long) store_size,
+                   store_size ? (grub_uint32_t) grub_divmod64(store_free * 100, store_size, NULL) : 0,
+                   (unsigned long long) store_max_var);
+
+    return grub_errno;
+}
+
+/* Print the variable service statistics collected since the module was
+ * loaded or last reset. */
+static grub_err_t
+grub_cmd_setup_var_stats (grub_command_t cmd,
+           int argc, char *argv[])
+{
+    int reset = 0;
+
+    if (argc == 1 && 0 == grub_strcmp(argv[0], "--reset"))
+        reset = 1;
+    else if (argc != 0)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "Usage: %s [--reset]", cmd->name);
+
+    out_info("variable service statistics (%s):\n", backend->name);
+    out_printf("%-20s %8s %8s %9s %10s %10s %8s\n",
+               "service", "calls", "errors", "too small", "bytes", "total ms", "max ms");
+    for (int i = 0; i < SERVICE_COUNT; ++i)
+    {
+        struct setup_var_service_stats* stats = &service_stats[i];
+
+        out_printf("%-20s %8llu %8llu %9llu %10llu %10llu %8llu\n", service_names[i],
+                   (unsigned long long) stats->calls,
+                   (unsigned long long) stats->errors,
+                   (unsigned long long) stats->too_small,
+                   (unsigned long long) stats->bytes,
+                   (unsigned long long) stats->total_ms,
+                   (unsigned long long) stats->max_ms);
+    }
+    out_printf("%llu unchanged write(s) skipped.\n", (unsigned long long) writes_skipped);
+
+    if (reset)
+    {
+        grub_memset(service_stats, 0, sizeof(service_stats));
+        writes_skipped = 0;
+        out_info("statistics reset.\n");
+    }
+    return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+grub_cmd_setup_var_rescan (grub_command_t cmd __attribute__ ((unused)),
+           int argc __attribute__ ((unused)), char *argv[] __attribute__ ((unused)))
+{
+    if (index_build())
+        return grub_errno;
+    out_printf("indexed %u EFI variables.\n", (grub_uint32_t) var_index_count);
+    return GRUB_ERR_NONE;
+}
+
+#ifdef GRUB_UTIL
+void
+grub_setup_var_set_backend (const struct setup_var_backend* new_backend)
+{
+    /* nothing cached about the old store may outlive it */
+    session_end();
+    index_invalidate();
+    if (backend->close)
+        backend->close();
+    backend = new_backend ? new_backend : &efi_backend;
+}
+
+int
+grub_setup_var_parse_guid (const char* str, grub_efi_guid_t* guid)
+{
+    return parse_guid(str, guid);
+}
+#endif
+
+struct setup_var_command
+{
+    const char* name;
+    grub_command_func_t func;
+    const char* summary;
+    const char* description;
+};
+
+static struct setup_var_command setup_var_commands[] =
+{
+    { "setup_var", grub_cmd_setup_var,
+      "setup_var offset [setval]",
+      "Read/Write specific (byte) offset of setup variable." },
+    { "setup_var2", grub_cmd_setup_var,
+      "setup_var2 offset [setval]",
+      "Read/Write specific (byte) offset of setup and custom variables." },
+    { "setup_var_3", grub_cmd_setup_var,
+      "setup_var_3 offset [setval]",
+      "Read/Write specific (byte) offset of setup variables ignoring error, use with great caution!!!" },
+    { "setup_var_vs", grub_cmd_setup_var,
+      "setup_var_vs offset [size] [setval]",
+      "Read/write specific (byte) offset of setup variable, capable of longer value (specify with size)." },
+    { "setup_var_cv", grub_cmd_setup_var,
+      "setup_var_cv varstorename offset [size] [setval]",
+      "Read/write specific (byte) offset of specified variable, capable of longer value (specify with size)." },
+    { "setup_var_gv", grub_cmd_setup_var_gv,
+      "setup_var_gv varstorename guid offset [size] [setval]",
+      "Read/write specific (byte) offset of variable with given name and GUID, without scanning the varstore." },
+    { "setup_var_dump", grub_cmd_setup_var_dump,
+      "setup_var_dump varstorename [guid] [offset length | offset:size ...]",
+      "Hex dump a varstore or a range of it, or decode several offset:size fields, with a single read." },
+    { "setup_var_save", grub_cmd_setup_var_save,
+      "setup_var_save varstorename [guid] file",
+      "Save the contents, GUID and attributes of a varstore to an existing file, overwriting it." },
+    { "setup_var_restore", grub_cmd_setup_var_restore,
+      "setup_var_restore file",
+      "Restore a varstore saved with setup_var_save, writing it only if it differs." },
+    { "setup_var_qload", grub_cmd_setup_var_qload,
+      "setup_var_qload [file]",
+      "Index the setup questions from an exported HII package list file, or from the firmware's HII database." },
+    { "setup_var_q", grub_cmd_setup_var_q,
+      "setup_var_q question [setval]",
+      "Read or set a setting by its prompt in the setup menus, or by its QuestionId (e.g. 0x1234)." },
+    { "setup_var_find", grub_cmd_setup_var_find,
+      "setup_var_find hexpattern [--guid guid] [--name pattern] [--max count]",
+      "Search the contents of all variables for a byte pattern and print the varstore and offset of each match." },
+    { "setup_var_fingerprint", grub_cmd_setup_var_fingerprint,
+      "setup_var_fingerprint [--contents] [file]",
+      "Hash every variable and the whole store, optionally writing the hashes (and the contents) to an existing file." },
+    { "setup_var_diff", grub_cmd_setup_var_diff,
+      "setup_var_diff file1 file2",
+      "List the variables added, removed or changed between two fingerprint files." },
+    { "lsefivar", grub_cmd_lsefivar,
+      "lsefivar [--prefix prefix] [--name pattern] [--guid guid] [--min-size size] [--max-size size] [--names-only]",
+      "Lists efi variables, optionally filtered by name, GUID and size." },
+    { "setup_var_stats", grub_cmd_setup_var_stats,
+      "setup_var_stats [--reset]",
+      "Show call counts, timing and bytes moved for each EFI variable service, optionally resetting them." },
+    { "setup_var_rescan", grub_cmd_setup_var_rescan,
+      "setup_var_rescan",
+      "Rebuild the cached index of efi variables." },
+    { "setup_var_begin", grub_cmd_setup_var_begin,
+      "setup_var_begin",
+      "Start staging setup_var writes in memory instead of writing them right away." },
+    { "setup_var_commit", grub_cmd_setup_var_commit,
+      "setup_var_commit",
+      "Write all staged changes, one write per changed varstore." },
+    { "setup_var_abort", grub_cmd_setup_var_abort,
+      "setup_var_abort",
+      "Drop all staged changes." },
+    { "setup_var_apply", grub_cmd_setup_var_apply,
+      "setup_var_apply file",
+      "Check and apply a list of \"varstore [guid] offset size value\" lines, one write per varstore." },
+};
+
+static grub_command_t setup_var_cmds[ARRAY_SIZE(setup_var_commands)];
+
+/* Every command is registered through this wrapper. It handles a leading
+ * --quiet and --force for all commands and flushes the output buffer before GRUB gets to
+ * print an error. */
+static grub_err_t
+grub_cmd_setup_var_dispatch (grub_command_t cmd,
+           int argc, char *argv[])
+{
+    struct setup_var_command* command = cmd->data;
+    grub_err_t err;
+
+    quiet = 0;
+    force = 0;
+    for (; argc > 0; argc--, argv++)
+    {
+        if (0 == grub_strcmp(argv[0], "--quiet") || 0 == grub_strcmp(argv[0], "-q"))
+            quiet = 1;
+        else if (0 == grub_strcmp(argv[0], "--force") || 0 == grub_strcmp(argv[0], "-f"))
+            force = 1;
+        else
+            break;
+    }
+
+    err = command->func(cmd, argc, argv);
+    out_flush();
+    quiet = 0;
+    force = 0;
+    return err;
+}
+
+GRUB_MOD_INIT(setup_var)
+{
+    for (grub_size_t i = 0; i < ARRAY_SIZE(setup_var_commands); ++i)
+    {
+        setup_var_cmds[i] = grub_register_command (setup_var_commands[i].name, grub_cmd_setup_var_dispatch,
+                        setup_var_commands[i].summary,
+                        setup_var_commands[i].description);
+        if (setup_var_cmds[i])
+            setup_var_cmds[i]->data = &setup_var_commands[i];
+    }
 }
 
 GRUB_MOD_FINI(setup_var)
 {
-    grub_unregister_command (cmd_setup_var);
-    grub_unregister_command (cmd_setup_var2);
-    grub_unregister_command (cmd_setup_var_3);
-    grub_unregister_command (cmd_setup_var_vs);
-    grub_unregister_command (cmd_setup_var_cv);
-    grub_unregister_command (cmd_setup_lsvar);
+    for (grub_size_t i = 0; i < ARRAY_SIZE(setup_var_commands); ++i)
+        grub_unregister_command (setup_var_cmds[i]);
+    session_end();
+    index_invalidate();
+    questions_free();
+#ifdef GRUB_UTIL
+    grub_setup_var_set_backend(NULL);
+#endif
+    grub_free(var_pool);
+    var_pool = NULL;
+    var_pool_size = 0;
 }
@@ -0,0 +1,39 @@
+/* setup_var.h - variable store backends of the setup_var commands */
+#ifndef GRUB_SETUP_VAR_HEADER
+#define GRUB_SETUP_VAR_HEADER	1
+
+#include <grub/err.h>
+#include <grub/efi/api.h>
+
+/* Where variables are read from and written to. The commands only use the
+ * services below, with EFI semantics (status codes, UCS-2 names,
+ * EFI_BUFFER_TOO_SMALL size probing), so another store can be plugged in by
+ * providing these. The module uses the runtime services; userspace builds
+ * (GRUB_UTIL) can switch to the stores in util/setup_var_host.c. */
+struct setup_var_backend
+{
+    const char* name;
+    grub_efi_status_t (*get_next_variable_name) (grub_efi_uintn_t* name_size, grub_efi_char16_t* name,
+                                                 grub_efi_guid_t* guid);
+    grub_efi_status_t (*get_variable) (grub_efi_char16_t* name, const grub_efi_guid_t* guid,
+                                       grub_efi_uint32_t* attr, grub_efi_uintn_t* size, void* data);
+    grub_efi_status_t (*set_variable) (grub_efi_char16_t* name, const grub_efi_guid_t* guid,
+                                       grub_efi_uint32_t attr, grub_efi_uintn_t size, void* data);
+    grub_efi_status_t (*query_variable_info) (grub_efi_uint32_t attr, grub_efi_uint64_t* max_storage,
+                                              grub_efi_uint64_t* remaining, grub_efi_uint64_t* max_size);
+    /* Release the store when the commands switch away from it, may be NULL. */
+    void (*close) (void);
+};
+
+#ifdef GRUB_UTIL
+/* Switch the commands to another store, or back to the runtime services if
+ * backend is NULL. An open session and the index are dropped, and the store
+ * in use is closed. */
+void grub_setup_var_set_backend (const struct setup_var_backend* backend);
+
+/* The GUID parser of the commands, for backends that name variables by GUID.
+ * Returns 0 if str is not a GUID. */
+int grub_setup_var_parse_guid (const char* str, grub_efi_guid_t* guid);
+#endif
+
+#endif
@@ -0,0 +1,108 @@
+/* bench.c - time the setup_var commands and count the variable service calls
+ *           they make, against mock stores of increasing size
+ *
+ * The mock store looks variables up linearly, so with thousands of variables
+ * the times of the commands that read every variable are mostly the mock's.
+ * The call counts are what carries over to firmware. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "host.h"
+#include "mock_efi.h"
+
+static const grub_efi_guid_t setup_guid =
+    { 0xa04a27f4, 0xdf00, 0x4d42, { 0xb5, 0x52, 0x39, 0x51, 0x13, 0x02, 0x11, 0x3d } };
+
+static double
+now_ms (void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+static void
+populate (unsigned int count)
+{
+    grub_uint8_t data[0x200];
+
+    mock_efi_reset();
+    mock_efi_set_store(0x4000000, 0x4000000, 0x10000);
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        grub_efi_guid_t guid = setup_guid;
+        char name[32];
+        grub_size_t size = 0x10 + (i * 37) % 0x1f0;
+
+        guid.data1 += i % 16;
+        for (grub_size_t j = 0; j < size; ++j)
+            data[j] = (grub_uint8_t) (i + j);
+        snprintf(name, sizeof(name), "Var%05u", i);
+        mock_efi_add(name, &guid, MOCK_EFI_ATTR, data, size);
+    }
+    mock_efi_add_fill("Setup", &setup_guid, 0x1000, 0);
+    mock_efi_add_fill("Custom", &setup_guid, 0x40, 0x11);
+}
+
+static void
+bench (const char* label, const char* fmt, const char* arg)
+{
+    grub_err_t err;
+    double start;
+
+    mock_efi_reset_calls();
+    start = now_ms();
+    err = host_run(fmt, arg);
+    printf("  %-28s %9.3f ms  gnvn %6lu  gv %6lu  sv %3lu  qvi %3lu%s\n", label, now_ms() - start,
+           mock_efi_calls.get_next_variable_name, mock_efi_calls.get_variable,
+           mock_efi_calls.set_variable, mock_efi_calls.query_variable_info,
+           err ? "  (failed)" : "");
+}
+
+static void
+bench_session (void)
+{
+    double start;
+
+    mock_efi_reset_calls();
+    start = now_ms();
+    host_run("setup_var_begin");
+    for (unsigned int i = 0; i < 16; ++i)
+        host_run("setup_var_cv --quiet Setup 0x%x 0x1 0x%x", i * 8, i + 1);
+    host_run("setup_var_commit");
+    printf("  %-28s %9.3f ms  gnvn %6lu  gv %6lu  sv %3lu  qvi %3lu\n", "16 edits in a session",
+           now_ms() - start, mock_efi_calls.get_next_variable_name, mock_efi_calls.get_variable,
+           mock_efi_calls.set_variable, mock_efi_calls.query_variable_info);
+}
+
+int
+main (int argc, char** argv)
+{
+    static const unsigned int default_sizes[] = { 100, 1000, 4000 };
+
+    for (int i = 0; i < (argc > 1 ? argc - 1 : 3); ++i)
+    {
+        unsigned int count = argc > 1 ? (unsigned int) strtoul(argv[i + 1], NULL, 0) : default_sizes[i];
+
+        populate(count);
+        host_init();
+        printf("%u variables:\n", count);
+        bench("setup_var_cv (cold index)", "setup_var_cv --quiet Custom 0x4%s", "");
+        bench("setup_var_cv (warm index)", "setup_var_cv --quiet Custom 0x4%s", "");
+        bench("setup_var_gv", "setup_var_gv --quiet Custom %s 0x4", "A04A27F4-DF00-4D42-B552-39511302113D");
+        bench("setup_var write", "setup_var --quiet 0x10 0x1%s", "");
+        bench("setup_var unchanged write", "setup_var --quiet 0x10 0x1%s", "");
+        bench_session();
+        bench("lsefivar --names-only", "lsefivar --quiet --names-only%s", "");
+        bench("setup_var_find", "setup_var_find --quiet 0x11111111%s", "");
+        bench("setup_var_fingerprint", "setup_var_fingerprint --quiet%s", "");
+        bench("setup_var_rescan", "setup_var_rescan --quiet%s", "");
+        host_fini();
+        host_remove_temp_files();
+    }
+    mock_efi_reset();
+    return 0;
+}
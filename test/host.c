@@ -0,0 +1,556 @@
+/* host.c - the parts of the GRUB kernel setup_var.c needs, on top of libc */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <grub/command.h>
+#include <grub/dl.h>
+#include <grub/file.h>
+#include <grub/misc.h>
+#include <grub/mm.h>
+#include <grub/partition.h>
+#include <grub/time.h>
+
+#include "host.h"
+
+void grub_mod_init_setup_var (void);
+void grub_mod_fini_setup_var (void);
+
+grub_err_t grub_errno;
+static char error_message[1024];
+
+static char* output;
+static grub_size_t output_len;
+static grub_size_t output_capacity;
+static int echo;
+
+static grub_command_t commands;
+
+static char** temp_files;
+static grub_size_t temp_file_count;
+
+grub_err_t
+grub_error (grub_err_t n, const char* fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(error_message, sizeof(error_message), fmt, args);
+    va_end(args);
+    grub_errno = n;
+    return n;
+}
+
+void
+grub_print_error (void)
+{
+    if (grub_errno)
+        grub_printf("error: %s.\n", error_message);
+    grub_errno = GRUB_ERR_NONE;
+}
+
+void*
+grub_malloc (grub_size_t size)
+{
+    void* ptr = malloc(size ? size : 1);
+
+    if (!ptr)
+        grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+    return ptr;
+}
+
+void*
+grub_zalloc (grub_size_t size)
+{
+    return grub_calloc(1, size);
+}
+
+void*
+grub_calloc (grub_size_t nmemb, grub_size_t size)
+{
+    void* ptr = calloc(nmemb ? nmemb : 1, size ? size : 1);
+
+    if (!ptr)
+        grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+    return ptr;
+}
+
+void*
+grub_realloc (void* ptr, grub_size_t size)
+{
+    void* new_ptr = realloc(ptr, size ? size : 1);
+
+    if (!new_ptr)
+        grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+    return new_ptr;
+}
+
+void
+grub_free (void* ptr)
+{
+    free(ptr);
+}
+
+static void
+host_xputs (const char* str)
+{
+    grub_size_t len = strlen(str);
+
+    if (output_len + len + 1 > output_capacity)
+    {
+        output_capacity = (output_len + len + 1) * 2;
+        output = realloc(output, output_capacity);
+        if (!output)
+            abort();
+    }
+    memcpy(output + output_len, str, len + 1);
+    output_len += len;
+    if (echo)
+        fputs(str, stdout);
+}
+
+void (*grub_xputs) (const char* str) = host_xputs;
+
+void
+grub_refresh (void)
+{
+    fflush(stdout);
+}
+
+int
+grub_vsnprintf (char* str, grub_size_t n, const char* fmt, va_list args)
+{
+    int ret = vsnprintf(str, n, fmt, args);
+
+    /* GRUB returns the number of characters actually stored */
+    if (ret < 0)
+        return 0;
+    if (n && (grub_size_t) ret >= n)
+        return n - 1;
+    return ret;
+}
+
+int
+grub_snprintf (char* str, grub_size_t n, const char* fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = grub_vsnprintf(str, n, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+int
+grub_vprintf (const char* fmt, va_list args)
+{
+    char* str;
+    int ret;
+
+    ret = vasprintf(&str, fmt, args);
+    if (ret < 0)
+        return 0;
+    grub_xputs(str);
+    free(str);
+    return ret;
+}
+
+int
+grub_printf (const char* fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = grub_vprintf(fmt, args);
+    va_end(args);
+    return ret;
+}
+
+char*
+grub_xasprintf (const char* fmt, ...)
+{
+    va_list args;
+    char* str;
+
+    va_start(args, fmt);
+    if (vasprintf(&str, fmt, args) < 0)
+        str = NULL;
+    va_end(args);
+    return str;
+}
+
+char*
+grub_strdup (const char* s)
+{
+    return strdup(s);
+}
+
+char*
+grub_strndup (const char* s, grub_size_t n)
+{
+    return strndup(s, n);
+}
+
+/* Like GRUB's, these set grub_errno for a string without digits and for
+ * values that don't fit. */
+unsigned long long
+grub_strtoull (const char* restrict str, const char** const restrict end, int base)
+{
+    unsigned long long value;
+    char* stop;
+
+    errno = 0;
+    value = strtoull(str, &stop, base);
+    if (end)
+        *end = stop;
+    if (stop == str)
+        grub_error(GRUB_ERR_BAD_NUMBER, "unrecognized number");
+    else if (errno == ERANGE)
+        grub_error(GRUB_ERR_OUT_OF_RANGE, "overflow is detected");
+    return value;
+}
+
+unsigned long
+grub_strtoul (const char* restrict str, const char** const restrict end, int base)
+{
+    unsigned long long value = grub_strtoull(str, end, base);
+
+    if (value > ~0UL)
+    {
+        grub_error(GRUB_ERR_OUT_OF_RANGE, "overflow is detected");
+        return ~0UL;
+    }
+    return value;
+}
+
+grub_uint64_t
+grub_divmod64 (grub_uint64_t n, grub_uint64_t d, grub_uint64_t* r)
+{
+    if (r)
+        *r = n % d;
+    return n / d;
+}
+
+grub_uint64_t
+grub_get_time_ms (void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (grub_uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+grub_command_t
+grub_register_command (const char* name, grub_command_func_t func,
+                       const char* summary, const char* description)
+{
+    grub_command_t cmd = grub_zalloc(sizeof(*cmd));
+
+    if (!cmd)
+        return NULL;
+    cmd->name = name;
+    cmd->func = func;
+    cmd->summary = summary;
+    cmd->description = description;
+    cmd->next = commands;
+    commands = cmd;
+    return cmd;
+}
+
+void
+grub_unregister_command (grub_command_t cmd)
+{
+    for (grub_command_t* p = &commands; *p; p = &(*p)->next)
+        if (*p == cmd)
+        {
+            *p = cmd->next;
+            free(cmd);
+            return;
+        }
+}
+
+/* Files and disks are host files. A file lives on its own "disk" starting at
+ * sector 0, so the blocklists setup_var.c collects are file offsets. */
+struct host_file
+{
+    struct grub_file file;
+    struct grub_device device;
+    struct grub_disk disk;
+};
+
+grub_disk_addr_t
+grub_partition_get_start (const struct grub_partition* p __attribute__ ((unused)))
+{
+    return 0;
+}
+
+grub_err_t
+grub_disk_read (grub_disk_t disk, grub_disk_addr_t sector, grub_off_t offset,
+                grub_size_t size, void* buf)
+{
+    if (pread(disk->fd, buf, size, (sector << GRUB_DISK_SECTOR_BITS) + offset) != (ssize_t) size)
+        return grub_error(GRUB_ERR_READ_ERROR, "failure reading sector 0x%llx", (unsigned long long) sector);
+    return GRUB_ERR_NONE;
+}
+
+grub_err_t
+grub_disk_write (grub_disk_t disk, grub_disk_addr_t sector, grub_off_t offset,
+                 grub_size_t size, const void* buf)
+{
+    if (pwrite(disk->fd, buf, size, (sector << GRUB_DISK_SECTOR_BITS) + offset) != (ssize_t) size)
+        return grub_error(GRUB_ERR_WRITE_ERROR, "failure writing sector 0x%llx", (unsigned long long) sector);
+    return GRUB_ERR_NONE;
+}
+
+grub_file_t
+grub_file_open (const char* name, enum grub_file_type type __attribute__ ((unused)))
+{
+    struct host_file* host;
+    struct stat st;
+    int fd;
+
+    fd = open(name, O_RDWR);
+    if (fd < 0)
+        fd = open(name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        grub_error(GRUB_ERR_FILE_NOT_FOUND, "file `%s' not found", name);
+        return NULL;
+    }
+    host = grub_zalloc(sizeof(*host));
+    if (!host)
+    {
+        close(fd);
+        return NULL;
+    }
+    host->disk.fd = fd;
+    host->device.disk = &host->disk;
+    host->file.device = &host->device;
+    host->file.size = st.st_size;
+    host->file.name = strdup(name);
+    return &host->file;
+}
+
+grub_ssize_t
+grub_file_read (grub_file_t file, void* buf, grub_size_t len)
+{
+    struct host_file* host = (struct host_file*) file;
+    grub_off_t pos;
+    grub_off_t end;
+    ssize_t got;
+
+    if (file->offset >= file->size)
+        return 0;
+    if (len > file->size - file->offset)
+        len = file->size - file->offset;
+    got = pread(host->disk.fd, buf, len, file->offset);
+    if (got < 0)
+    {
+        grub_error(GRUB_ERR_READ_ERROR, "failure reading `%s'", file->name);
+        return -1;
+    }
+
+    /* the disk layer reports reads one sector at a time */
+    end = file->offset + got;
+    for (pos = file->offset; file->read_hook && pos < end;)
+    {
+        unsigned offset = pos % GRUB_DISK_SECTOR_SIZE;
+        unsigned length = GRUB_DISK_SECTOR_SIZE - offset;
+
+        if (length > end - pos)
+            length = end - pos;
+#ifdef SETUP_VAR_READ_HOOK_WITH_BUF
+        if (file->read_hook(pos >> GRUB_DISK_SECTOR_BITS, offset, length, (char*) buf + (pos - file->offset),
+                            file->read_hook_data))
+            return -1;
+#else
+        file->read_hook(pos >> GRUB_DISK_SECTOR_BITS, offset, length, file->read_hook_data);
+#endif
+        pos += length;
+    }
+    file->offset = end;
+    return got;
+}
+
+grub_off_t
+grub_file_seek (grub_file_t file, grub_off_t offset)
+{
+    grub_off_t old = file->offset;
+
+    if (offset > file->size)
+    {
+        grub_error(GRUB_ERR_OUT_OF_RANGE, "attempt to seek outside of the file");
+        return -1;
+    }
+    file->offset = offset;
+    return old;
+}
+
+grub_err_t
+grub_file_close (grub_file_t file)
+{
+    struct host_file* host = (struct host_file*) file;
+
+    close(host->disk.fd);
+    free(file->name);
+    free(host);
+    return GRUB_ERR_NONE;
+}
+
+void
+host_init (void)
+{
+    grub_mod_init_setup_var();
+}
+
+void
+host_fini (void)
+{
+    grub_mod_fini_setup_var();
+}
+
+grub_err_t
+host_run_argv (int argc, char** argv)
+{
+    grub_command_t cmd;
+
+    output_len = 0;
+    if (output)
+        output[0] = 0;
+    error_message[0] = 0;
+    grub_errno = GRUB_ERR_NONE;
+    if (argc == 0)
+        return GRUB_ERR_NONE;
+
+    for (cmd = commands; cmd; cmd = cmd->next)
+        if (strcmp(cmd->name, argv[0]) == 0)
+            break;
+    if (!cmd)
+        return grub_error(GRUB_ERR_UNKNOWN_COMMAND, "can't find command `%s'", argv[0]);
+    return cmd->func(cmd, argc - 1, argv + 1);
+}
+
+grub_err_t
+host_run (const char* fmt, ...)
+{
+    char* argv[64];
+    int argc = 0;
+    char* line;
+    char* p;
+    va_list args;
+    grub_err_t err;
+
+    va_start(args, fmt);
+    if (vasprintf(&line, fmt, args) < 0)
+        abort();
+    va_end(args);
+
+    for (p = line; *p && argc < (int) ARRAY_SIZE(argv);)
+    {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (!*p)
+            break;
+        if (*p == '"')
+        {
+            argv[argc++] = ++p;
+            while (*p && *p != '"')
+                p++;
+        }
+        else
+        {
+            argv[argc++] = p;
+            while (*p && *p != ' ' && *p != '\t')
+                p++;
+        }
+        if (*p)
+            *p++ = 0;
+    }
+
+    err = host_run_argv(argc, argv);
+    free(line);
+    return err;
+}
+
+const char*
+host_output (void)
+{
+    return output ? output : "";
+}
+
+const char*
+host_error (void)
+{
+    return error_message;
+}
+
+void
+host_set_echo (int on)
+{
+    echo = on;
+}
+
+const char*
+host_temp_file (const void* data, grub_size_t size)
+{
+    char path[] = "/tmp/setup_var_test.XXXXXX";
+    int fd;
+
+    fd = mkstemp(path);
+    if (fd < 0 || write(fd, data, size) != (ssize_t) size)
+    {
+        perror("temporary file");
+        exit(2);
+    }
+    close(fd);
+    temp_files = realloc(temp_files, (temp_file_count + 1) * sizeof(*temp_files));
+    temp_files[temp_file_count] = strdup(path);
+    return temp_files[temp_file_count++];
+}
+
+void
+host_remove_temp_files (void)
+{
+    for (grub_size_t i = 0; i < temp_file_count; ++i)
+    {
+        unlink(temp_files[i]);
+        free(temp_files[i]);
+    }
+    free(temp_files);
+    temp_files = NULL;
+    temp_file_count = 0;
+}
+
+grub_uint8_t*
+host_read_file (const char* path, grub_size_t* size)
+{
+    FILE* f = fopen(path, "rb");
+    grub_uint8_t* buf = NULL;
+    long len;
+
+    if (!f)
+        return NULL;
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0)
+    {
+        buf = malloc(len ? len : 1);
+        if (buf && fread(buf, 1, len, f) != (size_t) len)
+        {
+            free(buf);
+            buf = NULL;
+        }
+        *size = len;
+    }
+    fclose(f);
+    return buf;
+}
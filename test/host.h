@@ -0,0 +1,33 @@
+/* host.h - run the setup_var commands on the host, for the tests and for the
+ *          Linux tool in util/ */
+#ifndef SETUP_VAR_TEST_HOST_H
+#define SETUP_VAR_TEST_HOST_H	1
+
+#include <grub/err.h>
+#include <grub/types.h>
+
+/* Register and unregister the module's commands. host_fini drops everything
+ * the module has cached. */
+void host_init (void);
+void host_fini (void);
+
+/* Run one command line. Arguments are split on blanks; double quotes keep
+ * blanks in an argument. Output of the command replaces host_output(). */
+grub_err_t host_run (const char* fmt, ...) __attribute__ ((format (printf, 1, 2)));
+grub_err_t host_run_argv (int argc, char** argv);
+
+const char* host_output (void);
+const char* host_error (void);
+
+/* Also copy command output to stdout. */
+void host_set_echo (int echo);
+
+/* Create a temporary file with the given contents; the returned path is
+ * removed by host_remove_temp_files. */
+const char* host_temp_file (const void* data, grub_size_t size);
+void host_remove_temp_files (void);
+
+/* Read a whole host file; the caller frees the result. */
+grub_uint8_t* host_read_file (const char* path, grub_size_t* size);
+
+#endif
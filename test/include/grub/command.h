@@ -0,0 +1,25 @@
+/* Minimal stand-in for GRUB's <grub/command.h>. */
+#ifndef GRUB_COMMAND_HEADER
+#define GRUB_COMMAND_HEADER	1
+
+#include <grub/err.h>
+
+struct grub_command;
+typedef struct grub_command* grub_command_t;
+typedef grub_err_t (*grub_command_func_t) (struct grub_command* cmd, int argc, char** argv);
+
+struct grub_command
+{
+    struct grub_command* next;
+    const char* name;
+    grub_command_func_t func;
+    const char* summary;
+    const char* description;
+    void* data;
+};
+
+grub_command_t grub_register_command (const char* name, grub_command_func_t func,
+                                      const char* summary, const char* description);
+void grub_unregister_command (grub_command_t cmd);
+
+#endif
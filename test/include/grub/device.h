@@ -0,0 +1,14 @@
+/* Minimal stand-in for GRUB's <grub/device.h>. */
+#ifndef GRUB_DEVICE_HEADER
+#define GRUB_DEVICE_HEADER	1
+
+#include <grub/disk.h>
+
+struct grub_device
+{
+    grub_disk_t disk;
+    void* net;
+};
+typedef struct grub_device* grub_device_t;
+
+#endif
@@ -0,0 +1,34 @@
+/* Minimal stand-in for GRUB's <grub/disk.h>. A disk is a host file, with
+ * sectors counted from its start. */
+#ifndef GRUB_DISK_HEADER
+#define GRUB_DISK_HEADER	1
+
+#include <grub/types.h>
+#include <grub/err.h>
+
+#define GRUB_DISK_SECTOR_SIZE	0x200U
+#define GRUB_DISK_SECTOR_BITS	9
+
+struct grub_partition;
+
+struct grub_disk
+{
+    int fd;
+    struct grub_partition* partition;
+};
+typedef struct grub_disk* grub_disk_t;
+
+/* the GRUB 2.06 form by default, the 2.12 one with SETUP_VAR_READ_HOOK_WITH_BUF */
+#ifdef SETUP_VAR_READ_HOOK_WITH_BUF
+typedef grub_err_t (*grub_disk_read_hook_t) (grub_disk_addr_t sector, unsigned offset, unsigned length, char* buf,
+                                             void* data);
+#else
+typedef void (*grub_disk_read_hook_t) (grub_disk_addr_t sector, unsigned offset, unsigned length, void* data);
+#endif
+
+grub_err_t grub_disk_read (grub_disk_t disk, grub_disk_addr_t sector, grub_off_t offset,
+                           grub_size_t size, void* buf);
+grub_err_t grub_disk_write (grub_disk_t disk, grub_disk_addr_t sector, grub_off_t offset,
+                            grub_size_t size, const void* buf);
+
+#endif
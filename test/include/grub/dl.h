@@ -0,0 +1,16 @@
+/* Minimal stand-in for GRUB's <grub/dl.h>. The module's init and fini
+ * become plain functions the host programs call. */
+#ifndef GRUB_DL_H
+#define GRUB_DL_H	1
+
+#include <grub/types.h>
+
+#define GRUB_MOD_LICENSE(license)
+#define GRUB_MOD_INIT(name)	\
+    void grub_mod_init_##name (void); \
+    void grub_mod_init_##name (void)
+#define GRUB_MOD_FINI(name)	\
+    void grub_mod_fini_##name (void); \
+    void grub_mod_fini_##name (void)
+
+#endif
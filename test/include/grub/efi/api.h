@@ -0,0 +1,95 @@
+/* Minimal stand-in for GRUB's <grub/efi/api.h>: the types, status codes and
+ * runtime services setup_var.c uses. */
+#ifndef GRUB_EFI_API_HEADER
+#define GRUB_EFI_API_HEADER	1
+
+#include <grub/types.h>
+
+typedef grub_uint8_t grub_efi_boolean_t;
+typedef grub_uint8_t grub_efi_uint8_t;
+typedef grub_uint16_t grub_efi_uint16_t;
+typedef grub_uint32_t grub_efi_uint32_t;
+typedef grub_uint64_t grub_efi_uint64_t;
+typedef grub_addr_t grub_efi_uintn_t;
+typedef grub_efi_uintn_t grub_efi_status_t;
+typedef grub_uint16_t grub_efi_char16_t;
+typedef void* grub_efi_handle_t;
+
+struct grub_efi_guid
+{
+    grub_uint32_t data1;
+    grub_uint16_t data2;
+    grub_uint16_t data3;
+    grub_uint8_t data4[8];
+} __attribute__ ((aligned (8)));
+typedef struct grub_efi_guid grub_efi_guid_t;
+
+#define GRUB_EFI_ERROR_CODE(value)	\
+    ((((grub_efi_status_t) 1) << (sizeof (grub_efi_status_t) * 8 - 1)) | (value))
+
+#define GRUB_EFI_SUCCESS	0
+#define GRUB_EFI_LOAD_ERROR	GRUB_EFI_ERROR_CODE (1)
+#define GRUB_EFI_INVALID_PARAMETER	GRUB_EFI_ERROR_CODE (2)
+#define GRUB_EFI_UNSUPPORTED	GRUB_EFI_ERROR_CODE (3)
+#define GRUB_EFI_BUFFER_TOO_SMALL	GRUB_EFI_ERROR_CODE (5)
+#define GRUB_EFI_DEVICE_ERROR	GRUB_EFI_ERROR_CODE (7)
+#define GRUB_EFI_WRITE_PROTECTED	GRUB_EFI_ERROR_CODE (8)
+#define GRUB_EFI_OUT_OF_RESOURCES	GRUB_EFI_ERROR_CODE (9)
+#define GRUB_EFI_NOT_FOUND	GRUB_EFI_ERROR_CODE (14)
+#define GRUB_EFI_ACCESS_DENIED	GRUB_EFI_ERROR_CODE (15)
+#define GRUB_EFI_SECURITY_VIOLATION	GRUB_EFI_ERROR_CODE (26)
+
+#define GRUB_EFI_VARIABLE_NON_VOLATILE	0x0000000000000001
+#define GRUB_EFI_VARIABLE_BOOTSERVICE_ACCESS	0x0000000000000002
+#define GRUB_EFI_VARIABLE_RUNTIME_ACCESS	0x0000000000000004
+
+struct grub_efi_table_header
+{
+    grub_efi_uint64_t signature;
+    grub_efi_uint32_t revision;
+    grub_efi_uint32_t header_size;
+    grub_efi_uint32_t crc32;
+    grub_efi_uint32_t reserved;
+};
+typedef struct grub_efi_table_header grub_efi_table_header_t;
+
+struct grub_efi_runtime_services
+{
+    grub_efi_table_header_t hdr;
+    void* get_time;
+    void* set_time;
+    void* get_wakeup_time;
+    void* set_wakeup_time;
+    void* set_virtual_address_map;
+    void* convert_pointer;
+    grub_efi_status_t (*get_variable) (grub_efi_char16_t* variable_name, const grub_efi_guid_t* vendor_guid,
+                                       grub_efi_uint32_t* attributes, grub_efi_uintn_t* data_size, void* data);
+    grub_efi_status_t (*get_next_variable_name) (grub_efi_uintn_t* variable_name_size,
+                                                 grub_efi_char16_t* variable_name, grub_efi_guid_t* vendor_guid);
+    grub_efi_status_t (*set_variable) (grub_efi_char16_t* variable_name, const grub_efi_guid_t* vendor_guid,
+                                       grub_efi_uint32_t attributes, grub_efi_uintn_t data_size, void* data);
+    void* get_next_high_monotonic_count;
+    void* reset_system;
+    void* update_capsule;
+    void* query_capsule_capabilities;
+    grub_efi_status_t (*query_variable_info) (grub_efi_uint32_t attributes,
+                                              grub_efi_uint64_t* maximum_variable_storage_size,
+                                              grub_efi_uint64_t* remaining_variable_storage_size,
+                                              grub_efi_uint64_t* maximum_variable_size);
+};
+typedef struct grub_efi_runtime_services grub_efi_runtime_services_t;
+
+struct grub_efi_system_table
+{
+    grub_efi_table_header_t hdr;
+    grub_efi_runtime_services_t* runtime_services;
+};
+typedef struct grub_efi_system_table grub_efi_system_table_t;
+
+#define efi_call_1(func, a)	func (a)
+#define efi_call_2(func, a, b)	func (a, b)
+#define efi_call_3(func, a, b, c)	func (a, b, c)
+#define efi_call_4(func, a, b, c, d)	func (a, b, c, d)
+#define efi_call_5(func, a, b, c, d, e)	func (a, b, c, d, e)
+
+#endif
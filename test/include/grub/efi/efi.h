@@ -0,0 +1,11 @@
+/* Minimal stand-in for GRUB's <grub/efi/efi.h>. */
+#ifndef GRUB_EFI_EFI_HEADER
+#define GRUB_EFI_EFI_HEADER	1
+
+#include <grub/efi/api.h>
+
+extern grub_efi_system_table_t* grub_efi_system_table;
+
+void* grub_efi_locate_protocol (grub_efi_guid_t* protocol, void* registration);
+
+#endif
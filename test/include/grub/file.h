@@ -0,0 +1,47 @@
+/* Minimal stand-in for GRUB's <grub/file.h>. Files are host files. */
+#ifndef GRUB_FILE_HEADER
+#define GRUB_FILE_HEADER	1
+
+#include <grub/types.h>
+#include <grub/err.h>
+#include <grub/device.h>
+
+enum grub_file_type
+{
+    GRUB_FILE_TYPE_NONE = 0,
+    GRUB_FILE_TYPE_CAT,
+    GRUB_FILE_TYPE_HEXCAT,
+    GRUB_FILE_TYPE_CONFIG,
+    GRUB_FILE_TYPE_LOADENV,
+    GRUB_FILE_TYPE_SAVEENV,
+    GRUB_FILE_TYPE_TO_HASH,
+    GRUB_FILE_TYPE_COMPARE,
+    GRUB_FILE_TYPE_MASK = 0xffff,
+    GRUB_FILE_TYPE_SKIP_SIGNATURE = 0x10000,
+    GRUB_FILE_TYPE_NO_DECOMPRESS = 0x20000
+};
+
+struct grub_file
+{
+    char* name;
+    grub_device_t device;
+    grub_off_t offset;
+    grub_off_t size;
+    void* data;
+    grub_disk_read_hook_t read_hook;
+    void* read_hook_data;
+};
+typedef struct grub_file* grub_file_t;
+
+grub_file_t grub_file_open (const char* name, enum grub_file_type type);
+grub_ssize_t grub_file_read (grub_file_t file, void* buf, grub_size_t len);
+grub_off_t grub_file_seek (grub_file_t file, grub_off_t offset);
+grub_err_t grub_file_close (grub_file_t file);
+
+static inline grub_off_t
+grub_file_size (const grub_file_t file)
+{
+    return file->size;
+}
+
+#endif
@@ -0,0 +1,57 @@
+/* Minimal stand-in for GRUB's <grub/misc.h>. The string and memory helpers
+ * map to libc, the rest is implemented in host.c. */
+#ifndef GRUB_MISC_HEADER
+#define GRUB_MISC_HEADER	1
+
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <grub/types.h>
+#include <grub/err.h>
+
+#define ARRAY_SIZE(array)	(sizeof (array) / sizeof (array[0]))
+#define GNU_PRINTF	printf
+#define COMPILE_TIME_ASSERT(cond)	switch (0) { case 1: case !(cond): ; }
+
+#define grub_memcmp	memcmp
+#define grub_memcpy	memcpy
+#define grub_memmove	memmove
+#define grub_memset	memset
+#define grub_strlen	strlen
+#define grub_strcmp	strcmp
+#define grub_strncmp	strncmp
+#define grub_strcasecmp	strcasecmp
+#define grub_strncasecmp	strncasecmp
+#define grub_strcpy	strcpy
+#define grub_strncpy	strncpy
+#define grub_strchr	strchr
+#define grub_strrchr	strrchr
+#define grub_strstr	strstr
+#define grub_isspace	isspace
+#define grub_isdigit	isdigit
+#define grub_isxdigit	isxdigit
+#define grub_isprint	isprint
+#define grub_tolower	tolower
+#define grub_toupper	toupper
+
+#define grub_min(a, b)	((a) < (b) ? (a) : (b))
+#define grub_max(a, b)	((a) > (b) ? (a) : (b))
+
+#define grub_dprintf(condition, ...)	do { } while (0)
+
+int grub_printf (const char* fmt, ...) __attribute__ ((format (printf, 1, 2)));
+int grub_vprintf (const char* fmt, va_list args);
+int grub_snprintf (char* str, grub_size_t n, const char* fmt, ...) __attribute__ ((format (printf, 3, 4)));
+int grub_vsnprintf (char* str, grub_size_t n, const char* fmt, va_list args);
+char* grub_xasprintf (const char* fmt, ...) __attribute__ ((format (printf, 1, 2)));
+char* grub_strdup (const char* s);
+char* grub_strndup (const char* s, grub_size_t n);
+unsigned long grub_strtoul (const char* restrict str, const char** const restrict end, int base);
+unsigned long long grub_strtoull (const char* restrict str, const char** const restrict end, int base);
+grub_uint64_t grub_divmod64 (grub_uint64_t n, grub_uint64_t d, grub_uint64_t* r);
+void grub_refresh (void);
+
+extern void (*grub_xputs) (const char* str);
+
+#endif
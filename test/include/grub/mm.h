@@ -0,0 +1,13 @@
+/* Minimal stand-in for GRUB's <grub/mm.h>. */
+#ifndef GRUB_MM_H
+#define GRUB_MM_H	1
+
+#include <grub/types.h>
+
+void* grub_malloc (grub_size_t size);
+void* grub_zalloc (grub_size_t size);
+void* grub_calloc (grub_size_t nmemb, grub_size_t size);
+void* grub_realloc (void* ptr, grub_size_t size);
+void grub_free (void* ptr);
+
+#endif
@@ -0,0 +1,9 @@
+/* Minimal stand-in for GRUB's <grub/partition.h>. */
+#ifndef GRUB_PART_HEADER
+#define GRUB_PART_HEADER	1
+
+#include <grub/disk.h>
+
+grub_disk_addr_t grub_partition_get_start (const struct grub_partition* p);
+
+#endif
@@ -0,0 +1,9 @@
+/* Minimal stand-in for GRUB's <grub/time.h>. */
+#ifndef KERNEL_TIME_HEADER
+#define KERNEL_TIME_HEADER	1
+
+#include <grub/types.h>
+
+grub_uint64_t grub_get_time_ms (void);
+
+#endif
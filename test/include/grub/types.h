@@ -0,0 +1,36 @@
+/* Minimal stand-in for GRUB's <grub/types.h>, enough to build setup_var.c
+ * on the host. Only little-endian hosts are supported. */
+#ifndef GRUB_TYPES_HEADER
+#define GRUB_TYPES_HEADER	1
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t grub_uint8_t;
+typedef uint16_t grub_uint16_t;
+typedef uint32_t grub_uint32_t;
+/* unsigned long long as on 32-bit GRUB targets, so that printing one with
+ * %lx is a format warning here too */
+typedef unsigned long long grub_uint64_t;
+typedef int8_t grub_int8_t;
+typedef int16_t grub_int16_t;
+typedef int32_t grub_int32_t;
+typedef int64_t grub_int64_t;
+typedef size_t grub_size_t;
+typedef long grub_ssize_t;
+typedef unsigned long grub_addr_t;
+typedef uint64_t grub_off_t;
+typedef uint64_t grub_disk_addr_t;
+
+#define ALIGN_UP(addr, align)	(((addr) + (align) - 1) & ~((align) - 1))
+
+#define grub_le_to_cpu16(x)	((grub_uint16_t) (x))
+#define grub_le_to_cpu32(x)	((grub_uint32_t) (x))
+#define grub_le_to_cpu64(x)	((grub_uint64_t) (x))
+#define grub_cpu_to_le16(x)	((grub_uint16_t) (x))
+#define grub_cpu_to_le32(x)	((grub_uint32_t) (x))
+#define grub_cpu_to_le64(x)	((grub_uint64_t) (x))
+
+#define GRUB_PACKED	__attribute__ ((packed))
+
+#endif
@@ -0,0 +1,348 @@
+/* mock_efi.c - an in-memory EFI variable store behind the runtime services */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <grub/efi/efi.h>
+
+#include "mock_efi.h"
+
+#define MOCK_EFI_HEADER_SIZE	(0x3c)
+
+struct mock_variable
+{
+    grub_efi_char16_t* name;
+    grub_size_t name_size;
+    grub_efi_guid_t guid;
+    grub_uint32_t attr;
+    grub_uint8_t* data;
+    grub_size_t size;
+};
+
+struct mock_efi_calls mock_efi_calls;
+
+static struct mock_variable* variables;
+static grub_size_t variable_count;
+/* where the last GetNextVariableName stopped, so that walking the store is
+ * linear */
+static grub_size_t next_hint;
+
+static grub_uint64_t store_max;
+static grub_uint64_t store_remaining;
+static grub_uint64_t store_max_size;
+
+static grub_size_t enumeration_fail_after;
+static grub_efi_status_t enumeration_fail_status;
+
+static const void* hii_data;
+static grub_size_t hii_size;
+
+static grub_size_t
+name_size_of (const grub_efi_char16_t* name)
+{
+    grub_size_t len = 0;
+
+    while (name[len])
+        len++;
+    return (len + 1) * sizeof(grub_efi_char16_t);
+}
+
+static struct mock_variable*
+find (const grub_efi_char16_t* name, const grub_efi_guid_t* guid)
+{
+    grub_size_t name_size = name_size_of(name);
+
+    for (grub_size_t i = 0; i < variable_count; ++i)
+        if (variables[i].name_size == name_size && memcmp(variables[i].name, name, name_size) == 0 &&
+            memcmp(&variables[i].guid, guid, sizeof(*guid)) == 0)
+            return &variables[i];
+    return NULL;
+}
+
+static void
+remove_variable (struct mock_variable* var)
+{
+    grub_size_t i = var - variables;
+
+    free(var->name);
+    free(var->data);
+    memmove(var, var + 1, (variable_count - i - 1) * sizeof(*var));
+    variable_count--;
+}
+
+static struct mock_variable*
+store (const grub_efi_char16_t* name, const grub_efi_guid_t* guid, grub_uint32_t attr,
+       const void* data, grub_size_t size)
+{
+    struct mock_variable* var = find(name, guid);
+
+    if (!var)
+    {
+        variables = realloc(variables, (variable_count + 1) * sizeof(*variables));
+        var = &variables[variable_count++];
+        var->name_size = name_size_of(name);
+        var->name = malloc(var->name_size);
+        memcpy(var->name, name, var->name_size);
+        var->guid = *guid;
+        var->data = NULL;
+    }
+    var->attr = attr;
+    var->data = realloc(var->data, size ? size : 1);
+    memcpy(var->data, data, size);
+    var->size = size;
+    return var;
+}
+
+static grub_efi_char16_t*
+name_from_ascii (const char* ascii)
+{
+    grub_size_t len = strlen(ascii);
+    grub_efi_char16_t* name = calloc(len + 1, sizeof(*name));
+
+    for (grub_size_t i = 0; i < len; ++i)
+        name[i] = (grub_uint8_t) ascii[i];
+    return name;
+}
+
+static grub_efi_status_t
+mock_get_variable (grub_efi_char16_t* name, const grub_efi_guid_t* guid, grub_efi_uint32_t* attr,
+                   grub_efi_uintn_t* size, void* data)
+{
+    struct mock_variable* var;
+
+    mock_efi_calls.get_variable++;
+    var = find(name, guid);
+    if (!var)
+        return GRUB_EFI_NOT_FOUND;
+    if (attr)
+        *attr = var->attr;
+    if (*size < var->size)
+    {
+        *size = var->size;
+        return GRUB_EFI_BUFFER_TOO_SMALL;
+    }
+    if (!data)
+        return GRUB_EFI_INVALID_PARAMETER;
+    memcpy(data, var->data, var->size);
+    *size = var->size;
+    return GRUB_EFI_SUCCESS;
+}
+
+static grub_efi_status_t
+mock_get_next_variable_name (grub_efi_uintn_t* name_size, grub_efi_char16_t* name, grub_efi_guid_t* guid)
+{
+    grub_size_t i = 0;
+    struct mock_variable* var;
+
+    mock_efi_calls.get_next_variable_name++;
+    if (name[0])
+    {
+        if (next_hint < variable_count && memcmp(variables[next_hint].name, name, variables[next_hint].name_size) == 0 &&
+            memcmp(&variables[next_hint].guid, guid, sizeof(*guid)) == 0)
+            var = &variables[next_hint];
+        else
+            var = find(name, guid);
+        if (!var)
+            return GRUB_EFI_INVALID_PARAMETER;
+        i = var - variables + 1;
+    }
+    if (enumeration_fail_status && i >= enumeration_fail_after)
+        return enumeration_fail_status;
+    if (i >= variable_count)
+        return GRUB_EFI_NOT_FOUND;
+
+    var = &variables[i];
+    if (*name_size < var->name_size)
+    {
+        *name_size = var->name_size;
+        return GRUB_EFI_BUFFER_TOO_SMALL;
+    }
+    memcpy(name, var->name, var->name_size);
+    *name_size = var->name_size;
+    *guid = var->guid;
+    next_hint = i;
+    return GRUB_EFI_SUCCESS;
+}
+
+static grub_efi_status_t
+mock_set_variable (grub_efi_char16_t* name, const grub_efi_guid_t* guid, grub_efi_uint32_t attr,
+                   grub_efi_uintn_t size, void* data)
+{
+    struct mock_variable* var;
+    grub_uint64_t need;
+
+    mock_efi_calls.set_variable++;
+    var = find(name, guid);
+    if (size == 0)
+    {
+        if (!var)
+            return GRUB_EFI_NOT_FOUND;
+        remove_variable(var);
+        return GRUB_EFI_SUCCESS;
+    }
+    if (var && var->attr != attr)
+        /* attributes can only be changed by deleting the variable first */
+        return GRUB_EFI_INVALID_PARAMETER;
+    if (size > store_max_size)
+        return GRUB_EFI_INVALID_PARAMETER;
+    need = MOCK_EFI_HEADER_SIZE + name_size_of(name) + size;
+    if (need > store_remaining)
+        return GRUB_EFI_OUT_OF_RESOURCES;
+    store_remaining -= need;
+    store(name, guid, attr, data, size);
+    return GRUB_EFI_SUCCESS;
+}
+
+static grub_efi_status_t
+mock_query_variable_info (grub_efi_uint32_t attr __attribute__ ((unused)), grub_efi_uint64_t* max_storage,
+                          grub_efi_uint64_t* remaining, grub_efi_uint64_t* max_size)
+{
+    mock_efi_calls.query_variable_info++;
+    *max_storage = store_max;
+    *remaining = store_remaining;
+    *max_size = store_max_size;
+    return GRUB_EFI_SUCCESS;
+}
+
+static grub_efi_runtime_services_t mock_runtime_services =
+{
+    .hdr = { .revision = 2 << 16 },
+    .get_variable = mock_get_variable,
+    .get_next_variable_name = mock_get_next_variable_name,
+    .set_variable = mock_set_variable,
+    .query_variable_info = mock_query_variable_info,
+};
+
+static grub_efi_system_table_t mock_system_table =
+{
+    .hdr = { .revision = 2 << 16 },
+    .runtime_services = &mock_runtime_services,
+};
+
+grub_efi_system_table_t* grub_efi_system_table = &mock_system_table;
+
+/* EFI_HII_DATABASE_PROTOCOL, of which setup_var.c only calls
+ * ExportPackageLists */
+struct mock_hii_database
+{
+    void* new_package_list;
+    void* remove_package_list;
+    void* update_package_list;
+    void* list_package_lists;
+    grub_efi_status_t (*export_package_lists) (struct mock_hii_database* this, void* handle,
+                                               grub_efi_uintn_t* size, void* buffer);
+};
+
+static grub_efi_status_t
+mock_export_package_lists (struct mock_hii_database* this __attribute__ ((unused)),
+                           void* handle __attribute__ ((unused)), grub_efi_uintn_t* size, void* buffer)
+{
+    if (*size < hii_size)
+    {
+        *size = hii_size;
+        return GRUB_EFI_BUFFER_TOO_SMALL;
+    }
+    memcpy(buffer, hii_data, hii_size);
+    *size = hii_size;
+    return GRUB_EFI_SUCCESS;
+}
+
+static struct mock_hii_database mock_hii_database =
+{
+    .export_package_lists = mock_export_package_lists,
+};
+
+void*
+grub_efi_locate_protocol (grub_efi_guid_t* protocol, void* registration __attribute__ ((unused)))
+{
+    static const grub_efi_guid_t hii_database_guid =
+        { 0xef9fc172, 0xa1b2, 0x4693, { 0xb3, 0x27, 0x6d, 0x32, 0xfc, 0x41, 0x60, 0x42 } };
+
+    if (hii_data && memcmp(protocol, &hii_database_guid, sizeof(*protocol)) == 0)
+        return &mock_hii_database;
+    return NULL;
+}
+
+void
+mock_efi_reset (void)
+{
+    while (variable_count)
+        remove_variable(&variables[variable_count - 1]);
+    free(variables);
+    variables = NULL;
+    next_hint = 0;
+    mock_efi_set_store(0x100000, 0x100000, 0x10000);
+    mock_efi_set_hii(NULL, 0);
+    mock_efi_fail_enumeration(0, GRUB_EFI_SUCCESS);
+    mock_efi_reset_calls();
+}
+
+void
+mock_efi_reset_calls (void)
+{
+    memset(&mock_efi_calls, 0, sizeof(mock_efi_calls));
+}
+
+void
+mock_efi_add (const char* name, const grub_efi_guid_t* guid, grub_uint32_t attr,
+              const void* data, grub_size_t size)
+{
+    grub_efi_char16_t* name16 = name_from_ascii(name);
+
+    store(name16, guid, attr, data, size);
+    free(name16);
+}
+
+void
+mock_efi_add_fill (const char* name, const grub_efi_guid_t* guid, grub_size_t size, grub_uint8_t fill)
+{
+    grub_uint8_t* data = malloc(size ? size : 1);
+
+    memset(data, fill, size);
+    mock_efi_add(name, guid, MOCK_EFI_ATTR, data, size);
+    free(data);
+}
+
+const grub_uint8_t*
+mock_efi_get (const char* name, const grub_efi_guid_t* guid, grub_size_t* size, grub_uint32_t* attr)
+{
+    grub_efi_char16_t* name16 = name_from_ascii(name);
+    struct mock_variable* var = find(name16, guid);
+
+    free(name16);
+    if (!var)
+        return NULL;
+    if (size)
+        *size = var->size;
+    if (attr)
+        *attr = var->attr;
+    return var->data;
+}
+
+void
+mock_efi_set_store (grub_uint64_t max_storage, grub_uint64_t remaining, grub_uint64_t max_size)
+{
+    store_max = max_storage;
+    store_remaining = remaining;
+    store_max_size = max_size;
+}
+
+grub_uint64_t
+mock_efi_remaining (void)
+{
+    return store_remaining;
+}
+
+void
+mock_efi_fail_enumeration (grub_size_t count, grub_efi_status_t status)
+{
+    enumeration_fail_after = count;
+    enumeration_fail_status = status;
+}
+
+void
+mock_efi_set_hii (const void* data, grub_size_t size)
+{
+    hii_data = data;
+    hii_size = size;
+}
@@ -0,0 +1,51 @@
+/* mock_efi.h - an in-memory EFI variable store behind the runtime services */
+#ifndef SETUP_VAR_TEST_MOCK_EFI_H
+#define SETUP_VAR_TEST_MOCK_EFI_H	1
+
+#include <grub/efi/api.h>
+
+#define MOCK_EFI_ATTR	(GRUB_EFI_VARIABLE_NON_VOLATILE | GRUB_EFI_VARIABLE_BOOTSERVICE_ACCESS | \
+                         GRUB_EFI_VARIABLE_RUNTIME_ACCESS)
+
+/* How often each runtime service was called since the last mock_efi_reset
+ * or mock_efi_reset_calls. */
+struct mock_efi_calls
+{
+    unsigned long get_next_variable_name;
+    unsigned long get_variable;
+    unsigned long set_variable;
+    unsigned long query_variable_info;
+};
+
+extern struct mock_efi_calls mock_efi_calls;
+
+/* Empty the store, reset the counters and the store limits. */
+void mock_efi_reset (void);
+void mock_efi_reset_calls (void);
+
+/* Add a variable, or replace it, without counting a SetVariable call. */
+void mock_efi_add (const char* name, const grub_efi_guid_t* guid, grub_uint32_t attr,
+                   const void* data, grub_size_t size);
+/* Add a variable of size bytes, all set to fill. */
+void mock_efi_add_fill (const char* name, const grub_efi_guid_t* guid, grub_size_t size, grub_uint8_t fill);
+
+/* Current contents of a variable, or NULL if there is none. */
+const grub_uint8_t* mock_efi_get (const char* name, const grub_efi_guid_t* guid,
+                                  grub_size_t* size, grub_uint32_t* attr);
+
+/* Store limits as QueryVariableInfo reports them. Every write of a variable
+ * uses up its size plus a header from the remaining space, as on firmware
+ * that appends new copies; SetVariable fails with EFI_OUT_OF_RESOURCES once
+ * there is no room. */
+void mock_efi_set_store (grub_uint64_t max_storage, grub_uint64_t remaining, grub_uint64_t max_size);
+grub_uint64_t mock_efi_remaining (void);
+
+/* Make GetNextVariableName fail with status once it has returned count
+ * names in a row; 0 as status stops the failures. */
+void mock_efi_fail_enumeration (grub_size_t count, grub_efi_status_t status);
+
+/* Package lists returned by the HII database protocol; NULL removes the
+ * protocol. */
+void mock_efi_set_hii (const void* data, grub_size_t size);
+
+#endif
@@ -0,0 +1,1241 @@
+/* test_setup_var.c - behaviour tests for the setup_var commands, run against
+ *                    the mock variable store */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <grub/misc.h>
+
+#include "host.h"
+#include "mock_efi.h"
+#include "setup_var_host.h"
+
+#define SETUP_GUID_STR	"A04A27F4-DF00-4D42-B552-39511302113D"
+#define NETWORK_GUID_STR	"D1405D16-7AFC-4695-BB12-41459D3695A2"
+/* as efivarfs writes GUIDs in file names */
+#define SETUP_GUID_FILE	"a04a27f4-df00-4d42-b552-39511302113d"
+
+static const grub_efi_guid_t setup_guid =
+    { 0xa04a27f4, 0xdf00, 0x4d42, { 0xb5, 0x52, 0x39, 0x51, 0x13, 0x02, 0x11, 0x3d } };
+static const grub_efi_guid_t network_guid =
+    { 0xd1405d16, 0x7afc, 0x4695, { 0xbb, 0x12, 0x41, 0x45, 0x9d, 0x36, 0x95, 0xa2 } };
+static const grub_efi_guid_t other_guid =
+    { 0x80e1202e, 0x2697, 0x4264, { 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8 } };
+
+static unsigned int checks;
+static unsigned int failures;
+static const char* current_test;
+
+#define CHECK(cond)	check((cond), #cond, __FILE__, __LINE__)
+#define CHECK_OK(...)	check_err(host_run(__VA_ARGS__), GRUB_ERR_NONE, __FILE__, __LINE__)
+#define CHECK_ERR(err, ...)	check_err(host_run(__VA_ARGS__), (err), __FILE__, __LINE__)
+#define CHECK_OUTPUT(str)	check(strstr(host_output(), (str)) != NULL, "output contains \"" str "\"", __FILE__, __LINE__)
+
+static void
+check (int ok, const char* what, const char* file, int line)
+{
+    checks++;
+    if (ok)
+        return;
+    failures++;
+    printf("%s:%d: %s: check failed: %s\n", file, line, current_test, what);
+    printf("    output: %s\n", host_output());
+}
+
+static void
+check_err (grub_err_t err, grub_err_t expected, const char* file, int line)
+{
+    checks++;
+    if (err == expected)
+        return;
+    failures++;
+    printf("%s:%d: %s: command returned %d, expected %d (%s)\n", file, line, current_test,
+           err, expected, host_error());
+    printf("    output: %s\n", host_output());
+}
+
+static grub_uint8_t
+var_byte (const char* name, const grub_efi_guid_t* guid, grub_size_t offset)
+{
+    grub_size_t size;
+    const grub_uint8_t* data = mock_efi_get(name, guid, &size, NULL);
+
+    if (!data || offset >= size)
+    {
+        check(0, "variable exists and is large enough", __FILE__, __LINE__);
+        return 0;
+    }
+    return data[offset];
+}
+
+/* The store every test starts from: two Setup varstores with different
+ * GUIDs, like on many Insyde boards, and a few others. */
+static void
+default_store (void)
+{
+    grub_uint8_t setup[0x400];
+
+    for (grub_size_t i = 0; i < sizeof(setup); ++i)
+        setup[i] = (grub_uint8_t) (i * 7);
+    mock_efi_add_fill("Setup", &other_guid, 0x8, 0x00);
+    mock_efi_add("Setup", &setup_guid, MOCK_EFI_ATTR, setup, sizeof(setup));
+    mock_efi_add_fill("Custom", &setup_guid, 0x40, 0x11);
+    mock_efi_add_fill("NetworkStackVar", &network_guid, 0x9, 0x00);
+}
+
+static void
+test_begin (const char* name)
+{
+    current_test = name;
+    mock_efi_reset();
+    default_store();
+    host_init();
+}
+
+static void
+test_end (void)
+{
+    host_fini();
+    host_remove_temp_files();
+}
+
+static void
+test_index_reused (void)
+{
+    test_begin("index_reused");
+
+    CHECK_OK("setup_var_cv Custom 0x4");
+    CHECK_OUTPUT("offset 0x04 is: 0x11");
+    CHECK(mock_efi_calls.get_next_variable_name > 0);
+
+    /* the second lookup is answered from the index */
+    mock_efi_reset_calls();
+    CHECK_OK("setup_var_cv NetworkStackVar 0x2");
+    CHECK(mock_efi_calls.get_next_variable_name == 0);
+
+    /* setup_var_gv never walks the store */
+    CHECK_OK("setup_var_rescan");
+    mock_efi_reset_calls();
+    CHECK_OK("setup_var_gv Custom " SETUP_GUID_STR " 0x4");
+    CHECK(mock_efi_calls.get_next_variable_name == 0);
+
+    test_end();
+}
+
+static void
+test_enumeration_error (void)
+{
+    test_begin("enumeration_error");
+
+    /* Custom is the third variable, the walk fails on the second */
+    mock_efi_fail_enumeration(1, GRUB_EFI_DEVICE_ERROR);
+    CHECK_ERR(GRUB_ERR_INVALID_COMMAND, "setup_var_cv Custom 0x4");
+    CHECK(strstr(host_error(), "enumerate") != NULL);
+    CHECK_ERR(GRUB_ERR_INVALID_COMMAND, "setup_var_rescan");
+
+    /* nothing of the failed walk is kept, the next command walks again */
+    mock_efi_fail_enumeration(0, GRUB_EFI_SUCCESS);
+    mock_efi_reset_calls();
+    CHECK_OK("setup_var_cv Custom 0x4");
+    CHECK_OUTPUT("offset 0x04 is: 0x11");
+    CHECK(mock_efi_calls.get_next_variable_name == 5);
+
+    test_end();
+}
+
+static void
+test_write_elision (void)
+{
+    test_begin("write_elision");
+
+    /* writing the value a varstore already has is skipped */
+    mock_efi_reset_calls();
+    CHECK_OK("setup_var_cv Custom 0x4 0x1 0x11");
+    CHECK(mock_efi_calls.set_variable == 0);
+    CHECK_OK("setup_var_cv Custom 0x4 0x1 0x22");
+    CHECK(mock_efi_calls.set_variable == 1);
+    CHECK(var_byte("Custom", &setup_guid, 4) == 0x22);
+
+    test_end();
+}
+
+static void
+test_argument_ranges (void)
+{
+    test_begin("argument_ranges");
+
+    /* missing arguments are an error, not a read past argv */
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_cv");
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_cv Custom");
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_gv Custom");
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_vs");
+
+    /* nothing is truncated to fit the offset, size or value */
+    mock_efi_reset_calls();
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_gv Custom " SETUP_GUID_STR " 0x100000002");
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_gv Custom " SETUP_GUID_STR " 0x2 0x10001");
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_gv Custom " SETUP_GUID_STR " 0x2 0x1 0x122");
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_gv Custom " SETUP_GUID_STR " 0x2 0x0");
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_gv Custom " SETUP_GUID_STR " 0x2z");
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_cv Custom 0x100000002");
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_cv Custom 0x2 0x10001");
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_cv Custom 0x2 0x2 0x10000");
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_vs 0x100000002");
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_vs 0x2 0x9 0x1");
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var 0x2 0x1ff");
+    CHECK(mock_efi_calls.set_variable == 0);
+
+    /* offset + size would wrap where UINTN is 32 bits */
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_gv Custom " SETUP_GUID_STR " 0xffffffff 0x2");
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_cv Custom 0xfffffffe 0x8 0x1");
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_gv Custom " SETUP_GUID_STR " 0x3f 0x2");
+    CHECK(mock_efi_calls.set_variable == 0);
+
+    /* the largest values still go through */
+    CHECK_OK("setup_var_gv Custom " SETUP_GUID_STR " 0x38 0x8 0xffffffffffffffff");
+    CHECK_OK("setup_var_cv Custom 0x2 0x2 0xffff");
+    CHECK(var_byte("Custom", &setup_guid, 0x3f) == 0xff);
+    CHECK(var_byte("Custom", &setup_guid, 0x3) == 0xff);
+    CHECK(var_byte("Custom", &setup_guid, 0x4) == 0x11);
+
+    test_end();
+}
+
+static void
+test_session_write_elision (void)
+{
+    test_begin("session_write_elision");
+
+    /* several edits of a varstore in a session make a single write */
+    CHECK_OK("setup_var_begin");
+    mock_efi_reset_calls();
+    CHECK_OK("setup_var_cv Custom 0x3 0x1 0x11");
+    CHECK_OK("setup_var_cv Custom 0x4 0x1 0x22");
+    CHECK_OK("setup_var_gv Custom " SETUP_GUID_STR " 0x5 0x2 0x4433");
+    CHECK_OK("setup_var_gv NetworkStackVar " NETWORK_GUID_STR " 0x2 0x1 0x1");
+    CHECK(mock_efi_calls.set_variable == 0);
+    /* each varstore is read once, later edits work on the staged copy */
+    CHECK(mock_efi_calls.get_variable <= 4);
+    CHECK(var_byte("Custom", &setup_guid, 4) == 0x11);
+
+    CHECK_OK("setup_var_commit");
+    CHECK(mock_efi_calls.set_variable == 2);
+    CHECK(var_byte("Custom", &setup_guid, 4) == 0x22);
+    CHECK(var_byte("Custom", &setup_guid, 5) == 0x33);
+    CHECK(var_byte("Custom", &setup_guid, 6) == 0x44);
+    CHECK(var_byte("NetworkStackVar", &network_guid, 2) == 0x1);
+
+    /* a session that ends up with the original contents writes nothing */
+    CHECK_OK("setup_var_begin");
+    mock_efi_reset_calls();
+    CHECK_OK("setup_var_cv Custom 0x4 0x1 0x55");
+    CHECK_OK("setup_var_cv Custom 0x4 0x1 0x22");
+    CHECK_OK("setup_var_commit");
+    CHECK(mock_efi_calls.set_variable == 0);
+
+    /* an aborted session writes nothing */
+    CHECK_OK("setup_var_begin");
+    mock_efi_reset_calls();
+    CHECK_OK("setup_var_cv Custom 0x4 0x1 0x66");
+    CHECK_OK("setup_var_abort");
+    CHECK(mock_efi_calls.set_variable == 0);
+    CHECK(var_byte("Custom", &setup_guid, 4) == 0x22);
+
+    test_end();
+}
+
+static void
+test_apply_all_or_nothing (void)
+{
+    static const char bad[] =
+        "# the first line is fine, the second is out of range\n"
+        "Custom 0x4 0x1 0x22\n"
+        "NetworkStackVar " NETWORK_GUID_STR " 0x8 0x2 0x1\n";
+    static const char wrap[] =
+        "Custom 0xffffffff 0x2 0x1\n";
+    static const char too_large[] =
+        "Custom 0x4 0x1 0x22\n"
+        "Custom 0x5 0x1 0x1ff\n";
+    static const char ambiguous[] =
+        "Setup 0x4 0x1 0x22\n";
+    static const char good[] =
+        "Custom 0x4 0x1 0x22\n"
+        "Custom 0x6 0x2 0x4433   # same varstore, still one write\n"
+        "\n"
+        "Setup " SETUP_GUID_STR " 0x10 0x1 0x1\n"
+        "NetworkStackVar 0x2 0x1 0x1\n";
+
+    test_begin("apply_all_or_nothing");
+
+    mock_efi_reset_calls();
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_apply %s", host_temp_file(bad, sizeof(bad) - 1));
+    CHECK(mock_efi_calls.set_variable == 0);
+    CHECK(var_byte("Custom", &setup_guid, 4) == 0x11);
+
+    /* offset + size would wrap where UINTN is 32 bits */
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_apply %s", host_temp_file(wrap, sizeof(wrap) - 1));
+    CHECK(mock_efi_calls.set_variable == 0);
+
+    /* a value wider than its field is refused, not truncated */
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_apply %s", host_temp_file(too_large, sizeof(too_large) - 1));
+    CHECK(strstr(host_error(), "line 2") != NULL);
+    CHECK(mock_efi_calls.set_variable == 0);
+    CHECK(var_byte("Custom", &setup_guid, 4) == 0x11);
+    CHECK(var_byte("Custom", &setup_guid, 5) == 0x11);
+
+    /* two varstores are called Setup, so the GUID is needed */
+    CHECK(host_run("setup_var_apply %s", host_temp_file(ambiguous, sizeof(ambiguous) - 1)) != GRUB_ERR_NONE);
+    CHECK(mock_efi_calls.set_variable == 0);
+
+    CHECK_OK("setup_var_apply %s", host_temp_file(good, sizeof(good) - 1));
+    CHECK(mock_efi_calls.set_variable == 3);
+    CHECK(var_byte("Custom", &setup_guid, 4) == 0x22);
+    CHECK(var_byte("Custom", &setup_guid, 6) == 0x33);
+    CHECK(var_byte("Custom", &setup_guid, 7) == 0x44);
+    CHECK(var_byte("Setup", &setup_guid, 0x10) == 0x1);
+    CHECK(var_byte("NetworkStackVar", &network_guid, 2) == 0x1);
+
+    test_end();
+}
+
+static void
+test_save_restore (void)
+{
+    static grub_uint8_t zero[0x200];
+    const char* snapshot;
+    grub_uint8_t* image;
+    grub_size_t image_size;
+    grub_uint8_t custom[0x40];
+    grub_uint32_t attr;
+
+    test_begin("save_restore");
+
+    snapshot = host_temp_file(zero, sizeof(zero));
+    CHECK_OK("setup_var_save Custom %s", snapshot);
+
+    CHECK_OK("setup_var_cv Custom 0x4 0x2 0xbeef");
+    mock_efi_reset_calls();
+    CHECK_OK("setup_var_restore %s", snapshot);
+    CHECK(mock_efi_calls.set_variable == 1);
+    for (grub_size_t i = 0; i < 0x40; ++i)
+        CHECK(var_byte("Custom", &setup_guid, i) == 0x11);
+
+    /* restoring the same contents again writes nothing */
+    mock_efi_reset_calls();
+    CHECK_OK("setup_var_restore %s", snapshot);
+    CHECK(mock_efi_calls.set_variable == 0);
+
+    /* the attributes are restored too, by deleting and recreating the
+     * variable, as SetVariable can't change them */
+    memset(custom, 0x11, sizeof(custom));
+    mock_efi_add("Custom", &setup_guid, GRUB_EFI_VARIABLE_BOOTSERVICE_ACCESS, custom, sizeof(custom));
+    mock_efi_reset_calls();
+    CHECK_OK("setup_var_restore %s", snapshot);
+    CHECK_OUTPUT("attributes differ");
+    CHECK(mock_efi_calls.set_variable == 2);
+    CHECK(mock_efi_get("Custom", &setup_guid, NULL, &attr) != NULL && attr == MOCK_EFI_ATTR);
+    mock_efi_reset_calls();
+    CHECK_OK("setup_var_restore %s", snapshot);
+    CHECK(mock_efi_calls.set_variable == 0);
+
+    /* a damaged file is refused before anything is written */
+    image = host_read_file(snapshot, &image_size);
+    CHECK(image != NULL);
+    if (image)
+    {
+        image[0x50] ^= 0xff;
+        mock_efi_reset_calls();
+        CHECK(host_run("setup_var_restore %s", host_temp_file(image, image_size)) != GRUB_ERR_NONE);
+        CHECK(mock_efi_calls.set_variable == 0);
+        free(image);
+    }
+
+    /* a file that is too small is refused and left alone */
+    CHECK(host_run("setup_var_save Custom %s", host_temp_file(zero, 0x20)) != GRUB_ERR_NONE);
+
+    test_end();
+}
+
+/* A growing byte buffer for building HII package lists. */
+struct blob
+{
+    grub_uint8_t* data;
+    grub_size_t size;
+};
+
+static void
+blob_put (struct blob* blob, const void* data, grub_size_t size)
+{
+    if (!size)
+        return;
+    blob->data = realloc(blob->data, blob->size + size);
+    memcpy(blob->data + blob->size, data, size);
+    blob->size += size;
+}
+
+static void
+blob_put8 (struct blob* blob, grub_uint8_t value)
+{
+    blob_put(blob, &value, 1);
+}
+
+static void
+blob_put16 (struct blob* blob, grub_uint16_t value)
+{
+    blob_put8(blob, value & 0xff);
+    blob_put8(blob, value >> 8);
+}
+
+static void
+blob_put32 (struct blob* blob, grub_uint32_t value)
+{
+    blob_put16(blob, value & 0xffff);
+    blob_put16(blob, value >> 16);
+}
+
+static void
+blob_put_guid (struct blob* blob, const grub_efi_guid_t* guid)
+{
+    blob_put32(blob, guid->data1);
+    blob_put16(blob, guid->data2);
+    blob_put16(blob, guid->data3);
+    blob_put(blob, guid->data4, 8);
+}
+
+static void
+blob_put_blob (struct blob* blob, struct blob* other)
+{
+    blob_put(blob, other->data, other->size);
+    free(other->data);
+    other->data = NULL;
+    other->size = 0;
+}
+
+/* IFR opcode with the payload in body */
+static void
+ifr_op (struct blob* ifr, grub_uint8_t opcode, struct blob* body, int scope)
+{
+    blob_put8(ifr, opcode);
+    blob_put8(ifr, (body->size + 2) | (scope ? 0x80 : 0));
+    blob_put_blob(ifr, body);
+}
+
+static void
+ifr_varstore (struct blob* ifr, grub_uint16_t id, const grub_efi_guid_t* guid, grub_uint16_t size,
+              const char* name)
+{
+    struct blob body = { 0 };
+
+    blob_put_guid(&body, guid);
+    blob_put16(&body, id);
+    blob_put16(&body, size);
+    blob_put(&body, name, strlen(name) + 1);
+    ifr_op(ifr, 0x24, &body, 0);
+}
+
+static void
+ifr_varstore_efi (struct blob* ifr, grub_uint16_t id, const grub_efi_guid_t* guid, grub_uint16_t size,
+                  const char* name)
+{
+    struct blob body = { 0 };
+
+    blob_put16(&body, id);
+    blob_put_guid(&body, guid);
+    blob_put32(&body, MOCK_EFI_ATTR);
+    blob_put16(&body, size);
+    blob_put(&body, name, strlen(name) + 1);
+    ifr_op(ifr, 0x26, &body, 0);
+}
+
+/* ONE_OF, CHECKBOX or NUMERIC; the low bits of flags give the size of
+ * ONE_OF and NUMERIC values */
+static void
+ifr_question (struct blob* ifr, grub_uint8_t opcode, grub_uint16_t prompt, grub_uint16_t question_id,
+              grub_uint16_t varstore, grub_uint16_t offset, grub_uint8_t flags)
+{
+    struct blob body = { 0 };
+
+    blob_put16(&body, prompt);
+    blob_put16(&body, 0);
+    blob_put16(&body, question_id);
+    blob_put16(&body, varstore);
+    blob_put16(&body, offset);
+    blob_put8(&body, 0);
+    blob_put8(&body, flags);
+    ifr_op(ifr, opcode, &body, 0);
+}
+
+static void
+hii_package (struct blob* list, grub_uint8_t type, struct blob* body)
+{
+    blob_put32(list, (grub_uint32_t) (body->size + 4) | ((grub_uint32_t) type << 24));
+    blob_put_blob(list, body);
+}
+
+/* Strings package with UCS-2 strings 1..count, plus a skip and an SCSU
+ * string to exercise the other block types. */
+static void
+hii_strings (struct blob* list, const char* language, const char* const* strings, grub_size_t count)
+{
+    struct blob body = { 0 };
+    grub_uint32_t header_size = 4 + 4 + 4 + 32 + 2 + strlen(language) + 1;
+
+    blob_put32(&body, header_size);
+    blob_put32(&body, header_size);
+    for (int i = 0; i < 16; ++i)
+        blob_put16(&body, 0);
+    blob_put16(&body, 1);
+    blob_put(&body, language, strlen(language) + 1);
+    for (grub_size_t i = 0; i < count; ++i)
+    {
+        blob_put8(&body, 0x14);
+        for (const char* c = strings[i]; *c; ++c)
+            blob_put16(&body, (grub_uint8_t) *c);
+        blob_put16(&body, 0);
+    }
+    blob_put8(&body, 0x22);
+    blob_put16(&body, 2);
+    blob_put8(&body, 0x10);
+    blob_put(&body, "Scsu Thing", sizeof("Scsu Thing"));
+    blob_put8(&body, 0x00);
+    hii_package(list, 0x04, &body);
+}
+
+/* A package list with questions in a buffer varstore (NetworkStackVar) and an
+ * EFI varstore (Setup). The prompts are looked up in the English strings. */
+static struct blob
+hii_fixture (void)
+{
+    static const char* const french[] =
+        { "Support PXE Ipv6", "Demarrage silencieux", "Delai de demarrage", "Mode de demarrage" };
+    static const char* const english[] =
+        { "Ipv6 PXE Support", "Quiet Boot", "  Boot Timeout ", "Boot Mode" };
+    struct blob ifr = { 0 };
+    struct blob body = { 0 };
+    struct blob packages = { 0 };
+    struct blob list = { 0 };
+
+    blob_put_guid(&body, &setup_guid);
+    blob_put32(&body, 0);
+    ifr_op(&ifr, 0x0e, &body, 1);
+    ifr_varstore(&ifr, 1, &network_guid, 0x9, "NetworkStackVar");
+    ifr_varstore_efi(&ifr, 2, &setup_guid, 0x400, "Setup");
+    ifr_question(&ifr, 0x05, 1, 0x10, 1, 0x2, 0);
+    ifr_question(&ifr, 0x06, 2, 0x11, 2, 0x10, 0);
+    ifr_question(&ifr, 0x07, 3, 0x12, 2, 0x20, 1);
+    ifr_question(&ifr, 0x05, 4, 0x13, 2, 0x30, 2);
+    ifr_op(&ifr, 0x29, &body, 0);
+    hii_package(&packages, 0x02, &ifr);
+
+    hii_strings(&packages, "fr-FR", french, ARRAY_SIZE(french));
+    hii_strings(&packages, "en-US", english, ARRAY_SIZE(english));
+    hii_package(&packages, 0xdf, &body);
+
+    blob_put_guid(&list, &setup_guid);
+    blob_put32(&list, packages.size + 20);
+    blob_put_blob(&list, &packages);
+    return list;
+}
+
+static void
+test_hii_offsets (void)
+{
+    struct blob hii = hii_fixture();
+
+    test_begin("hii_offsets");
+
+    /* without a file the package lists come from the HII database */
+    CHECK(host_run("setup_var_q \"Boot Mode\"") != GRUB_ERR_NONE);
+    mock_efi_set_hii(hii.data, hii.size);
+    CHECK_OK("setup_var_qload");
+    CHECK_OUTPUT("4 question(s) in 2 varstore(s)");
+
+    /* NUMERIC with a 2 byte value at 0x20 of Setup */
+    mock_efi_reset_calls();
+    CHECK_OK("setup_var_q \"Boot Timeout\" 0x1234");
+    CHECK(mock_efi_calls.set_variable == 1);
+    CHECK(var_byte("Setup", &setup_guid, 0x1f) == (grub_uint8_t) (0x1f * 7));
+    CHECK(var_byte("Setup", &setup_guid, 0x20) == 0x34);
+    CHECK(var_byte("Setup", &setup_guid, 0x21) == 0x12);
+    CHECK(var_byte("Setup", &setup_guid, 0x22) == (grub_uint8_t) (0x22 * 7));
+    /* the other Setup varstore has a different GUID and is left alone */
+    CHECK(var_byte("Setup", &other_guid, 0x0) == 0x0);
+
+    /* ONE_OF with a 4 byte value, read only */
+    mock_efi_reset_calls();
+    CHECK_OK("setup_var_q \"boot mode\"");
+    CHECK_OUTPUT("0x30");
+    CHECK(mock_efi_calls.set_variable == 0);
+
+    /* by QuestionId, in the buffer varstore */
+    CHECK_OK("setup_var_q 0x10 0x1");
+    CHECK(var_byte("NetworkStackVar", &network_guid, 0x2) == 0x1);
+    CHECK(var_byte("NetworkStackVar", &network_guid, 0x3) == 0x0);
+
+    /* CHECKBOX values are a single byte */
+    CHECK_OK("setup_var_q \"Quiet Boot\" 0x1");
+    CHECK(var_byte("Setup", &setup_guid, 0x10) == 0x1);
+    CHECK(var_byte("Setup", &setup_guid, 0x11) == (grub_uint8_t) (0x11 * 7));
+
+    /* values too large for the question are refused, not truncated */
+    mock_efi_reset_calls();
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_q \"Quiet Boot\" 0x100");
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_q \"Boot Timeout\" 0x10000");
+    CHECK(mock_efi_calls.set_variable == 0);
+    CHECK(var_byte("Setup", &setup_guid, 0x10) == 0x1);
+    CHECK(var_byte("Setup", &setup_guid, 0x11) == (grub_uint8_t) (0x11 * 7));
+
+    /* the same from a file, with the package list exported twice */
+    mock_efi_set_hii(NULL, 0);
+    hii.data = realloc(hii.data, hii.size * 2);
+    memcpy(hii.data + hii.size, hii.data, hii.size);
+    CHECK_OK("setup_var_qload %s", host_temp_file(hii.data, hii.size * 2));
+    CHECK_OK("setup_var_q 0x12");
+    CHECK_OUTPUT("0x1234");
+
+    free(hii.data);
+    test_end();
+}
+
+/* More varstores in one form set than a fixed table would hold. */
+static void
+test_hii_many_varstores (void)
+{
+    static const char* const strings[] = { "Last Option" };
+    struct blob ifr = { 0 };
+    struct blob body = { 0 };
+    struct blob packages = { 0 };
+    struct blob list = { 0 };
+    grub_efi_guid_t last_guid = other_guid;
+    char name[16];
+
+    test_begin("hii_many_varstores");
+
+    blob_put_guid(&body, &setup_guid);
+    blob_put32(&body, 0);
+    ifr_op(&ifr, 0x0e, &body, 1);
+    for (int i = 1; i <= 100; ++i)
+    {
+        grub_efi_guid_t guid = other_guid;
+
+        guid.data1 += i;
+        grub_snprintf(name, sizeof(name), "Store%03d", i);
+        ifr_varstore(&ifr, i, &guid, 0x10, name);
+        last_guid = guid;
+    }
+    mock_efi_add_fill(name, &last_guid, 0x10, 0x00);
+    ifr_question(&ifr, 0x05, 1, 0x20, 100, 0x3, 0);
+    ifr_op(&ifr, 0x29, &body, 0);
+    hii_package(&packages, 0x02, &ifr);
+    hii_strings(&packages, "en-US", strings, ARRAY_SIZE(strings));
+    hii_package(&packages, 0xdf, &body);
+    blob_put_guid(&list, &setup_guid);
+    blob_put32(&list, packages.size + 20);
+    blob_put_blob(&list, &packages);
+
+    CHECK_OK("setup_var_qload %s", host_temp_file(list.data, list.size));
+    CHECK_OUTPUT("1 question(s) in 100 varstore(s)");
+    CHECK_OK("setup_var_q \"Last Option\" 0x5");
+    CHECK(var_byte("Store100", &last_guid, 0x3) == 0x5);
+
+    free(list.data);
+    test_end();
+}
+
+static void
+test_capacity (void)
+{
+    static const char batch[] =
+        "Custom 0x4 0x1 0x66\n"
+        "Setup " SETUP_GUID_STR " 0x4 0x1 0x66\n";
+    grub_uint8_t network[9] = { 0 };
+
+    test_begin("capacity");
+    /* NetworkStackVar is volatile, so it is checked against another store */
+    mock_efi_add("NetworkStackVar", &network_guid,
+                 GRUB_EFI_VARIABLE_BOOTSERVICE_ACCESS | GRUB_EFI_VARIABLE_RUNTIME_ACCESS, network, sizeof(network));
+
+    /* a single write is refused with its own error */
+    mock_efi_set_store(0x10000, 0x8c, 0x10000);
+    mock_efi_reset_calls();
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_cv Custom 0x4 0x1 0x22");
+    CHECK(strstr(host_error(), "not enough variable store space (need 0x8e, have 0x8c)") != NULL);
+    CHECK(mock_efi_calls.set_variable == 0);
+    CHECK(mock_efi_calls.query_variable_info == 1);
+    CHECK_OK("setup_var_cv --force Custom 0x4 0x1 0x22");
+    CHECK(mock_efi_calls.set_variable == 1);
+
+    mock_efi_set_store(0x10000, 0x10000, 0x20);
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_cv Custom 0x4 0x1 0x33");
+    CHECK(strstr(host_error(), "variable too large for the store (need 0x40, at most 0x20)") != NULL);
+
+    /* a commit queries the store once per set of attributes, and not again
+     * for each varstore */
+    mock_efi_set_store(0x10000, 0x10000, 0x10000);
+    CHECK_OK("setup_var_begin");
+    CHECK_OK("setup_var_cv Custom 0x4 0x1 0x44");
+    CHECK_OK("setup_var_gv Setup " SETUP_GUID_STR " 0x4 0x1 0x44");
+    CHECK_OK("setup_var_cv NetworkStackVar 0x2 0x1 0x1");
+    mock_efi_reset_calls();
+    CHECK_OK("setup_var_commit");
+    CHECK(mock_efi_calls.set_variable == 3);
+    CHECK(mock_efi_calls.query_variable_info == 2);
+
+    /* each varstore fits on its own, the batch doesn't: nothing is written
+     * and the session stays open */
+    CHECK_OK("setup_var_begin");
+    CHECK_OK("setup_var_cv Custom 0x4 0x1 0x55");
+    CHECK_OK("setup_var_gv Setup " SETUP_GUID_STR " 0x4 0x1 0x55");
+    mock_efi_set_store(0x10000, 0x4d0, 0x10000);
+    mock_efi_reset_calls();
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_commit");
+    CHECK(strstr(host_error(), "not enough variable store space (need 0x4da, have 0x4d0)") != NULL);
+    CHECK_OUTPUT("the session is still open");
+    CHECK(mock_efi_calls.set_variable == 0);
+    mock_efi_set_store(0x10000, 0x10000, 0x10000);
+    CHECK_OK("setup_var_commit");
+    CHECK(mock_efi_calls.set_variable == 2);
+    CHECK(var_byte("Custom", &setup_guid, 4) == 0x55);
+
+    /* setup_var_apply outside a session drops its edits instead */
+    mock_efi_set_store(0x10000, 0x4d0, 0x10000);
+    mock_efi_reset_calls();
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_apply %s", host_temp_file(batch, sizeof(batch) - 1));
+    CHECK_OUTPUT("the edits are discarded");
+    CHECK(strstr(host_output(), "still open") == NULL);
+    CHECK(mock_efi_calls.set_variable == 0);
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_commit");
+
+    test_end();
+}
+
+static unsigned int
+count_lines (const char* str, const char* needle)
+{
+    unsigned int count = 0;
+
+    for (; (str = strstr(str, needle)); str++)
+        count++;
+    return count;
+}
+
+static void
+test_find_cap (void)
+{
+    grub_uint8_t data[0x200];
+
+    test_begin("find_cap");
+    memset(data, 0x5a, sizeof(data));
+    mock_efi_add("Filler", &other_guid, MOCK_EFI_ATTR, data, sizeof(data));
+
+    /* 0x5a5a matches at every offset of Filler */
+    CHECK_OK("setup_var_find 0x5a5a");
+    CHECK(count_lines(host_output(), "offset 0x") == 100);
+    CHECK_OUTPUT("411 more match(es) omitted");
+    CHECK_OUTPUT("511 match(es) in 1 of 5 variables searched");
+
+    CHECK_OK("setup_var_find 0x5a5a --max 0x10");
+    CHECK(count_lines(host_output(), "offset 0x") == 0x10);
+    CHECK_OUTPUT("495 more match(es) omitted");
+
+    CHECK_OK("setup_var_find --max 0 0x5a5a");
+    CHECK(count_lines(host_output(), "offset 0x") == 511);
+    CHECK(strstr(host_output(), "omitted") == NULL);
+
+    /* under the cap nothing is said about it */
+    CHECK_OK("setup_var_find 0x1111 --name Custom");
+    CHECK(count_lines(host_output(), "offset 0x") == 63);
+    CHECK(strstr(host_output(), "omitted") == NULL);
+
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_find 0x5a5a --max lots");
+    test_end();
+}
+
+static void
+test_quiet (void)
+{
+    test_begin("quiet");
+
+    /* the value is still printed, the chatter around it isn't */
+    CHECK_OK("setup_var_cv Custom 0x4");
+    CHECK_OUTPUT("Looking for Custom variable");
+    CHECK_OK("setup_var_cv --quiet Custom 0x4");
+    CHECK_OUTPUT("offset 0x04 is: 0x11");
+    CHECK(strstr(host_output(), "Looking for") == NULL);
+    CHECK(strstr(host_output(), "variable store:") == NULL);
+
+    /* errors come through whatever --quiet says */
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_cv -q Custom 0x4 0x1 0x100");
+    CHECK(strstr(host_error(), "too large") != NULL);
+
+    /* and so do warnings and the errors of a commit, which go to the output */
+    CHECK_OK("setup_var_begin");
+    CHECK_OK("setup_var_cv -q Custom 0x4 0x1 0x22");
+    CHECK(strcmp(host_output(), "offset 0x04 is: 0x11\nsetting offset 0x04 to 0x22\n") == 0);
+    mock_efi_set_store(0x10000, 0x10, 0x10000);
+    CHECK_ERR(GRUB_ERR_INVALID_COMMAND, "setup_var_commit --quiet --force");
+    CHECK_OUTPUT("warning: the write needs about");
+    CHECK_OUTPUT("error: can't set variable using efi");
+    CHECK(strstr(host_output(), "variable store:") == NULL);
+    CHECK(var_byte("Custom", &setup_guid, 4) == 0x11);
+
+    test_end();
+}
+
+static void
+test_dump (void)
+{
+    test_begin("dump");
+
+    CHECK_OK("setup_var_dump NetworkStackVar 0x0:0x1 0x1:0x8");
+    CHECK_OK("setup_var_dump Custom " SETUP_GUID_STR " 0x3c 0x4");
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_dump NetworkStackVar 0x8:0x2");
+    /* offset + size wraps around, and the offset doesn't fit in 32 bits */
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_dump NetworkStackVar 0xffffffffffffffff:0x8");
+    CHECK_ERR(GRUB_ERR_OUT_OF_RANGE, "setup_var_dump NetworkStackVar 0x100000000:0x1");
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_dump NetworkStackVar 0xffffffff:0x8");
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_dump NetworkStackVar 0xfffffffffffffff8 0x10");
+
+    test_end();
+}
+
+/* Calls to a service in the output of setup_var_stats. */
+static unsigned long
+stat_calls (const char* service)
+{
+    const char* line = strstr(host_output(), service);
+    unsigned long calls = 0;
+
+    if (!line || sscanf(line + strlen(service), "%lu", &calls) != 1)
+        check(0, "setup_var_stats lists the service", __FILE__, __LINE__);
+    return calls;
+}
+
+static void
+efivar_write (const char* dir, const char* file, grub_uint32_t attr, const void* data, grub_size_t size)
+{
+    char path[256];
+    FILE* f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    f = fopen(path, "wb");
+    if (!f || fwrite(&attr, sizeof(attr), 1, f) != 1 || fwrite(data, 1, size, f) != size || fclose(f) != 0)
+    {
+        perror(path);
+        exit(2);
+    }
+}
+
+static grub_uint8_t*
+efivar_read (const char* dir, const char* file, grub_size_t* size)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    return host_read_file(path, size);
+}
+
+static void
+remove_dir (const char* dir)
+{
+    struct dirent* dirent;
+    DIR* d = opendir(dir);
+
+    while (d && (dirent = readdir(d)))
+    {
+        if (dirent->d_name[0] != '.')
+            unlinkat(dirfd(d), dirent->d_name, 0);
+    }
+    if (d)
+        closedir(d);
+    rmdir(dir);
+}
+
+static void
+test_efivarfs (void)
+{
+    char dir[] = "/tmp/setup_var_efivarfs.XXXXXX";
+    grub_uint8_t setup[0x100];
+    grub_uint8_t custom[0x40];
+    grub_uint8_t* data;
+    grub_uint32_t attr;
+    grub_size_t size;
+
+    test_begin("efivarfs");
+    if (!mkdtemp(dir))
+    {
+        perror(dir);
+        exit(2);
+    }
+    for (grub_size_t i = 0; i < sizeof(setup); ++i)
+        setup[i] = (grub_uint8_t) i;
+    memset(custom, 0x11, sizeof(custom));
+    efivar_write(dir, "Setup-" SETUP_GUID_FILE, MOCK_EFI_ATTR, setup, sizeof(setup));
+    efivar_write(dir, "Custom-" SETUP_GUID_FILE, MOCK_EFI_ATTR, custom, sizeof(custom));
+    efivar_write(dir, "README", 0, "", 0);
+
+    CHECK(grub_setup_var_use_efivarfs(dir) == GRUB_ERR_NONE);
+    mock_efi_reset_calls();
+
+    /* the files are the store, the runtime services aren't used */
+    CHECK_OK("lsefivar --names-only");
+    CHECK_OUTPUT("Setup");
+    CHECK_OUTPUT("Custom");
+    CHECK(strstr(host_output(), "README") == NULL);
+    CHECK(strstr(host_output(), "NetworkStackVar") == NULL);
+    CHECK_OK("setup_var_cv Setup 0x10");
+    CHECK_OUTPUT("offset 0x10 is: 0x10");
+    CHECK(mock_efi_calls.get_next_variable_name == 0 && mock_efi_calls.get_variable == 0);
+
+    /* a write rewrites the whole file, attributes first */
+    CHECK_OK("setup_var_cv Setup 0x10 0x2 0xbeef");
+    data = efivar_read(dir, "Setup-" SETUP_GUID_FILE, &size);
+    CHECK(data && size == sizeof(attr) + sizeof(setup));
+    if (data && size == sizeof(attr) + sizeof(setup))
+    {
+        memcpy(&attr, data, sizeof(attr));
+        CHECK(attr == MOCK_EFI_ATTR);
+        CHECK(data[4 + 0x10] == 0xef && data[4 + 0x11] == 0xbe && data[4 + 0x12] == 0x12);
+    }
+    free(data);
+    CHECK(mock_efi_calls.set_variable == 0);
+
+    /* unchanged values aren't written, a session writes each varstore once */
+    CHECK_OK("setup_var_stats --reset");
+    CHECK_OK("setup_var_cv Setup 0x10 0x2 0xbeef");
+    CHECK_OK("setup_var_begin");
+    CHECK_OK("setup_var_cv Custom 0x0 0x1 0x1");
+    CHECK_OK("setup_var_cv Custom 0x1 0x1 0x2");
+    CHECK_OK("setup_var_cv Setup 0x0 0x1 0x3");
+    CHECK_OK("setup_var_commit");
+    CHECK_OK("setup_var_stats");
+    CHECK_OUTPUT("(efivarfs)");
+    CHECK_OUTPUT("1 unchanged write(s) skipped");
+    CHECK(stat_calls("SetVariable") == 2);
+    CHECK(stat_calls("GetNextVariableName") == 0);
+    data = efivar_read(dir, "Custom-" SETUP_GUID_FILE, &size);
+    CHECK(data && size == sizeof(attr) + sizeof(custom) && data[4] == 0x1 && data[5] == 0x2 && data[6] == 0x11);
+    free(data);
+
+    CHECK_ERR(GRUB_ERR_BAD_ARGUMENT, "setup_var_gv Missing " SETUP_GUID_STR " 0x0");
+    CHECK(grub_setup_var_use_efivarfs("/nonexistent/efivars") == GRUB_ERR_FILE_NOT_FOUND);
+
+    /* back on the runtime services, with nothing cached from the files */
+    CHECK(grub_setup_var_use_efivarfs(NULL) == GRUB_ERR_NONE);
+    CHECK_OK("setup_var_cv NetworkStackVar 0x0");
+    remove_dir(dir);
+    test_end();
+}
+
+/* A variable in an authenticated VSS store, padded to 4 bytes with erased
+ * flash. Returns where its data starts in the store blob. */
+static grub_size_t
+vss_variable (struct blob* store, grub_uint8_t state, grub_uint32_t attr, const char* name,
+              const grub_efi_guid_t* guid, const void* data, grub_size_t size)
+{
+    static const grub_uint8_t zero[28];
+    grub_size_t data_offset;
+
+    blob_put16(store, 0x55aa);
+    blob_put8(store, state);
+    blob_put8(store, 0);
+    blob_put32(store, attr);
+    /* monotonic count, timestamp and public key index */
+    blob_put(store, zero, sizeof(zero));
+    blob_put32(store, (strlen(name) + 1) * 2);
+    blob_put32(store, size);
+    blob_put_guid(store, guid);
+    for (const char* c = name; ; ++c)
+    {
+        blob_put16(store, (grub_uint8_t) *c);
+        if (!*c)
+            break;
+    }
+    data_offset = store->size;
+    blob_put(store, data, size);
+    while (store->size % 4)
+        blob_put8(store, 0xff);
+    return data_offset;
+}
+
+/* Start an authenticated EDK2 variable store of size bytes. */
+static void
+vss_store (struct blob* img, grub_uint32_t size)
+{
+    static const grub_efi_guid_t auth_store_guid =
+        { 0xaaf32c78, 0x947b, 0x439a, { 0xa1, 0x80, 0x2e, 0x14, 0x4e, 0xc3, 0x77, 0x92 } };
+
+    blob_put_guid(img, &auth_store_guid);
+    blob_put32(img, size);
+    blob_put8(img, 0x5a);
+    blob_put8(img, 0xfe);
+    blob_put16(img, 0);
+    blob_put32(img, 0);
+}
+
+static void
+test_image (void)
+{
+    const grub_uint32_t store_offset = 0x48;
+    const grub_uint32_t store_size = 0x1000;
+    grub_uint8_t setup[0x100];
+    grub_uint8_t custom[0x40];
+    grub_uint8_t lang[4] = { 'e', 'n', 'g', 0 };
+    grub_uint8_t zero[0x200];
+    struct blob img = { 0 };
+    grub_size_t setup_data;
+    grub_size_t custom_header;
+    grub_size_t size;
+    grub_uint8_t* data;
+    const char* path;
+    const char* snapshot;
+
+    test_begin("image");
+    for (grub_size_t i = 0; i < sizeof(setup); ++i)
+        setup[i] = (grub_uint8_t) i;
+    memset(custom, 0x11, sizeof(custom));
+    memset(zero, 0, sizeof(zero));
+
+    /* a store after a firmware volume header, with an older deleted copy of
+     * Setup and a replacement of Lang that was cut short */
+    blob_put(&img, zero, store_offset);
+    vss_store(&img, store_size);
+    vss_variable(&img, 0x3c, MOCK_EFI_ATTR, "Setup", &setup_guid, zero, sizeof(setup));
+    setup_data = vss_variable(&img, 0x3f, MOCK_EFI_ATTR, "Setup", &setup_guid, setup, sizeof(setup));
+    custom_header = img.size;
+    vss_variable(&img, 0x3f, GRUB_EFI_VARIABLE_BOOTSERVICE_ACCESS, "Custom", &setup_guid, custom, sizeof(custom));
+    vss_variable(&img, 0x3e, MOCK_EFI_ATTR, "Lang", &other_guid, "fra", 4);
+    vss_variable(&img, 0x3f, MOCK_EFI_ATTR, "Lang", &other_guid, lang, sizeof(lang));
+    vss_variable(&img, 0x3e, MOCK_EFI_ATTR, "Timeout", &other_guid, "\x05\x00", 2);
+    while (img.size < store_offset + store_size)
+        blob_put8(&img, 0xff);
+    blob_put(&img, zero, 0x100);
+    path = host_temp_file(img.data, img.size);
+
+    /* the save is taken from the runtime services, with other attributes */
+    snapshot = host_temp_file(zero, sizeof(zero));
+    CHECK_OK("setup_var_save Custom %s", snapshot);
+
+    CHECK(grub_setup_var_use_image(path) == GRUB_ERR_NONE);
+    mock_efi_reset_calls();
+    CHECK_OK("lsefivar --names-only");
+    CHECK(count_lines(host_output(), "name: Setup") == 1);
+    CHECK(count_lines(host_output(), "name: Lang") == 1);
+    CHECK(count_lines(host_output(), "name: Timeout") == 1);
+    CHECK(strstr(host_output(), "NetworkStackVar") == NULL);
+    CHECK_OK("setup_var_gv Lang 80E1202E-2697-4264-0102-030405060708 0x0 0x3");
+    CHECK_OUTPUT("0x676e65");
+    CHECK_OK("setup_var_cv Setup 0x10");
+    CHECK_OUTPUT("offset 0x10 is: 0x10");
+
+    /* same-size writes patch the image where the data is */
+    CHECK_OK("setup_var_cv Setup 0x10 0x2 0xbeef");
+    data = host_read_file(path, &size);
+    CHECK(data && size == img.size);
+    if (data && size == img.size)
+    {
+        CHECK(data[setup_data + 0x10] == 0xef && data[setup_data + 0x11] == 0xbe);
+        CHECK(memcmp(data + setup_data + 0x12, setup + 0x12, sizeof(setup) - 0x12) == 0);
+        CHECK(memcmp(data + setup_data + sizeof(setup), img.data + setup_data + sizeof(setup),
+                     img.size - setup_data - sizeof(setup)) == 0);
+    }
+    free(data);
+
+    /* other attributes need a new copy, appended after the last one */
+    CHECK_OK("setup_var_restore %s", snapshot);
+    CHECK_OUTPUT("attributes differ");
+    CHECK(mock_efi_calls.get_variable == 0 && mock_efi_calls.set_variable == 0);
+    CHECK_OK("lsefivar --names-only --name Custom");
+    CHECK(count_lines(host_output(), "name: Custom") == 1);
+    CHECK_OK("setup_var_cv Custom 0x3f");
+    CHECK_OUTPUT("offset 0x3f is: 0x11");
+    data = host_read_file(path, &size);
+    CHECK(data && size == img.size && data[custom_header + 2] == 0x3d);
+    free(data);
+
+    /* the image reads the same when opened again */
+    CHECK(grub_setup_var_use_image(path) == GRUB_ERR_NONE);
+    CHECK_OK("setup_var_restore %s", snapshot);
+    CHECK_OUTPUT("unchanged");
+    CHECK_OK("setup_var_cv Setup 0x11");
+    CHECK_OUTPUT("offset 0x11 is: 0xbe");
+
+    CHECK(grub_setup_var_use_image(snapshot) == GRUB_ERR_BAD_FILE_TYPE);
+    CHECK(grub_setup_var_use_efivarfs(NULL) == GRUB_ERR_NONE);
+    free(img.data);
+    test_end();
+}
+
+static void
+test_image_stores (void)
+{
+    const grub_uint32_t store_size = 0x400;
+    grub_uint8_t setup[0x40];
+    grub_uint8_t zero[0x100];
+    struct blob img = { 0 };
+    grub_size_t extra_data;
+    grub_size_t size;
+    grub_uint8_t* data;
+    const char* path;
+    const char* snapshot;
+
+    test_begin("image_stores");
+    memset(setup, 0x22, sizeof(setup));
+    memset(zero, 0, sizeof(zero));
+    snapshot = host_temp_file(zero, sizeof(zero));
+    CHECK_OK("setup_var_save Custom %s", snapshot);
+
+    /* a main store and a second one holding an older copy of Setup and a
+     * variable of its own */
+    vss_store(&img, store_size);
+    vss_variable(&img, 0x3f, MOCK_EFI_ATTR, "Setup", &setup_guid, setup, sizeof(setup));
+    while (img.size < store_size)
+        blob_put8(&img, 0xff);
+    blob_put(&img, zero, 0x40);
+    vss_store(&img, store_size);
+    vss_variable(&img, 0x3f, MOCK_EFI_ATTR, "Setup", &setup_guid, zero, sizeof(setup));
+    extra_data = vss_variable(&img, 0x3f, MOCK_EFI_ATTR, "Extra", &other_guid, "\x01\x02", 2);
+    while (img.size < 0x40 + 2 * store_size)
+        blob_put8(&img, 0xff);
+    path = host_temp_file(img.data, img.size);
+
+    CHECK(grub_setup_var_use_image(path) == GRUB_ERR_NONE);
+    CHECK_OK("lsefivar --names-only");
+    CHECK(count_lines(host_output(), "name: Setup") == 1);
+    CHECK(count_lines(host_output(), "name: Extra") == 1);
+    /* the first store's copy wins */
+    CHECK_OK("setup_var_cv Setup 0x3");
+    CHECK_OUTPUT("offset 0x03 is: 0x22");
+
+    /* a variable of the second store is read and patched where it is */
+    CHECK_OK("setup_var_gv Extra 80E1202E-2697-4264-0102-030405060708 0x1 0x1 0x7");
+    data = host_read_file(path, &size);
+    CHECK(data && size == img.size);
+    if (data && size == img.size)
+    {
+        CHECK(data[extra_data] == 0x01 && data[extra_data + 1] == 0x07);
+        CHECK(memcmp(data, img.data, extra_data) == 0);
+    }
+    free(data);
+
+    /* a new variable goes to the first store, in front of the second */
+    CHECK_OK("setup_var_restore %s", snapshot);
+    CHECK_OUTPUT("variable not present, creating it.");
+    CHECK(grub_setup_var_use_image(path) == GRUB_ERR_NONE);
+    CHECK_OK("setup_var_cv Custom 0x3f");
+    CHECK_OUTPUT("offset 0x3f is: 0x11");
+    data = host_read_file(path, &size);
+    CHECK(data && size == img.size && memcmp(data + store_size, img.data + store_size, extra_data - store_size) == 0);
+    free(data);
+
+    CHECK(grub_setup_var_use_efivarfs(NULL) == GRUB_ERR_NONE);
+    free(img.data);
+    test_end();
+}
+
+static void
+test_fingerprint_diff (void)
+{
+    static grub_uint8_t zero[0x1000];
+    const char* golden;
+    const char* current;
+    const char* full_golden;
+    const char* full_current;
+    grub_uint8_t* image;
+    grub_size_t image_size;
+
+    test_begin("fingerprint_diff");
+
+    golden = host_temp_file(zero, sizeof(zero));
+    current = host_temp_file(zero, sizeof(zero));
+    full_golden = host_temp_file(zero, sizeof(zero));
+    full_current = host_temp_file(zero, sizeof(zero));
+
+    /* an unchanged store gives the same fingerprint */
+    CHECK_OK("setup_var_fingerprint %s", golden);
+    CHECK_OUTPUT("(4 variables)");
+    CHECK_OK("setup_var_fingerprint %s", current);
+    CHECK_OK("setup_var_diff %s %s", golden, current);
+    CHECK_OUTPUT("fingerprints are identical");
+
+    /* one changed byte: the variable is reported, and with --contents the
+     * offset and both values too */
+    CHECK_OK("setup_var_fingerprint --contents %s", full_golden);
+    CHECK_OK("setup_var_cv Custom 0x12 0x1 0x5a");
+    CHECK_OK("setup_var_fingerprint %s", current);
+    CHECK_OK("setup_var_fingerprint --contents %s", full_current);
+    CHECK_OK("setup_var_diff %s %s", golden, current);
+    CHECK_OUTPUT("~ " SETUP_GUID_FILE " Custom (0x40 bytes)");
+    CHECK_OUTPUT("0 added, 0 removed, 1 changed.");
+    CHECK(count_lines(host_output(), "\n") == 2);
+    CHECK_OK("setup_var_diff %s %s", full_golden, full_current);
+    CHECK_OUTPUT("~ " SETUP_GUID_FILE " Custom (0x40 bytes)\n    0x12: 0x11 -> 0x5a\n");
+    CHECK(count_lines(host_output(), "\n") == 3);
+
+    /* a variable that appears, and read the other way round, disappears */
+    mock_efi_add_fill("Extra", &setup_guid, 0x10, 0x33);
+    CHECK_OK("setup_var_rescan");
+    CHECK_OK("setup_var_fingerprint %s", golden);
+    CHECK_OK("setup_var_diff %s %s", current, golden);
+    CHECK_OUTPUT("+ " SETUP_GUID_FILE " Extra (0x10 bytes)");
+    CHECK_OUTPUT("1 added, 0 removed, 0 changed.");
+    CHECK_OK("setup_var_diff %s %s", golden, current);
+    CHECK_OUTPUT("- " SETUP_GUID_FILE " Extra (0x10 bytes)");
+    CHECK_OUTPUT("0 added, 1 removed, 0 changed.");
+
+    /* a damaged file is refused, not misread */
+    image = host_read_file(full_current, &image_size);
+    CHECK(image != NULL);
+    if (image)
+    {
+        image[0x100] ^= 0xff;
+        CHECK_ERR(GRUB_ERR_BAD_FILE_TYPE, "setup_var_diff %s %s", golden, host_temp_file(image, image_size));
+        CHECK(strstr(host_error(), "checksum mismatch") != NULL);
+        CHECK(strcmp(host_output(), "") == 0);
+
+        /* cut off in the middle of a record */
+        CHECK_ERR(GRUB_ERR_BAD_FILE_TYPE, "setup_var_diff %s %s", golden, host_temp_file(image, 0x40));
+        CHECK(strstr(host_error(), "not a setup_var fingerprint") != NULL);
+        /* shorter than the header */
+        CHECK_ERR(GRUB_ERR_BAD_FILE_TYPE, "setup_var_diff %s %s", host_temp_file(image, 0x8), golden);
+        CHECK(strstr(host_error(), "not a setup_var fingerprint") != NULL);
+        /* contents that run past the end of the file; the size of the first
+         * record follows the 20 byte header, GUID and attributes */
+        image[0x100] ^= 0xff;
+        memset(image + 0x14 + 0x14, 0xff, 4);
+        CHECK_ERR(GRUB_ERR_BAD_FILE_TYPE, "setup_var_diff %s %s", golden, host_temp_file(image, image_size));
+        CHECK(strstr(host_error(), "not a setup_var fingerprint") != NULL);
+        free(image);
+    }
+
+    test_end();
+}
+
+int
+main (void)
+{
+    test_index_reused();
+    test_enumeration_error();
+    test_write_elision();
+    test_argument_ranges();
+    test_session_write_elision();
+    test_apply_all_or_nothing();
+    test_save_restore();
+    test_hii_offsets();
+    test_hii_many_varstores();
+    test_capacity();
+    test_find_cap();
+    test_quiet();
+    test_dump();
+    test_fingerprint_diff();
+    test_efivarfs();
+    test_image();
+    test_image_stores();
+
+    mock_efi_reset();
+    printf("%u checks, %u failures\n", checks, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,103 @@
+/* setup_var_cli.c - run the setup_var commands from Linux, on the variables
+ *                   efivarfs exposes or on a firmware image file */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <grub/efi/efi.h>
+#include <grub/misc.h>
+
+#include "host.h"
+#include "setup_var_host.h"
+
+#define DEFAULT_EFIVARFS_ROOT	"/sys/firmware/efi/efivars"
+
+/* There are no runtime services here, only the efivarfs backend is used. */
+grub_efi_system_table_t* grub_efi_system_table;
+
+void*
+grub_efi_locate_protocol (grub_efi_guid_t* protocol __attribute__ ((unused)),
+                          void* registration __attribute__ ((unused)))
+{
+    return NULL;
+}
+
+static void
+usage (void)
+{
+    fprintf(stderr,
+            "Usage: setup-var [--efivarfs dir | --image file] [command [args...]]\n"
+            "Run one setup_var command, e.g. setup-var setup_var_cv Setup 0x10 0x1 0x0,\n"
+            "or with no command, one command per line from standard input, so that\n"
+            "setup_var_begin ... setup_var_commit batches several edits.\n"
+            "The variables are those in efivarfs, under " DEFAULT_EFIVARFS_ROOT " unless\n"
+            "dir is given, or those in the variable store of a firmware image file.\n");
+    exit(2);
+}
+
+static int
+report (grub_err_t err)
+{
+    if (err == GRUB_ERR_NONE)
+        return 0;
+    fprintf(stderr, "error: %s.\n", host_error());
+    return 1;
+}
+
+int
+main (int argc, char** argv)
+{
+    const char* root = DEFAULT_EFIVARFS_ROOT;
+    const char* image = NULL;
+    grub_err_t err;
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    int failed = 0;
+
+    /* options go before the command, whose own --quiet and --force follow it */
+    for (argc--, argv++; argc > 0 && argv[0][0] == '-'; argc--, argv++)
+    {
+        if (strcmp(argv[0], "--efivarfs") == 0 && argc > 1)
+        {
+            root = argv[1];
+            argc--, argv++;
+        }
+        else if (strcmp(argv[0], "--image") == 0 && argc > 1)
+        {
+            image = argv[1];
+            argc--, argv++;
+        }
+        else
+            usage();
+    }
+
+    host_set_echo(1);
+    host_init();
+    err = image ? grub_setup_var_use_image(image) : grub_setup_var_use_efivarfs(root);
+    if (report(err))
+    {
+        host_fini();
+        return 1;
+    }
+
+    if (argc > 0)
+        failed = report(host_run_argv(argc, argv));
+    else
+    {
+        while (!failed && (len = getline(&line, &line_size, stdin)) >= 0)
+        {
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+                line[--len] = 0;
+            if (line[strspn(line, " \t")] == 0 || line[strspn(line, " \t")] == '#')
+                continue;
+            failed = report(host_run("%s", line));
+        }
+        free(line);
+    }
+
+    /* a session left open is dropped, as when GRUB exits */
+    host_fini();
+    return failed;
+}
@@ -0,0 +1,1041 @@
+/* setup_var_host.c - variable store backends for running the setup_var
+ *                    commands on Linux: efivarfs and firmware image files */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2002,2003,2005,2006,2007,2008,2009,2008  Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/fs.h>
+
+#include <grub/types.h>
+#include <grub/misc.h>
+#include <grub/mm.h>
+#include <grub/efi/api.h>
+
+#include "setup_var.h"
+#include "setup_var_host.h"
+
+#define SETUP_VAR_EFIVARFS_MAGIC	(0xde5e81e4)
+
+/* EDK2 variable store (VSS) layout, as found in firmware images */
+#define VSS_STORE_SIGNATURE	(0x53535624)	/* "$VSS", Insyde and older stores */
+#define VSS_STORE_GUID		{ 0xddcf3616, 0x3275, 0x4164, { 0x98, 0xb6, 0xfe, 0x85, 0x70, 0x7f, 0xfe, 0x7d } }
+#define VSS_AUTH_STORE_GUID	{ 0xaaf32c78, 0x947b, 0x439a, { 0xa1, 0x80, 0x2e, 0x14, 0x4e, 0xc3, 0x77, 0x92 } }
+#define VSS_STORE_FORMATTED	(0x5a)
+#define VSS_STORE_HEALTHY	(0xfe)
+#define VSS_START_ID		(0x55aa)
+#define VSS_VAR_ADDED		(0x3f)
+#define VSS_VAR_IN_DELETED_TRANSITION	(0xfe)
+#define VSS_VAR_DELETED		(0xfd)
+
+/* Both backends keep a list of the variables, in the order
+ * GetNextVariableName returns them. */
+struct host_var
+{
+    grub_efi_char16_t* name;
+    grub_efi_uintn_t name_size;
+    grub_efi_guid_t guid;
+    /* for image stores, which store the variable is in and where */
+    grub_size_t store;
+    grub_size_t offset;
+    grub_size_t data_offset;
+    grub_uint32_t data_size;
+    grub_uint32_t attr;
+    grub_uint8_t state;
+};
+
+static struct host_var* host_vars = NULL;
+static grub_size_t host_var_count = 0;
+static grub_size_t host_var_capacity = 0;
+/* whether the names are allocated, rather than pointing into an image */
+static int host_var_names_owned = 0;
+/* position of the variable after the last one GetNextVariableName returned */
+static grub_size_t host_var_next = 0;
+
+static void
+host_vars_clear (void)
+{
+    if (host_var_names_owned)
+    {
+        for (grub_size_t i = 0; i < host_var_count; ++i)
+            grub_free(host_vars[i].name);
+    }
+    grub_free(host_vars);
+    host_vars = NULL;
+    host_var_count = 0;
+    host_var_capacity = 0;
+    host_var_next = 0;
+}
+
+static grub_efi_status_t
+host_vars_append (const struct host_var* var)
+{
+    if (host_var_count == host_var_capacity)
+    {
+        grub_size_t new_capacity = host_var_capacity ? host_var_capacity * 2 : 64;
+        struct host_var* new_vars = grub_realloc(host_vars, new_capacity * sizeof(*host_vars));
+        if (!new_vars)
+            return GRUB_EFI_OUT_OF_RESOURCES;
+        host_vars = new_vars;
+        host_var_capacity = new_capacity;
+    }
+    host_vars[host_var_count++] = *var;
+    return GRUB_EFI_SUCCESS;
+}
+
+static int
+host_var_is (const struct host_var* var, const grub_efi_char16_t* name, const grub_efi_guid_t* guid)
+{
+    const grub_efi_char16_t* c = var->name;
+
+    for (; *c && *c == *name; ++c, ++name);
+    return *c == *name && 0 == grub_memcmp(&var->guid, guid, sizeof(grub_efi_guid_t));
+}
+
+/* Position of a variable in the list, or host_var_count. */
+static grub_size_t
+host_vars_find (const grub_efi_char16_t* name, const grub_efi_guid_t* guid)
+{
+    grub_size_t i;
+
+    for (i = 0; i < host_var_count; ++i)
+    {
+        if (host_var_is(&host_vars[i], name, guid))
+            break;
+    }
+    return i;
+}
+
+/* GetNextVariableName over the list. The name given is normally the last one
+ * returned, which is found without a search. */
+static grub_efi_status_t
+host_vars_next (grub_efi_uintn_t* name_size, grub_efi_char16_t* name, grub_efi_guid_t* guid)
+{
+    struct host_var* var;
+    grub_size_t next;
+
+    if (name[0] == 0)
+        next = 0;
+    else if (host_var_next > 0 && host_var_next <= host_var_count &&
+             host_var_is(&host_vars[host_var_next - 1], name, guid))
+        next = host_var_next;
+    else
+    {
+        next = host_vars_find(name, guid);
+        if (next == host_var_count)
+            return GRUB_EFI_INVALID_PARAMETER;
+        next++;
+    }
+
+    if (next == host_var_count)
+        return GRUB_EFI_NOT_FOUND;
+    var = &host_vars[next];
+    if (*name_size < var->name_size)
+    {
+        *name_size = var->name_size;
+        return GRUB_EFI_BUFFER_TOO_SMALL;
+    }
+    grub_memcpy(name, var->name, var->name_size);
+    *name_size = var->name_size;
+    grub_memcpy(guid, &var->guid, sizeof(grub_efi_guid_t));
+    host_var_next = next + 1;
+    return GRUB_EFI_SUCCESS;
+}
+
+/* Backend over a Linux efivarfs mount, for running the commands from a live
+ * system. Each variable is a file named <Name>-<guid> holding the 4-byte
+ * attributes followed by the data. Any directory laid out the same way works,
+ * which is how the tests use it. */
+static char* efivarfs_root = NULL;
+
+/* The reverse of the kernel's efi_status_to_err. */
+static grub_efi_status_t
+efivarfs_status (int err)
+{
+    switch (err)
+    {
+    case ENOENT:
+        return GRUB_EFI_NOT_FOUND;
+    case ENOSPC:
+        return GRUB_EFI_OUT_OF_RESOURCES;
+    case EINVAL:
+        return GRUB_EFI_INVALID_PARAMETER;
+    case EROFS:
+        return GRUB_EFI_WRITE_PROTECTED;
+    case EACCES:
+        return GRUB_EFI_SECURITY_VIOLATION;
+    case EPERM:
+        return GRUB_EFI_ACCESS_DENIED;
+    case ENOMEM:
+        return GRUB_EFI_OUT_OF_RESOURCES;
+    default:
+        return GRUB_EFI_DEVICE_ERROR;
+    }
+}
+
+/* Path of the file of a variable, with the name in UTF-8, or NULL if out of
+ * memory. */
+static char*
+efivarfs_path (const grub_efi_char16_t* name, const grub_efi_guid_t* guid)
+{
+    grub_size_t root_len = grub_strlen(efivarfs_root);
+    grub_size_t len = root_len + sizeof("/-01234567-89ab-cdef-0123-456789abcdef");
+    const grub_efi_char16_t* c;
+    char* path;
+    char* p;
+
+    for (c = name; *c; ++c)
+        len += *c < 0x80 ? 1 : (*c < 0x800 ? 2 : 3);
+    path = grub_malloc(len);
+    if (!path)
+        return NULL;
+
+    grub_memcpy(path, efivarfs_root, root_len);
+    p = path + root_len;
+    *p++ = '/';
+    for (c = name; *c; ++c)
+    {
+        if (*c < 0x80)
+            *p++ = *c;
+        else if (*c < 0x800)
+        {
+            *p++ = 0xc0 | (*c >> 6);
+            *p++ = 0x80 | (*c & 0x3f);
+        }
+        else
+        {
+            *p++ = 0xe0 | (*c >> 12);
+            *p++ = 0x80 | ((*c >> 6) & 0x3f);
+            *p++ = 0x80 | (*c & 0x3f);
+        }
+    }
+    grub_snprintf(p, len - (p - path), "-%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                  guid->data1, guid->data2, guid->data3, guid->data4[0], guid->data4[1], guid->data4[2],
+                  guid->data4[3], guid->data4[4], guid->data4[5], guid->data4[6], guid->data4[7]);
+    return path;
+}
+
+/* UCS-2 form of the first len bytes of a file name, or NULL if they are empty
+ * or not UTF-8 for characters UCS-2 can hold. */
+static grub_efi_char16_t*
+efivarfs_name_from_utf8 (const char* str, grub_size_t len, grub_efi_uintn_t* name_size)
+{
+    const grub_uint8_t* p = (const grub_uint8_t*) str;
+    const grub_uint8_t* end = p + len;
+    grub_efi_char16_t* name;
+    grub_size_t count = 0;
+
+    if (!len)
+        return NULL;
+    name = grub_malloc((len + 1) * sizeof(grub_efi_char16_t));
+    if (!name)
+        return NULL;
+
+    while (p < end)
+    {
+        grub_uint32_t c = *p++;
+        int more = 0;
+
+        if (c >= 0xc0 && c < 0xe0)
+        {
+            c &= 0x1f;
+            more = 1;
+        }
+        else if (c >= 0xe0 && c < 0xf0)
+        {
+            c &= 0x0f;
+            more = 2;
+        }
+        else if (c >= 0x80)
+            break;
+        if (end - p < more)
+            break;
+        for (; more; --more, ++p)
+        {
+            if ((*p & 0xc0) != 0x80)
+                break;
+            c = (c << 6) | (*p & 0x3f);
+        }
+        if (more || c == 0)
+            break;
+        name[count++] = c;
+    }
+    if (p < end)
+    {
+        grub_free(name);
+        return NULL;
+    }
+
+    name[count++] = 0;
+    *name_size = count * sizeof(grub_efi_char16_t);
+    return name;
+}
+
+/* List the variables under the root. Files that aren't named like variables
+ * are left out. */
+static grub_efi_status_t
+efivarfs_list (void)
+{
+    struct dirent* dirent;
+    DIR* dir;
+
+    host_vars_clear();
+    host_var_names_owned = 1;
+    dir = opendir(efivarfs_root);
+    if (!dir)
+        return efivarfs_status(errno);
+
+    while ((dirent = readdir(dir)))
+    {
+        grub_size_t len = grub_strlen(dirent->d_name);
+        struct host_var var;
+
+        /* the GUID takes the last 36 characters */
+        grub_memset(&var, 0, sizeof(var));
+        if (len < 38 || dirent->d_name[len - 37] != '-' || !grub_setup_var_parse_guid(dirent->d_name + len - 36, &var.guid))
+            continue;
+        var.name = efivarfs_name_from_utf8(dirent->d_name, len - 37, &var.name_size);
+        if (!var.name)
+            continue;
+        if (host_vars_append(&var))
+        {
+            grub_free(var.name);
+            closedir(dir);
+            host_vars_clear();
+            return GRUB_EFI_OUT_OF_RESOURCES;
+        }
+    }
+    closedir(dir);
+    return GRUB_EFI_SUCCESS;
+}
+
+/* An empty name starts a walk over a fresh listing of the directory. */
+static grub_efi_status_t
+efivarfs_get_next_variable_name (grub_efi_uintn_t* name_size, grub_efi_char16_t* name, grub_efi_guid_t* guid)
+{
+    if (name[0] == 0)
+    {
+        grub_efi_status_t status = efivarfs_list();
+        if (status)
+            return status;
+    }
+    return host_vars_next(name_size, name, guid);
+}
+
+/* Read the whole file of a variable. The caller frees *contents. */
+static grub_efi_status_t
+efivarfs_read (const grub_efi_char16_t* name, const grub_efi_guid_t* guid, grub_uint8_t** contents,
+               grub_size_t* len)
+{
+    grub_efi_status_t status = GRUB_EFI_SUCCESS;
+    grub_uint8_t* buf = NULL;
+    grub_size_t capacity = 0;
+    char* path;
+    ssize_t n;
+    int fd;
+
+    path = efivarfs_path(name, guid);
+    if (!path)
+        return GRUB_EFI_OUT_OF_RESOURCES;
+    fd = open(path, O_RDONLY);
+    grub_free(path);
+    if (fd < 0)
+        return efivarfs_status(errno);
+
+    /* efivarfs files are sized by the variable, but regular files may not be
+     * what they seem, so just read to the end */
+    *len = 0;
+    while (1)
+    {
+        if (*len == capacity)
+        {
+            grub_size_t new_capacity = capacity ? capacity * 2 : 0x1000;
+            grub_uint8_t* new_buf = grub_realloc(buf, new_capacity);
+            if (!new_buf)
+            {
+                status = GRUB_EFI_OUT_OF_RESOURCES;
+                break;
+            }
+            buf = new_buf;
+            capacity = new_capacity;
+        }
+        n = read(fd, buf + *len, capacity - *len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            status = efivarfs_status(errno);
+        if (n <= 0)
+            break;
+        *len += n;
+    }
+    close(fd);
+
+    if (status)
+    {
+        grub_free(buf);
+        return status;
+    }
+    *contents = buf;
+    return GRUB_EFI_SUCCESS;
+}
+
+static grub_efi_status_t
+efivarfs_get_variable (grub_efi_char16_t* name, const grub_efi_guid_t* guid, grub_efi_uint32_t* attr,
+                       grub_efi_uintn_t* size, void* data)
+{
+    grub_efi_status_t status;
+    grub_uint8_t* contents = NULL;
+    grub_size_t len = 0;
+
+    status = efivarfs_read(name, guid, &contents, &len);
+    if (status)
+        return status;
+
+    if (len < sizeof(grub_efi_uint32_t))
+        status = GRUB_EFI_DEVICE_ERROR;
+    else
+    {
+        if (attr)
+            grub_memcpy(attr, contents, sizeof(grub_efi_uint32_t));
+        len -= sizeof(grub_efi_uint32_t);
+        if (*size < len)
+            status = GRUB_EFI_BUFFER_TOO_SMALL;
+        else
+            grub_memcpy(data, contents + sizeof(grub_efi_uint32_t), len);
+        *size = len;
+    }
+    grub_free(contents);
+    return status;
+}
+
+/* efivarfs makes the files of all but a few well-known variables immutable,
+ * so that they aren't removed by accident. Clear the flag of a file, keeping
+ * its old flags in *flags. Returns 0 if the flag wasn't the problem. */
+static int
+efivarfs_make_mutable (const char* path, int* flags)
+{
+    int new_flags;
+    int ok = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (ioctl(fd, FS_IOC_GETFLAGS, flags) == 0 && (*flags & FS_IMMUTABLE_FL))
+    {
+        new_flags = *flags & ~FS_IMMUTABLE_FL;
+        ok = ioctl(fd, FS_IOC_SETFLAGS, &new_flags) == 0;
+    }
+    close(fd);
+    return ok;
+}
+
+static void
+efivarfs_restore_flags (const char* path, int flags)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return;
+    ioctl(fd, FS_IOC_SETFLAGS, &flags);
+    close(fd);
+}
+
+/* Write a variable with one write() of the attributes and data, which is how
+ * efivarfs takes a SetVariable. A size of 0 deletes the variable. */
+static grub_efi_status_t
+efivarfs_set_variable (grub_efi_char16_t* name, const grub_efi_guid_t* guid, grub_efi_uint32_t attr,
+                       grub_efi_uintn_t size, void* data)
+{
+    grub_size_t len = sizeof(grub_efi_uint32_t) + size;
+    grub_efi_status_t status = GRUB_EFI_SUCCESS;
+    grub_uint8_t* buf = NULL;
+    struct statfs fs;
+    int mutable = 0;
+    int flags = 0;
+    char* path;
+    int fd;
+
+    path = efivarfs_path(name, guid);
+    if (!path)
+        return GRUB_EFI_OUT_OF_RESOURCES;
+
+    if (size == 0)
+    {
+        if (unlink(path) == 0)
+            goto out;
+        if (errno == EPERM && (mutable = efivarfs_make_mutable(path, &flags)) && unlink(path) == 0)
+        {
+            /* gone with its flags */
+            mutable = 0;
+            goto out;
+        }
+        status = efivarfs_status(mutable ? errno : EPERM);
+        goto out;
+    }
+
+    buf = grub_malloc(len);
+    if (!buf)
+    {
+        status = GRUB_EFI_OUT_OF_RESOURCES;
+        goto out;
+    }
+    grub_memcpy(buf, &attr, sizeof(grub_efi_uint32_t));
+    grub_memcpy(buf + sizeof(grub_efi_uint32_t), data, size);
+
+    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0 && errno == EPERM && (mutable = efivarfs_make_mutable(path, &flags)))
+        fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        status = efivarfs_status(errno);
+        goto out;
+    }
+
+    errno = 0;
+    if (write(fd, buf, len) != (ssize_t) len)
+        status = errno ? efivarfs_status(errno) : GRUB_EFI_DEVICE_ERROR;
+    /* efivarfs replaces the variable, other file systems keep a longer tail */
+    else if (fstatfs(fd, &fs) == 0 && fs.f_type != SETUP_VAR_EFIVARFS_MAGIC && ftruncate(fd, len) < 0)
+        status = efivarfs_status(errno);
+    close(fd);
+
+ out:
+    if (mutable)
+        efivarfs_restore_flags(path, flags);
+    grub_free(buf);
+    grub_free(path);
+    return status;
+}
+
+/* efivarfs reports the non-volatile store as the file system size, through
+ * the same QueryVariableInfo call. It doesn't say how large one variable may
+ * be, so the whole store is given as the limit. */
+static grub_efi_status_t
+efivarfs_query_variable_info (grub_efi_uint32_t attr, grub_efi_uint64_t* max_storage,
+                              grub_efi_uint64_t* remaining, grub_efi_uint64_t* max_size)
+{
+    struct statfs fs;
+
+    if (!(attr & GRUB_EFI_VARIABLE_NON_VOLATILE))
+        return GRUB_EFI_UNSUPPORTED;
+    if (statfs(efivarfs_root, &fs) < 0 || fs.f_type != SETUP_VAR_EFIVARFS_MAGIC || fs.f_blocks == 0)
+        return GRUB_EFI_UNSUPPORTED;
+
+    *max_storage = (grub_efi_uint64_t) fs.f_blocks * fs.f_bsize;
+    *remaining = (grub_efi_uint64_t) fs.f_bfree * fs.f_bsize;
+    *max_size = *max_storage;
+    return GRUB_EFI_SUCCESS;
+}
+
+static void
+efivarfs_close (void)
+{
+    host_vars_clear();
+    grub_free(efivarfs_root);
+    efivarfs_root = NULL;
+}
+
+static const struct setup_var_backend efivarfs_backend =
+{
+    "efivarfs",
+    efivarfs_get_next_variable_name,
+    efivarfs_get_variable,
+    efivarfs_set_variable,
+    efivarfs_query_variable_info,
+    efivarfs_close,
+};
+
+/* Backend over the variable stores in a firmware image file, e.g. a dumped
+ * SPI flash, for editing images before they are flashed. The image is mapped
+ * and the variables are patched where they are. */
+struct vss_store_header
+{
+    grub_uint8_t signature[16];
+    grub_uint32_t size;
+    grub_uint8_t format;
+    grub_uint8_t state;
+    grub_uint16_t reserved;
+    grub_uint32_t reserved1;
+} GRUB_PACKED;
+
+struct vss_old_store_header
+{
+    grub_uint32_t signature;
+    grub_uint32_t size;
+    grub_uint8_t format;
+    grub_uint8_t state;
+    grub_uint16_t reserved;
+    grub_uint32_t reserved1;
+} GRUB_PACKED;
+
+struct vss_variable_header
+{
+    grub_uint16_t start_id;
+    grub_uint8_t state;
+    grub_uint8_t reserved;
+    grub_uint32_t attr;
+    grub_uint32_t name_size;
+    grub_uint32_t data_size;
+    grub_uint8_t guid[16];
+} GRUB_PACKED;
+
+struct vss_auth_variable_header
+{
+    grub_uint16_t start_id;
+    grub_uint8_t state;
+    grub_uint8_t reserved;
+    grub_uint32_t attr;
+    grub_uint64_t monotonic_count;
+    grub_uint8_t timestamp[16];
+    grub_uint32_t pubkey_index;
+    grub_uint32_t name_size;
+    grub_uint32_t data_size;
+    grub_uint8_t guid[16];
+} GRUB_PACKED;
+
+/* A variable store found in the image. */
+struct image_store
+{
+    grub_size_t vars_start;
+    grub_size_t end;
+    int auth;
+    /* where the variables end and the erased space starts */
+    grub_size_t free;
+};
+
+static grub_uint8_t* image = NULL;
+static grub_size_t image_size = 0;
+static int image_writable = 0;
+static struct image_store* image_stores = NULL;
+static grub_size_t image_store_count = 0;
+static grub_size_t image_store_capacity = 0;
+
+/* Find the variable stores, in the order they are in the image. Stores start
+ * on 4-byte boundaries and don't overlap. */
+static grub_efi_status_t
+image_find_stores (void)
+{
+    static const grub_efi_guid_t store_guid = VSS_STORE_GUID;
+    static const grub_efi_guid_t auth_store_guid = VSS_AUTH_STORE_GUID;
+    grub_size_t offset = 0;
+
+    while (offset + sizeof(struct vss_store_header) <= image_size)
+    {
+        const struct vss_store_header* header = (const struct vss_store_header*) (image + offset);
+        const struct vss_old_store_header* old = (const struct vss_old_store_header*) (image + offset);
+        struct image_store store;
+        grub_uint32_t size = 0;
+
+        if (0 == grub_memcmp(header->signature, &store_guid, sizeof(header->signature)) ||
+            0 == grub_memcmp(header->signature, &auth_store_guid, sizeof(header->signature)))
+        {
+            size = grub_le_to_cpu32(header->size);
+            if (header->format != VSS_STORE_FORMATTED || header->state != VSS_STORE_HEALTHY ||
+                size < sizeof(*header) || size > image_size - offset)
+                size = 0;
+            store.auth = 0 == grub_memcmp(header->signature, &auth_store_guid, sizeof(header->signature));
+            store.vars_start = offset + sizeof(*header);
+        }
+        else if (grub_le_to_cpu32(old->signature) == VSS_STORE_SIGNATURE)
+        {
+            size = grub_le_to_cpu32(old->size);
+            if (old->format != VSS_STORE_FORMATTED || old->state != VSS_STORE_HEALTHY ||
+                size < sizeof(*old) || size > image_size - offset)
+                size = 0;
+            store.auth = 0;
+            store.vars_start = offset + sizeof(*old);
+        }
+        if (!size)
+        {
+            offset += 4;
+            continue;
+        }
+        store.end = offset + size;
+        store.free = store.vars_start;
+
+        if (image_store_count == image_store_capacity)
+        {
+            grub_size_t new_capacity = image_store_capacity ? image_store_capacity * 2 : 4;
+            struct image_store* new_stores = grub_realloc(image_stores, new_capacity * sizeof(*image_stores));
+            if (!new_stores)
+                return GRUB_EFI_OUT_OF_RESOURCES;
+            image_stores = new_stores;
+            image_store_capacity = new_capacity;
+        }
+        image_stores[image_store_count++] = store;
+        offset = ALIGN_UP(store.end, 4);
+    }
+    return GRUB_EFI_SUCCESS;
+}
+
+static grub_size_t
+image_header_size (const struct image_store* store)
+{
+    return store->auth ? sizeof(struct vss_auth_variable_header) : sizeof(struct vss_variable_header);
+}
+
+/* Walk one store and add the variables in it to the list. Deleted copies are
+ * skipped, and a copy caught in the middle of being replaced only counts if
+ * the new one never got written. A variable already found in an earlier
+ * store hides its copies in later ones, such as a backup of the store. */
+static grub_efi_status_t
+image_list_store (grub_size_t index)
+{
+    struct image_store* store = &image_stores[index];
+    grub_size_t offset = store->vars_start;
+    grub_size_t first = host_var_count;
+    grub_size_t in_transition = 0;
+
+    while (offset < store->end && store->end - offset >= image_header_size(store))
+    {
+        const struct vss_variable_header* header = (const struct vss_variable_header*) (image + offset);
+        const struct vss_auth_variable_header* auth = (const struct vss_auth_variable_header*) (image + offset);
+        grub_uint64_t end;
+        struct host_var var;
+
+        if (grub_le_to_cpu16(header->start_id) != VSS_START_ID)
+            break;
+        grub_memset(&var, 0, sizeof(var));
+        var.store = index;
+        var.offset = offset;
+        var.state = header->state;
+        var.attr = grub_le_to_cpu32(header->attr);
+        var.name_size = grub_le_to_cpu32(store->auth ? auth->name_size : header->name_size);
+        var.data_size = grub_le_to_cpu32(store->auth ? auth->data_size : header->data_size);
+        grub_memcpy(&var.guid, store->auth ? auth->guid : header->guid, sizeof(var.guid));
+        var.name = (grub_efi_char16_t*) (image + offset + image_header_size(store));
+        var.data_offset = offset + image_header_size(store) + var.name_size;
+
+        end = (grub_uint64_t) var.data_offset + var.data_size;
+        if (end > store->end || var.name_size < sizeof(grub_efi_char16_t) || (var.name_size & 1) ||
+            var.name[var.name_size / sizeof(grub_efi_char16_t) - 1] != 0)
+            /* a broken header, nothing after it can be trusted */
+            break;
+        offset = ALIGN_UP(end, 4);
+
+        if (var.state == (VSS_VAR_ADDED & VSS_VAR_IN_DELETED_TRANSITION))
+            in_transition++;
+        else if (var.state != VSS_VAR_ADDED)
+            continue;
+        if (host_vars_append(&var))
+            return GRUB_EFI_OUT_OF_RESOURCES;
+    }
+    store->free = grub_min(offset, store->end);
+
+    for (grub_size_t i = first; i < host_var_count;)
+    {
+        struct host_var* var = &host_vars[i];
+        grub_size_t j;
+
+        /* drop copies in transition whose replacement is there */
+        if (in_transition && var->state != VSS_VAR_ADDED)
+        {
+            in_transition--;
+            for (j = first; j < host_var_count; ++j)
+            {
+                if (host_vars[j].state == VSS_VAR_ADDED && host_var_is(&host_vars[j], var->name, &var->guid))
+                    break;
+            }
+        }
+        else
+            j = host_var_count;
+        /* and copies hidden by an earlier store */
+        if (j == host_var_count)
+        {
+            for (j = 0; j < first; ++j)
+            {
+                if (host_var_is(&host_vars[j], var->name, &var->guid))
+                    break;
+            }
+            if (j == first)
+            {
+                i++;
+                continue;
+            }
+        }
+        grub_memmove(var, var + 1, (host_var_count - i - 1) * sizeof(*var));
+        host_var_count--;
+    }
+    return GRUB_EFI_SUCCESS;
+}
+
+static grub_efi_status_t
+image_list (void)
+{
+    host_vars_clear();
+    host_var_names_owned = 0;
+    for (grub_size_t i = 0; i < image_store_count; ++i)
+    {
+        if (image_list_store(i))
+        {
+            host_vars_clear();
+            return GRUB_EFI_OUT_OF_RESOURCES;
+        }
+    }
+    return GRUB_EFI_SUCCESS;
+}
+
+static grub_efi_status_t
+image_get_next_variable_name (grub_efi_uintn_t* name_size, grub_efi_char16_t* name, grub_efi_guid_t* guid)
+{
+    return host_vars_next(name_size, name, guid);
+}
+
+static grub_efi_status_t
+image_get_variable (grub_efi_char16_t* name, const grub_efi_guid_t* guid, grub_efi_uint32_t* attr,
+                    grub_efi_uintn_t* size, void* data)
+{
+    grub_size_t i = host_vars_find(name, guid);
+    struct host_var* var;
+
+    if (i == host_var_count)
+        return GRUB_EFI_NOT_FOUND;
+    var = &host_vars[i];
+    if (attr)
+        *attr = var->attr;
+    if (*size < var->data_size)
+    {
+        *size = var->data_size;
+        return GRUB_EFI_BUFFER_TOO_SMALL;
+    }
+    /* GetVariable hands out a copy, so the commands never hold a pointer
+     * into the mapping */
+    grub_memcpy(data, image + var->data_offset, var->data_size);
+    *size = var->data_size;
+    return GRUB_EFI_SUCCESS;
+}
+
+/* Append a new copy of a variable in the erased space after the last one of
+ * a store. */
+static grub_efi_status_t
+image_append (const struct image_store* store, const grub_efi_char16_t* name, const grub_efi_guid_t* guid, grub_efi_uint32_t attr,
+              grub_efi_uintn_t size, const void* data)
+{
+    grub_uint32_t name_size = sizeof(grub_efi_char16_t);
+    grub_uint64_t total;
+    grub_uint8_t* p;
+
+    for (const grub_efi_char16_t* c = name; *c; ++c)
+        name_size += sizeof(grub_efi_char16_t);
+    total = ALIGN_UP((grub_uint64_t) image_header_size(store) + name_size + size, 4);
+    if (total > store->end - store->free)
+        return GRUB_EFI_OUT_OF_RESOURCES;
+    /* only erased flash can be written without erasing a block */
+    for (grub_size_t i = 0; i < total; ++i)
+    {
+        if (image[store->free + i] != 0xff)
+            return GRUB_EFI_OUT_OF_RESOURCES;
+    }
+
+    p = image + store->free;
+    if (store->auth)
+    {
+        struct vss_auth_variable_header header;
+
+        grub_memset(&header, 0, sizeof(header));
+        header.start_id = grub_cpu_to_le16(VSS_START_ID);
+        header.state = VSS_VAR_ADDED;
+        header.attr = grub_cpu_to_le32(attr);
+        header.name_size = grub_cpu_to_le32(name_size);
+        header.data_size = grub_cpu_to_le32(size);
+        grub_memcpy(header.guid, guid, sizeof(header.guid));
+        grub_memcpy(p, &header, sizeof(header));
+    }
+    else
+    {
+        struct vss_variable_header header;
+
+        grub_memset(&header, 0, sizeof(header));
+        header.start_id = grub_cpu_to_le16(VSS_START_ID);
+        header.state = VSS_VAR_ADDED;
+        header.attr = grub_cpu_to_le32(attr);
+        header.name_size = grub_cpu_to_le32(name_size);
+        header.data_size = grub_cpu_to_le32(size);
+        grub_memcpy(header.guid, guid, sizeof(header.guid));
+        grub_memcpy(p, &header, sizeof(header));
+    }
+    grub_memcpy(p + image_header_size(store), name, name_size);
+    grub_memcpy(p + image_header_size(store) + name_size, data, size);
+    return GRUB_EFI_SUCCESS;
+}
+
+/* A write of the same size and attributes patches the data in place. Other
+ * writes append a new copy to the store of the old one and mark the old one
+ * deleted, like the firmware does; space is not reclaimed. A new variable goes
+ * to the first store with room for it. */
+static grub_efi_status_t
+image_set_variable (grub_efi_char16_t* name, const grub_efi_guid_t* guid, grub_efi_uint32_t attr,
+                    grub_efi_uintn_t size, void* data)
+{
+    grub_size_t i = host_vars_find(name, guid);
+    struct host_var* var = i < host_var_count ? &host_vars[i] : NULL;
+    grub_efi_status_t status;
+
+    if (!image_writable)
+        return GRUB_EFI_WRITE_PROTECTED;
+    if (size == 0 && !var)
+        return GRUB_EFI_NOT_FOUND;
+    if (var && size && var->attr != attr)
+        return GRUB_EFI_INVALID_PARAMETER;
+
+    if (var && size == var->data_size)
+    {
+        grub_memcpy(image + var->data_offset, data, size);
+        return GRUB_EFI_SUCCESS;
+    }
+
+    if (size && var)
+    {
+        status = image_append(&image_stores[var->store], name, guid, attr, size, data);
+        if (status)
+            return status;
+    }
+    else if (size)
+    {
+        status = GRUB_EFI_OUT_OF_RESOURCES;
+        for (grub_size_t s = 0; s < image_store_count && status == GRUB_EFI_OUT_OF_RESOURCES; ++s)
+            status = image_append(&image_stores[s], name, guid, attr, size, data);
+        if (status)
+            return status;
+    }
+    if (var)
+        ((struct vss_variable_header*) (image + var->offset))->state &= VSS_VAR_DELETED;
+    return image_list();
+}
+
+/* There is nothing to reclaim in an image, a write either fits or fails. */
+static grub_efi_status_t
+image_query_variable_info (grub_efi_uint32_t attr __attribute__ ((unused)),
+                           grub_efi_uint64_t* max_storage __attribute__ ((unused)),
+                           grub_efi_uint64_t* remaining __attribute__ ((unused)),
+                           grub_efi_uint64_t* max_size __attribute__ ((unused)))
+{
+    return GRUB_EFI_UNSUPPORTED;
+}
+
+static void
+image_close (void)
+{
+    if (!image)
+        return;
+    if (image_writable)
+        msync(image, image_size, MS_SYNC);
+    munmap(image, image_size);
+    host_vars_clear();
+    grub_free(image_stores);
+    image_stores = NULL;
+    image_store_count = 0;
+    image_store_capacity = 0;
+    image = NULL;
+    image_size = 0;
+    image_writable = 0;
+}
+
+static const struct setup_var_backend image_backend =
+{
+    "firmware image",
+    image_get_next_variable_name,
+    image_get_variable,
+    image_set_variable,
+    image_query_variable_info,
+    image_close,
+};
+
+/* Switch the commands to the efivarfs backend on the directory root, or back
+ * to the runtime services if root is NULL. */
+grub_err_t
+grub_setup_var_use_efivarfs (const char* root)
+{
+    char* new_root = NULL;
+    struct stat st;
+
+    if (root)
+    {
+        if (stat(root, &st) < 0 || !S_ISDIR(st.st_mode))
+            return grub_error(GRUB_ERR_FILE_NOT_FOUND, "%s is not a directory of efi variables", root);
+        new_root = grub_strdup(root);
+        if (!new_root)
+            return grub_errno;
+    }
+
+    grub_setup_var_set_backend(NULL);
+    if (root)
+    {
+        efivarfs_root = new_root;
+        grub_setup_var_set_backend(&efivarfs_backend);
+    }
+    return GRUB_ERR_NONE;
+}
+
+/* Switch the commands to the variable stores in a firmware image file. The
+ * image is opened read-only if it can't be written. */
+grub_err_t
+grub_setup_var_use_image (const char* path)
+{
+    struct stat st;
+    void* map;
+    int writable = 1;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0 && (errno == EACCES || errno == EROFS))
+    {
+        writable = 0;
+        fd = open(path, O_RDONLY);
+    }
+    if (fd < 0)
+        return grub_error(GRUB_ERR_FILE_NOT_FOUND, "can't open %s", path);
+    if (fstat(fd, &st) < 0 || st.st_size <= 0)
+    {
+        close(fd);
+        return grub_error(GRUB_ERR_BAD_FILE_TYPE, "%s is empty", path);
+    }
+    map = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return grub_error(GRUB_ERR_OUT_OF_MEMORY, "can't map %s", path);
+
+    grub_setup_var_set_backend(NULL);
+    image = map;
+    image_size = st.st_size;
+    image_writable = writable;
+    if (image_find_stores())
+    {
+        image_close();
+        return grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+    }
+    if (!image_store_count)
+    {
+        image_close();
+        return grub_error(GRUB_ERR_BAD_FILE_TYPE, "no variable store found in %s", path);
+    }
+    if (image_list())
+    {
+        image_close();
+        return grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+    }
+    grub_setup_var_set_backend(&image_backend);
+    return GRUB_ERR_NONE;
+}
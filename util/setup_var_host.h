@@ -0,0 +1,14 @@
+/* setup_var_host.h - run the setup_var commands on efivarfs or on a firmware
+ *                    image file */
+#ifndef GRUB_SETUP_VAR_HOST_HEADER
+#define GRUB_SETUP_VAR_HOST_HEADER	1
+
+#include <grub/err.h>
+
+/* Run the commands on an efivarfs directory or on the variable store in a
+ * firmware image file instead of the runtime services.
+ * grub_setup_var_use_efivarfs (NULL) goes back to the runtime services. */
+grub_err_t grub_setup_var_use_efivarfs (const char* root);
+grub_err_t grub_setup_var_use_image (const char* path);
+
+#endif